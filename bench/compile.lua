@@ -0,0 +1,47 @@
+#!/usr/bin/env lua
+
+-- compares spawning threads and pool jobs from source code strings
+-- with spawning them from precompiled chunks
+
+local tlt = require( "tinylthread" )
+
+local N = tonumber( ... ) or 200
+
+-- some code that takes the parser a while
+local parts = { "local x = ...\nlocal t = {}\n" }
+for i = 1, 200 do
+  parts[ #parts+1 ] = ("t[ %d ] = function( a, b ) if a > b then return a - b else return b + a * %d end end\n"):format( i, i )
+end
+parts[ #parts+1 ] = "return x\n"
+local code = table.concat( parts )
+local chunk = tlt.compile( code )
+
+
+local function bench( name, f )
+  local t0 = tlt.clock()
+  f()
+  local dt = tlt.clock() - t0
+  print( ("%-24s %8d runs %10.3f ms %10.2f us/run"):format(
+         name, N, dt*1000, dt*1e6/N ) )
+end
+
+
+bench( "thread (source)", function()
+  for i = 1, N do tlt.thread( code, i ):join() end
+end )
+bench( "thread (chunk)", function()
+  for i = 1, N do tlt.thread( chunk, i ):join() end
+end )
+
+local pool = tlt.pool( 4 )
+bench( "pool job (source)", function()
+  local jobs = {}
+  for i = 1, N do jobs[ i ] = pool:run( code, i ) end
+  for i = 1, N do jobs[ i ]:join() end
+end )
+bench( "pool job (chunk)", function()
+  local jobs = {}
+  for i = 1, N do jobs[ i ] = pool:run( chunk, i ) end
+  for i = 1, N do jobs[ i ]:join() end
+end )
+pool:close()
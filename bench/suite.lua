@@ -0,0 +1,196 @@
+#!/usr/bin/env lua
+
+-- benchmark suite for thread creation, port handoffs, value copying
+-- and mutex contention
+--
+-- usage: lua suite.lua [--csv] [--quick] [max_threads]
+--
+-- With --csv, every measurement is printed as one line of
+-- `benchmark,parameter,metric,value,unit` (plus a header line), which
+-- is easy to collect and compare over time. --quick reduces the
+-- iteration counts (e.g. for smoke tests on CI). `luarocks test`
+-- runs the suite with --quick.
+
+local tlt = require( "tinylthread" )
+
+local csv, quick, T = false, false, 4
+for _,a in ipairs{ ... } do
+  if a == "--csv" then
+    csv = true
+  elseif a == "--quick" then
+    quick = true
+  elseif tonumber( a ) then
+    T = tonumber( a )
+  else
+    error( "unknown argument: "..a )
+  end
+end
+
+local function count( n )
+  return quick and math.max( 1, math.floor( n / 50 ) ) or n
+end
+
+
+if csv then
+  print( "benchmark,parameter,metric,value,unit" )
+end
+
+local function report( name, param, metric, value, unit )
+  if csv then
+    print( ("%s,%s,%s,%.6g,%s"):format( name, param, metric, value, unit ) )
+  else
+    print( ("%-12s %-16s %-10s %14.3f %s"):format(
+           name, param, metric, value, unit ) )
+  end
+end
+
+local function percentile( sorted, p )
+  local i = math.max( 1, math.ceil( #sorted * p / 100 ) )
+  return sorted[ i ]
+end
+
+
+-- thread spawn + join rate
+do
+  local n = count( 500 )
+  local t0 = tlt.clock()
+  for i = 1, n do
+    tlt.thread( "return ...", i ):join()
+  end
+  local dt = tlt.clock() - t0
+  report( "spawn", "thread", "rate", n/dt, "1/s" )
+  report( "spawn", "thread", "latency", dt*1e6/n, "us" )
+end
+
+
+-- round trip latency between two threads over synchronous and
+-- buffered pipes
+for _,capacity in ipairs{ 0, 16 } do
+  local n = count( 5000 )
+  local r1, w1 = tlt.pipe( capacity )
+  local r2, w2 = tlt.pipe( capacity )
+  local echo = tlt.thread( [[
+    local r, w, n = ...
+    for i = 1, n do
+      w:write( r:read() )
+    end
+  ]], r1, w2, n )
+  local samples = {}
+  local clock = tlt.clock
+  for i = 1, n do
+    local t0 = clock()
+    w1:write( i )
+    r2:read()
+    samples[ i ] = clock() - t0
+  end
+  assert( echo:join() )
+  table.sort( samples )
+  local param = "capacity="..capacity
+  for _,p in ipairs{ 50, 90, 99 } do
+    report( "pingpong", param, "p"..p, percentile( samples, p )*1e6, "us" )
+  end
+  report( "pingpong", param, "max", samples[ #samples ]*1e6, "us" )
+end
+
+
+-- throughput of one writer to many readers and many writers to one
+-- reader over a buffered pipe
+for k = 1, T do
+  if k == 1 or k == 2 or k == T or k % 4 == 0 then
+    local n = count( 20000 )
+    local per = math.floor( n / k )
+    n = per * k
+    -- fan-out
+    local r, w = tlt.pipe( 64 )
+    local threads = {}
+    local t0 = tlt.clock()
+    for i = 1, k do
+      threads[ i ] = tlt.thread( [[
+        local r, n = ...
+        for i = 1, n do r:read() end
+      ]], r, per )
+    end
+    for i = 1, n do w:write( i ) end
+    for i = 1, k do assert( threads[ i ]:join() ) end
+    report( "fanout", "readers="..k, "rate", n/(tlt.clock()-t0), "msg/s" )
+    -- fan-in
+    t0 = tlt.clock()
+    for i = 1, k do
+      threads[ i ] = tlt.thread( [[
+        local w, n = ...
+        for i = 1, n do w:write( i ) end
+      ]], w, per )
+    end
+    for i = 1, n do r:read() end
+    for i = 1, k do assert( threads[ i ]:join() ) end
+    report( "fanin", "writers="..k, "rate", n/(tlt.clock()-t0), "msg/s" )
+  end
+end
+
+
+-- cost of copying different kinds of values in and out of a
+-- buffered pipe (two copies per message, no other threads involved)
+do
+  local function numbers( n )
+    local t = {}
+    for i = 1, n do t[ i ] = i end
+    return t
+  end
+  local function nested( depth )
+    local t = { 1, "x", true }
+    for i = 1, depth do t = { t, i } end
+    return t
+  end
+  local payloads = {
+    { "nil", nil },
+    { "number", 42 },
+    { "string/16", ("x"):rep( 16 ) },
+    { "string/1k", ("x"):rep( 1024 ) },
+    { "string/64k", ("x"):rep( 65536 ) },
+    { "table/10", numbers( 10 ) },
+    { "table/1k", numbers( 1000 ) },
+    { "table/nested", nested( 20 ) },
+    { "buffer", tlt.buffer( ("x"):rep( 1024 ) ) },
+    { "array/1k", tlt.array( "double", 1000 ) },
+  }
+  local r, w = tlt.pipe( 1 )
+  for _,p in ipairs( payloads ) do
+    local n = count( p[ 1 ]:match( "64k$" ) and 500 or 5000 )
+    local v = p[ 2 ]
+    local t0 = tlt.clock()
+    for i = 1, n do
+      w:write( v )
+      r:read()
+    end
+    local dt = tlt.clock() - t0
+    report( "copy", p[ 1 ], "latency", dt*1e6/n, "us" )
+  end
+end
+
+
+-- contended lock/unlock pairs with short critical sections
+for _,mode in ipairs{ "plain", "adaptive" } do
+  for k = 1, T do
+    if k == 1 or k == 2 or k == T or k % 4 == 0 then
+      local n = count( 20000 )
+      local mutex = tlt.mutex( mode )
+      local counter = tlt.array( "int64", 1 )
+      local threads = {}
+      local t0 = tlt.clock()
+      for i = 1, k do
+        threads[ i ] = tlt.thread( [[
+          local mutex, counter, n = ...
+          for i = 1, n do
+            mutex:lock()
+            counter:set( 1, counter:get( 1 ) + 1 )
+            mutex:unlock()
+          end
+        ]], mutex, counter, n )
+      end
+      for i = 1, k do assert( threads[ i ]:join() ) end
+      local dt = tlt.clock() - t0
+      assert( counter:get( 1 ) == n*k )
+      report( "mutex", mode.."/"..k, "latency", dt*1e6/(n*k), "us" )
+    end
+  end
+end
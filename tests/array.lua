@@ -0,0 +1,42 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "creating typed arrays" )
+local a = tlt.array( "double", 1000 )
+local b = tlt.array( "double", 1000 )
+for i = 1, #a do
+  a:set( i, i )
+end
+b:fill( 1 )
+print( "", tlt.type( a ), a:type(), #a, a:get( 1 ), a:get( -1 ) )
+print( "", "sum:", a:sum(), "min:", a:min(), "max:", a:max() )
+b:axpy( 2, a )
+print( "", "after axpy:", b:get( 1 ), b:get( 1000 ), b:sum() )
+b:copy( a:sub( 1, 10 ), 991 )
+print( "", "after copy:", b:get( 990 ), b:get( 991 ), b:get( 1000 ) )
+
+
+print( "and now summing slices in parallel:" )
+local threads = {}
+for t = 1, 4 do
+  threads[ t ] = tlt.thread( [[
+    local slice = ...
+    slice:fill( 3 )
+    return slice:sum()
+  ]], a:sub( (t-1)*250+1, t*250 ) )
+end
+local total = 0
+for t = 1, 4 do
+  local _, s = threads[ t ]:join()
+  total = total + s
+end
+print( "", "sum of partial sums:", total, "sum of shared array:", a:sum() )
+
+
+print( "and now integer arrays:" )
+local c = tlt.array( "int32", 5 )
+c:fill( 7, 2, 4 )
+print( "", c:get( 1 ), c:get( 2 ), c:get( 4 ), c:get( 5 ), c:sum() )
+print( "", "out of range:", pcall( c.get, c, 6 ) )
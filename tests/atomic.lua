@@ -0,0 +1,38 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "incrementing an atomic counter from multiple threads" )
+local counter = tlt.atomic()
+local threads = {}
+for i = 1, 4 do
+  threads[ i ] = tlt.thread( [[
+    local counter = ...
+    for i = 1, 10000 do
+      counter:add( 1 )
+    end
+  ]], counter )
+end
+for i = 1, 4 do
+  threads[ i ]:join()
+end
+print( "", tlt.type( counter ), "value:", counter:load(), "expected:", 40000 )
+
+
+print( "and now the other operations:" )
+local a = tlt.atomic( 10 )
+print( "", "sub:", a:sub( 3 ), a:load() )
+print( "", "exchange:", a:exchange( 42 ), a:load() )
+print( "", "compare_exchange:", a:compare_exchange( 1, 2 ) )
+print( "", "compare_exchange:", a:compare_exchange( 42, 2 ) )
+a:store( -5 )
+print( "", "store:", a:load() )
+
+
+if math.maxinteger then
+  print( "and now wrapping around:" )
+  local w = tlt.atomic( math.maxinteger )
+  print( "", "add:", w:add( 1 ), w:load() == math.mininteger )
+  print( "", "sub:", w:sub( 1 ), w:load() == math.maxinteger )
+end
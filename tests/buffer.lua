@@ -0,0 +1,22 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "creating shared buffer" )
+local buf = tlt.buffer( ("0123456789"):rep( 100000 ) )
+print( "", "length:", #buf, buf:len() )
+print( "", "find:", buf:find( "789" ), buf:find( "x" ) )
+
+local view = buf:sub( 11, 20 )
+print( "", "view:", view:tostring(), view:byte( 1, 3 ) )
+
+local rport, wport = tlt.pipe()
+local th = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local port = ...
+  local b = port:read()
+  return tlt.type( b ), #b, b:sub( -5 ):tostring()
+]], rport )
+wport:write( buf )
+print( "", "results:", th:join() )
@@ -0,0 +1,101 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "creating buffered pipe" )
+local rport, wport = tlt.pipe( 4 )
+
+local th = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local port = ...
+  for i = 1, 10 do
+    port:write( i )
+    print( "", "sent", i )
+  end
+  port:write( { "a table", 1, true } )
+]], wport )
+wport = nil
+collectgarbage()
+
+tlt.sleep( 0.2 ) -- give the producer time to fill the buffer
+for i = 1, 10 do
+  print( "", "received", rport:read() )
+end
+local t = rport:read()
+print( "", "received", t[ 1 ], t[ 2 ], t[ 3 ] )
+print( "", "results:", th:join() )
+print( "", "reading from broken pipe:", pcall( rport.read, rport ) )
+
+
+print( "and now batch reads and writes:" )
+for _, capacity in ipairs{ 0, 8 } do
+  local rp, wp = tlt.pipe( capacity )
+  local th2 = tlt.thread( [[
+    local port = ...
+    local ok = port:write( 1, 2, 3, 4, 5 )
+    local n2 = port:writev{ "a", "b", "c" }
+    return ok, n2
+  ]], wp )
+  wp = nil
+  collectgarbage()
+  local got = 0
+  while got < 8 do
+    local t, n = rp:readall()
+    print( "", "capacity", capacity, "read", n, "values:",
+           table.concat( t, " " ) )
+    got = got + n
+  end
+  print( "", "results:", th2:join() )
+end
+
+
+print( "multiple producers and consumers on one pipe:" )
+do
+  local rp, wp = tlt.pipe( 16 )
+  local producers, consumers = {}, {}
+  for i = 1, 4 do
+    producers[ i ] = tlt.thread( [[
+      local port = ...
+      for i = 1, 1000 do port:write( i ) end
+    ]], wp )
+    consumers[ i ] = tlt.thread( [[
+      local port = ...
+      local sum = 0
+      while true do
+        local ok, v = pcall( port.read, port )
+        if not ok then return sum end
+        sum = sum + v
+      end
+    ]], rp )
+  end
+  rp, wp = nil, nil
+  collectgarbage()
+  for i = 1, 4 do producers[ i ]:join() end
+  local total = 0
+  for i = 1, 4 do
+    local _, sum = consumers[ i ]:join()
+    total = total + sum
+  end
+  print( "", "sum of all values:", total, "expected:", 4*500500 )
+end
+
+
+print( "non-blocking reads and writes:" )
+for _, capacity in ipairs{ 0, 2 } do
+  local rp, wp = tlt.pipe( capacity )
+  print( "", "capacity", capacity, "tryread:", rp:tryread() )
+  print( "", "capacity", capacity, "trywrite:", wp:trywrite( 1 ),
+         wp:trywrite( 2 ), wp:trywrite( 3 ) )
+  print( "", "capacity", capacity, "tryread:", rp:tryread() )
+end
+
+
+print( "capacities that aren't a power of two:" )
+do
+  local rp, wp = tlt.pipe( 3 )
+  print( "", "trywrite:", wp:trywrite( 1 ), wp:trywrite( 2 ),
+         wp:trywrite( 3 ), wp:trywrite( 4 ) )
+  print( "", "tryread:", rp:tryread() )
+  print( "", "trywrite:", wp:trywrite( 5 ), wp:trywrite( 6 ) )
+end
@@ -0,0 +1,62 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "starting some asynchronous computations" )
+local futures = {}
+for i = 1, 8 do
+  futures[ i ] = tlt.async( [[
+    local i = ...
+    local sum = 0
+    for j = 1, i * 100000 do sum = sum + j end
+    return i, sum
+  ]], i )
+end
+print( "", "wait_all:", tlt.wait_all( futures ) )
+for i = 1, #futures do
+  print( "", "ready:", futures[ i ]:ready(), futures[ i ]:get() )
+end
+
+
+print( "results can be fetched more than once" )
+print( "", futures[ 1 ]:get() )
+print( "", futures[ 1 ]:get() )
+
+
+print( "waiting for the first of several futures" )
+local slow = tlt.async( "require( 'tinylthread' ).sleep( 2 ) return 'slow'" )
+local fast = tlt.async( "return 'fast'" )
+local idx = tlt.wait_any( { slow, fast } )
+print( "", "first ready:", idx, select( idx, slow, fast ):get() )
+
+
+print( "getting results with a timeout" )
+print( "", slow:get( 0.01 ) )
+print( "", "wait_any:", tlt.wait_any( { slow }, 0.01 ) )
+print( "", "wait_all:", tlt.wait_all( { fast, slow }, 0.01 ) )
+
+
+print( "a future raising an error" )
+print( "", tlt.async( "error( 'argh!' )" ):get() )
+
+
+print( "another thread waiting on a future" )
+local f = tlt.async( [[
+  local slow = ...
+  return "got", slow:get()
+]], slow )
+print( "", f:get() )
+
+
+print( "dropping a future before it is done" )
+tlt.async( "require( 'tinylthread' ).sleep( 0.1 )" )
+collectgarbage()
+collectgarbage()
+tlt.sleep( 0.2 )
+
+
+print( "a future with thread options" )
+print( "", tlt.async( { "return ...", name = "async-1" }, 1, 2, 3 ):get() )
+print( "", tlt.type( f ) )
+
@@ -29,3 +29,18 @@ local th3 = tlt.thread[[
 ]]
 print( "", "results:", th3:join() )
 
+
+
+print( "and now passing nested tables:" )
+local shared = { "shared" }
+local nested = { a = { b = { c = "deep" } }, s1 = shared, s2 = shared }
+nested.self = nested
+local th4 = tlt.thread( [[
+  local t = ...
+  print( "", "nested value:", t.a.b.c )
+  print( "", "shared sub-tables:", t.s1 == t.s2, t.s1[ 1 ] )
+  print( "", "cycle preserved:", t.self == t )
+  return t
+]], nested )
+local ok, t = th4:join()
+print( "", "results:", ok, t.self == t, t.s1 == t.s2 )
@@ -0,0 +1,69 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "mapping a table in parallel" )
+local t = {}
+for i = 1, 1000 do t[ i ] = i end
+local squares = tlt.map( [[
+  local v, i = ...
+  return v * v
+]], t, { workers = 4, chunk = 16 } )
+local ok = #squares == #t
+for i = 1, #t do ok = ok and squares[ i ] == i * i end
+print( "", "results in order:", ok )
+
+
+print( "mapping with uneven work per item" )
+local r = tlt.map( [[
+  local n = ...
+  local sum = 0
+  for j = 1, n * 1000 do sum = sum + j end
+  return sum
+]], { 1, 1000, 1, 1, 2000, 1, 1, 1 }, { chunk = 1 } )
+print( "", #r, r[ 2 ], r[ 5 ] )
+
+
+print( "reducing a table" )
+print( "", tlt.reduce( "local a, b = ... return a + b", t ) )
+print( "", tlt.reduce( "local a, b = ... return a + b", t,
+                       { init = 1000, workers = 3 } ) )
+print( "", tlt.reduce( "local a, b = ... return a .. b",
+                       { "a", "b", "c", "d", "e", "f", "g" },
+                       { chunk = 2 } ) )
+
+
+print( "mapping on a pool with a prelude" )
+local pool = tlt.pool( 2, "function square( x ) return x * x end" )
+r = tlt.map( "local v = ... return square( v )", { 1, 2, 3, 4, 5 },
+             { pool = pool, chunk = 2 } )
+print( "", table.concat( r, " " ) )
+print( "", tlt.reduce( "local a, b = ... return a + b", t,
+                       { pool = pool } ) )
+pool:close()
+
+
+print( "empty input" )
+print( "", #tlt.map( "return ...", {} ) )
+print( "", tlt.reduce( "return ...", {} ) )
+print( "", tlt.reduce( "return ...", {}, { init = 42 } ) )
+
+
+print( "precompiled code and table items" )
+local chunk = tlt.compile[[
+  local p = ...
+  return p.x + p.y
+]]
+r = tlt.map( chunk, { { x = 1, y = 2 }, { x = 3, y = 4 } } )
+print( "", r[ 1 ], r[ 2 ] )
+
+
+print( "errors in the mapped function" )
+print( "", pcall( tlt.map, [[
+  local v = ...
+  if v == 500 then error( "argh!" ) end
+  return v
+]], t ) )
+print( "", pcall( tlt.map, "return ...", t, { workers = 0 } ) )
+
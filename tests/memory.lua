@@ -0,0 +1,40 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "memory usage of a thread" )
+local t = tlt.thread( [[
+  local t = {}
+  for i = 1, 100000 do t[ i ] = tostring( i ) end
+  t = nil
+  collectgarbage()
+  return "done"
+]] )
+print( "", t:join() )
+local used, peak = t:memory()
+print( "", "used:", used, "peak:", peak, "peak > used:", peak > used )
+
+
+print( "using the pool allocator" )
+t = tlt.thread( { [[
+  local t = {}
+  for i = 1, 100000 do t[ i ] = { i, tostring( i ) } end
+  local sum = 0
+  for i = 1, #t do sum = sum + t[ i ][ 1 ] end
+  return sum
+]], pool = true } )
+print( "", t:join() )
+
+
+print( "a thread exceeding its memory limit" )
+t = tlt.thread( { [[
+  local t = {}
+  for i = 1, 1e8 do t[ i ] = ("x"):rep( 100 )..i end
+]], memlimit = 4*1024*1024, pool = true } )
+print( "", t:join() )
+print( "", "peak below limit:", select( 2, t:memory() ) <= 4*1024*1024 )
+
+
+print( "a memory limit too small for the thread to start" )
+print( "", pcall( tlt.thread, { "return 1", memlimit = 1024 } ) )
@@ -0,0 +1,57 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "creating thread pool" )
+local pool = tlt.pool( 4, [[
+  -- runs once in every worker Lua state
+  function square( x )
+    return x * x
+  end
+]] )
+
+local jobs = {}
+for i = 1, 20 do
+  jobs[ i ] = pool:run( [[
+    local i = ...
+    return i, square( i )
+  ]], i )
+end
+
+for i = 1, #jobs do
+  print( "", "results:", jobs[ i ]:join() )
+end
+
+
+print( "and now a job raising an error:" )
+local job = pool:run[[
+  error( "argh!" )
+]]
+print( "", "results:", job:join() )
+
+
+print( "and now a job using a pipe:" )
+local rport, wport = tlt.pipe()
+job = pool:run( [[
+  local port = ...
+  for i = 1, 3 do
+    port:write( i )
+  end
+  return "done"
+]], wport )
+for i = 1, 3 do
+  print( "", "value:", rport:read() )
+end
+print( "", "results:", job:join() )
+
+
+print( "and now precompiled code:" )
+local chunk = tlt.compile[[
+  local a, b = ...
+  return a + b
+]]
+print( "", "thread results:", tlt.thread( chunk, 1, 2 ):join() )
+print( "", "job results:", pool:run( chunk, 3, 4 ):join() )
+
+pool:close()
@@ -0,0 +1,74 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "multiple readers at the same time" )
+local rw = tlt.rwlock()
+print( "", tlt.type( rw ), rw:rdlock(), rw:tryrdlock(), rw:trywrlock() )
+print( "", "unlock:", rw:unlock(), rw:unlock(), rw:unlock() )
+
+
+print( "a writer excludes readers and writers" )
+print( "", "wrlock:", rw:wrlock() )
+local t = tlt.thread( [[
+  local rw = ...
+  print( "", "child tryrdlock:", rw:tryrdlock() )
+  print( "", "child trywrlock:", rw:trywrlock() )
+  print( "", "child rdlock with timeout:", rw:rdlock( 0.1 ) )
+]], rw )
+t:join()
+print( "", "unlock:", rw:unlock() )
+
+
+print( "readers and writers updating a shared counter" )
+local counter = tlt.array( "int64", 1 )
+local threads = {}
+for i = 1, 4 do
+  threads[ i ] = tlt.thread( [[
+    local rw, counter, writer = ...
+    for i = 1, 1000 do
+      if writer then
+        rw:wrlock()
+        counter:set( 1, counter:get( 1 ) + 1 )
+        rw:unlock()
+      else
+        rw:rdlock()
+        local v = counter:get( 1 )
+        rw:unlock()
+      end
+    end
+  ]], rw, counter, i % 2 == 0 )
+end
+for i = 1, 4 do
+  threads[ i ]:join()
+end
+print( "", "counter:", counter:get( 1 ), "expected:", 2000 )
+
+
+print( "waiting writers have priority over new readers" )
+rw:rdlock()
+local w = tlt.thread( [[
+  local rw = ...
+  rw:wrlock()
+  print( "", "writer got the lock" )
+  rw:unlock()
+]], rw )
+tlt.sleep( 0.1 )
+print( "", "tryrdlock with waiting writer:", rw:tryrdlock() )
+rw:unlock()
+w:join()
+print( "", "tryrdlock afterwards:", rw:tryrdlock() )
+rw:unlock()
+
+
+print( "interrupting a blocked writer" )
+rw:rdlock()
+local i = tlt.thread( [[
+  local rw = ...
+  rw:wrlock()
+]], rw )
+tlt.sleep( 0.1 )
+i:interrupt()
+print( "", "join:", i:join() )
+rw:unlock()
@@ -0,0 +1,120 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+-- on Lua 5.1 tasks block their worker thread instead of yielding
+local can_yield = _VERSION ~= "Lua 5.1"
+
+
+print( "running many small tasks on a few threads" )
+local sched = tlt.scheduler( 4 )
+local results, wresults = tlt.pipe( 100 )
+for i = 1, 50 do
+  sched:spawn( [[
+    local i, port = ...
+    local sum = 0
+    for j = 1, i * 1000 do sum = sum + j end
+    port:write( sum )
+  ]], i, wresults )
+end
+print( "", "wait:", sched:wait() )
+local total = 0
+for i = 1, 50 do total = total + results:read() end
+print( "", "total:", total )
+
+
+if can_yield then
+  print( "tasks yielding on a full buffer" )
+  -- a single worker thread, so the tasks must take turns
+  local single = tlt.scheduler( 1 )
+  local rp, wp = tlt.pipe( 2 )
+  single:spawn( [[
+    local port = ...
+    for i = 1, 20 do port:write( i ) end
+  ]], wp )
+  single:spawn( [[
+    local port = ...
+    local sum = 0
+    for i = 1, 20 do sum = sum + port:read() end
+    print( "", "consumer sum:", sum )
+  ]], rp )
+  rp, wp = nil, nil
+  print( "", "close:", single:close() )
+
+
+  print( "tasks sharing a mutex" )
+  local m = tlt.mutex()
+  local counter = tlt.atomic( 0 )
+  for i = 1, 10 do
+    sched:spawn( [[
+      local m, counter = ...
+      for j = 1, 10 do
+        m:lock()
+        counter:add( 1 )
+        coroutine.yield() -- give other tasks a chance to block
+        m:unlock()
+      end
+    ]], m, counter )
+  end
+  print( "", "wait:", sched:wait(), "counter:", counter:load() )
+
+
+  print( "timeouts in tasks" )
+  local rp2, wp2 = tlt.pipe( 2 )
+  local m2 = tlt.mutex()
+  m2:lock()
+  sched:spawn( [[
+    local port, m = ...
+    port:settimeout( 0.1 )
+    print( "", "read:", port:read() )
+    print( "", "lock:", m:lock( 0.1 ) )
+  ]], rp2, m2 )
+  print( "", "wait:", sched:wait() )
+  m2:unlock()
+
+
+  print( "trylock in tasks" )
+  local m3 = tlt.mutex()
+  sched:spawn( [[
+    local m = ...
+    print( "", "trylock:", m:trylock() )
+    coroutine.yield() -- another task may run on this worker
+    m:unlock()
+    print( "", "trylock again:", m:trylock() )
+    m:unlock()
+  ]], m3 )
+  print( "", "wait:", sched:wait() )
+
+
+  print( "broken pipes in tasks" )
+  sched:spawn( [[
+    local port = ...
+    print( "", "read:", port:read() )
+    print( "", "read:", pcall( port.read, port ) )
+  ]], rp2 )
+  wp2:write( "last" )
+  rp2, wp2 = nil, nil
+  collectgarbage() -- close the pipe
+  print( "", "wait:", sched:wait() )
+end
+
+
+print( "tasks spawning more tasks" )
+sched:spawn( [[
+  local tlt = require( "tinylthread" )
+  local port = ...
+  for i = 1, 10 do
+    tlt.spawn( "local port, i = ... port:write( i * i )", port, i )
+  end
+]], wresults )
+print( "", "wait:", sched:wait() )
+total = 0
+for i = 1, 10 do total = total + results:read() end
+print( "", "sum of squares:", total )
+
+
+print( "failing tasks" )
+sched:spawn( "error( 'argh!' )" )
+sched:spawn( "error( 'argh!' )" )
+print( "", "wait:", sched:wait() )
+print( "", "close:", sched:close() )
+print( "", "type:", tlt.type( sched ) )
@@ -0,0 +1,75 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "selecting from a buffered and a synchronous pipe" )
+local rp1, wp1 = tlt.pipe( 4 )
+local rp2, wp2 = tlt.pipe()
+
+local th1 = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local p1, p2 = ...
+  for i = 1, 5 do
+    p1:write( "buffered "..i )
+    p2:write( "synchronous "..i )
+  end
+  p1, p2 = nil, nil
+  collectgarbage() -- close the pipes
+]], wp1, wp2 )
+wp1, wp2 = nil, nil
+collectgarbage()
+
+local open = { rp1, rp2 }
+while #open > 0 do
+  local i, v, extra = tlt.select( open )
+  if i then
+    print( "", "port", i, "received", v )
+  else
+    print( "", "port", extra, v )
+    table.remove( open, extra )
+  end
+end
+print( "", "results:", th1:join() )
+
+
+print( "and now with a timeout:" )
+local rp3, wp3 = tlt.pipe()
+local t0 = tlt.clock()
+print( "", "select:", tlt.select( { rp3 }, 0.2 ) )
+print( "", "waited at least 0.2 seconds:", tlt.clock() - t0 >= 0.19 )
+
+
+print( "and now waiting for a receiver:" )
+local th2 = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local port = ...
+  tlt.sleep( 0.1 )
+  return port:read()
+]], rp3 )
+print( "", "select:", tlt.select( { wp3 } ) )
+wp3:write( "hello" )
+print( "", "results:", th2:join() )
+
+
+print( "and now interrupting a thread blocked in select:" )
+local rp4, wp4 = tlt.pipe( 2 )
+local th3 = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  return tlt.select{ ... }
+]], rp4, rp3 )
+tlt.sleep( 0.1 )
+th3:interrupt()
+print( "", "results:", th3:join() )
+
+
+print( "and now with two ports that are always ready:" )
+local rp5, wp5 = tlt.pipe( 4 )
+local rp6, wp6 = tlt.pipe( 4 )
+for i = 1, 4 do
+  wp5:write( "first "..i )
+  wp6:write( "second "..i )
+end
+for i = 1, 4 do
+  print( "", "select:", tlt.select( { rp5, rp6 } ) )
+end
@@ -0,0 +1,64 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+local function show( name, stats )
+  local keys = {}
+  for k in pairs( stats ) do keys[ #keys+1 ] = k end
+  table.sort( keys )
+  io.write( "", name, ":" )
+  for _,k in ipairs( keys ) do
+    io.write( " ", k, "=", tostring( stats[ k ] ) )
+  end
+  io.write( "\n" )
+end
+
+
+print( "statistics of a contended mutex" )
+local mutex = tlt.mutex()
+mutex:lock()
+local t = tlt.thread( [[
+  local mutex = ...
+  mutex:lock()
+  mutex:unlock()
+]], mutex )
+tlt.sleep( 0.1 )
+mutex:unlock()
+t:join()
+show( "\tmutex", mutex:stats() )
+
+
+print( "statistics of a pipe" )
+local r, w = tlt.pipe()
+t = tlt.thread( [[
+  local w = ...
+  w:write( "hello", 1, 2 )
+  w:write( ("x"):rep( 100 ) )
+]], w )
+tlt.sleep( 0.1 )
+print( "", r:read( 3 ) )
+print( "", #r:read() )
+t:join()
+show( "\trport", r:stats() )
+show( "\twport", w:stats() )
+
+
+print( "statistics of an interrupted thread" )
+t = tlt.thread( [[
+  local r = ...
+  r:read()
+]], r )
+tlt.sleep( 0.1 )
+t:interrupt()
+print( "", t:join() )
+show( "\tthread", t:stats() )
+
+
+print( "global statistics" )
+show( "\tglobal", tlt.stats() )
+show( "\tdisabled", tlt.stats( false ) )
+mutex:lock()
+mutex:unlock()
+print( "", "acquisitions:", mutex:stats().acquisitions )
+tlt.stats( true )
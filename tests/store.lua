@@ -0,0 +1,48 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "basic store operations" )
+local store = tlt.store()
+store:set( "a", 1 )
+store:set( 2, { x = "y", 1, 2, 3 } )
+store:set( true, "yes" )
+print( "", tlt.type( store ), store:get( "a" ), store:get( 2 ).x,
+       #store:get( 2 ), store:get( true ), store:get( "missing" ) )
+print( "", "1 and 1.0 are the same key:", store:get( 2.0 ) ~= nil )
+print( "", "cas:", store:cas( "a", 2, 3 ), store:cas( "a", 1, 3 ),
+       store:get( "a" ) )
+print( "", "incr:", store:incr( "a" ), store:incr( "a", 10 ),
+       store:incr( "b", 0.5 ) )
+print( "", "delete:", store:delete( "a" ), store:delete( "a" ),
+       store:get( "a" ) )
+store:set( true, nil )
+print( "", "set to nil:", store:get( true ) )
+print( "", "invalid key:", pcall( store.get, store, {} ) )
+print( "", "invalid incr:", pcall( store.incr, store, 2 ) )
+print( "", "store in itself:", pcall( store.set, store, "self", store ) )
+
+
+print( "sharing handles and counting from multiple threads" )
+local rport, wport = tlt.pipe( 1 )
+store:set( "port", wport )
+local threads = {}
+for i = 1, 4 do
+  threads[ i ] = tlt.thread( [[
+    local store, i = ...
+    for j = 1, 1000 do
+      store:incr( "counter" )
+      store:incr( j % 10 )
+    end
+    if i == 1 then
+      store:get( "port" ):write( "hello from a stored port" )
+    end
+  ]], store, i )
+end
+for i = 1, 4 do
+  threads[ i ]:join()
+end
+print( "", "counter:", store:get( "counter" ), "expected:", 4000 )
+print( "", "key 7:", store:get( 7 ), "expected:", 400 )
+print( "", rport:read() )
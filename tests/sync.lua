@@ -0,0 +1,112 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "limiting concurrency with a semaphore" )
+local sem = tlt.semaphore( 2 )
+local active = tlt.atomic()
+local maximum = tlt.atomic()
+local threads = {}
+for i = 1, 6 do
+  threads[ i ] = tlt.thread( [[
+    local tlt = require( "tinylthread" )
+    local sem, active, maximum = ...
+    sem:acquire()
+    local n = active:add( 1 ) + 1
+    local m = maximum:load()
+    while n > m and not maximum:compare_exchange( m, n ) do
+      m = maximum:load()
+    end
+    tlt.sleep( 0.05 )
+    active:sub( 1 )
+    sem:release()
+  ]], sem, active, maximum )
+end
+for i = 1, 6 do
+  threads[ i ]:join()
+end
+print( "", tlt.type( sem ), "max. concurrency:", maximum:load(),
+       "count:", sem:count() )
+print( "", "tryacquire:", sem:tryacquire(), sem:tryacquire(),
+       sem:tryacquire() )
+print( "", "acquire with timeout:", sem:acquire( 0.1 ) )
+sem:release( 2 )
+
+
+print( "phases synchronized by a barrier" )
+local barrier = tlt.barrier( 3 )
+local data = tlt.array( "int32", 3 )
+for i = 1, 3 do
+  threads[ i ] = tlt.thread( [[
+    local barrier, data, i = ...
+    local serial = 0
+    for phase = 1, 5 do
+      data:set( i, phase )
+      if barrier:wait() then serial = serial + 1 end
+      -- everybody must have finished the current phase
+      assert( data:min() == phase )
+      if barrier:wait() then serial = serial + 1 end
+    end
+    return serial
+  ]], barrier, data, i )
+end
+local serial = 0
+for i = 1, 3 do
+  serial = serial + select( 2, threads[ i ]:join() )
+end
+print( "", tlt.type( barrier ), "phases:", data:get( 1 ),
+       "serial threads:", serial, "expected:", 10 )
+print( "", "wait with timeout:", tlt.barrier( 2 ):wait( 0.1 ) )
+
+
+print( "producer/consumer with mutex and condition" )
+local mutex = tlt.mutex()
+local cond = tlt.condition()
+local queue = tlt.array( "int64", 2 ) -- [1] = produced, [2] = consumed
+local consumer = tlt.thread( [[
+  local mutex, cond, queue = ...
+  local sum = 0
+  mutex:lock()
+  while queue:get( 2 ) < 100 do
+    while queue:get( 1 ) == queue:get( 2 ) do
+      cond:wait( mutex )
+    end
+    queue:set( 2, queue:get( 2 ) + 1 )
+    sum = sum + queue:get( 2 )
+  end
+  mutex:unlock()
+  return sum
+]], mutex, cond, queue )
+for i = 1, 100 do
+  mutex:lock()
+  queue:set( 1, i )
+  cond:signal()
+  mutex:unlock()
+  while queue:get( 2 ) < i do
+    tlt.sleep( 0 )
+  end
+end
+print( "", tlt.type( cond ), "sum:", select( 2, consumer:join() ),
+       "expected:", 5050 )
+mutex:lock()
+print( "", "wait with timeout:", cond:wait( mutex, 0.1 ) )
+print( "", "still locked:", mutex:unlock() )
+cond:broadcast()
+
+
+print( "interrupting blocked threads" )
+local t1 = tlt.thread( [[
+  local sem = ...
+  sem:acquire()
+]], tlt.semaphore() )
+local t2 = tlt.thread( [[
+  local mutex, cond = ...
+  mutex:lock()
+  cond:wait( mutex )
+]], mutex, cond )
+tlt.sleep( 0.1 )
+t1:interrupt()
+t2:interrupt()
+print( "", "join:", t1:join() )
+print( "", "join:", t2:join() )
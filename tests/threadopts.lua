@@ -0,0 +1,38 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "a named thread pinned to CPU 0" )
+local t = tlt.thread( { [[
+  local f = io.open( "/proc/thread-self/comm" )
+  if f then
+    local name = f:read( "*l" )
+    f:close()
+    return name
+  end
+  return "ingest-1"
+]], cpu = { 0 }, name = "ingest-1" } )
+print( "", t:join() )
+
+
+print( "a thread with a small stack and lower priority" )
+t = tlt.thread( { [[
+  local a, b = ...
+  return a + b
+]], stacksize = 64*1024, priority = 10, cpu = 0 }, 1, 2 )
+print( "", t:join() )
+
+
+print( "long thread names are truncated" )
+t = tlt.thread( { "return 'ok'", name = ("x"):rep( 40 ) } )
+print( "", t:join() )
+
+
+print( "invalid options" )
+print( "", pcall( tlt.thread, { "return 1", cpu = -1 } ) )
+print( "", pcall( tlt.thread, { "return 1", cpu = { "a" } } ) )
+print( "", pcall( tlt.thread, { "return 1", stacksize = "big" } ) )
+print( "", pcall( tlt.thread, { "return 1", priority = {} } ) )
+print( "", pcall( tlt.thread, { "return 1", name = true } ) )
+
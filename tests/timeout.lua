@@ -0,0 +1,55 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+
+print( "reading and writing with timeouts" )
+for _, capacity in ipairs{ 0, 2 } do
+  local rp, wp = tlt.pipe( capacity )
+  rp:settimeout( 0.1 )
+  wp:settimeout( 0.1 )
+  print( "", "capacity", capacity, "read:", rp:read() )
+  print( "", "capacity", capacity, "write:", wp:write( 1, 2, 3 ) )
+  rp:settimeout() -- block again
+end
+
+
+print( "and now locking a mutex with a timeout:" )
+local mtx = tlt.mutex()
+local th1 = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local mtx = ...
+  return mtx:lock( 0.1 )
+]], mtx )
+mtx:lock()
+print( "", "results:", th1:join() )
+mtx:unlock()
+
+
+print( "and now joining with a timeout:" )
+local th2 = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  tlt.sleep( 0.3 )
+  return "done"
+]] )
+print( "", "join:", th2:join( 0.1 ) )
+print( "", "join:", th2:join( 1 ) )
+
+
+print( "an infinite timeout means no timeout at all:" )
+local rp3, wp3 = tlt.pipe( 2 )
+rp3:settimeout( math.huge )
+local th3 = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local wp, mtx = ...
+  mtx:lock()
+  tlt.sleep( 0.2 )
+  wp:write( "late" )
+  tlt.sleep( 0.2 )
+  mtx:unlock()
+  return "done"
+]], wp3, mtx )
+print( "", "read:", rp3:read() )
+print( "", "lock:", mtx:lock( math.huge ) )
+mtx:unlock()
+print( "", "join:", th3:join( math.huge ) )
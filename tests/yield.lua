@@ -0,0 +1,134 @@
+#!/usr/bin/env lua
+
+local tlt = require( "tinylthread" )
+
+if _VERSION == "Lua 5.1" then
+  print( "yielding port and mutex operations need Lua 5.2 or later" )
+  return
+end
+
+
+-- a minimal dispatcher: resumes coroutines until they are done,
+-- coroutines that yielded a token only after the token is ready
+local function dispatch( ... )
+  local tasks = {}
+  for i, f in ipairs{ ... } do
+    tasks[ i ] = { co = coroutine.create( f ) }
+  end
+  while #tasks > 0 do
+    local progress = false
+    for i = #tasks, 1, -1 do
+      local t = tasks[ i ]
+      if t.token == nil or t.token:ready() then
+        local ok, token = coroutine.resume( t.co )
+        assert( ok, token )
+        progress = true
+        t.token = token
+        if coroutine.status( t.co ) == "dead" then
+          table.remove( tasks, i )
+        end
+      end
+    end
+    if not progress then
+      -- nothing to do right now: block until the first token is ready
+      tasks[ 1 ].token:wait( 0.01 )
+    end
+  end
+end
+
+
+print( "several consumers on a single thread" )
+local rp1, wp1 = tlt.pipe( 2 )
+local rp2, wp2 = tlt.pipe( 2 )
+local th = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local wp1, wp2 = ...
+  for i = 1, 5 do
+    wp1:write( "a" .. i )
+    tlt.sleep( 0.01 )
+    wp2:write( "b" .. i )
+  end
+]], wp1, wp2 )
+wp1, wp2 = nil, nil
+collectgarbage()
+local function consumer( port )
+  return function()
+    for i = 1, 5 do
+      print( "", "received", port:yread() )
+    end
+  end
+end
+dispatch( consumer( rp1 ), consumer( rp2 ) )
+print( "", "producer:", th:join() )
+
+
+print( "a producer yielding on a full buffer" )
+local rp3, wp3 = tlt.pipe( 2 )
+dispatch( function()
+  print( "", "written:", wp3:ywrite( 1, 2, 3, 4, 5 ) )
+end, function()
+  for i = 1, 5 do
+    print( "", "received", rp3:yread() )
+  end
+end )
+
+
+print( "coroutines waiting for a mutex held by another thread" )
+local m = tlt.mutex()
+local locker = tlt.thread( [[
+  local tlt = require( "tinylthread" )
+  local m = ...
+  m:lock()
+  tlt.sleep( 0.1 )
+  m:unlock()
+]], m )
+tlt.sleep( 0.05 ) -- let the other thread take the mutex
+local function worker( name )
+  return function()
+    print( "", name, "locked:", m:ylock() )
+    m:unlock()
+  end
+end
+dispatch( worker( "first" ), worker( "second" ) )
+print( "", "locker:", locker:join() )
+
+
+print( "coroutines holding a shared mutex across yields" )
+local shared = tlt.mutex()
+local inside = 0
+local function holder( name )
+  return function()
+    for i = 1, 3 do
+      shared:ylock()
+      inside = inside + 1
+      print( "", name, "holds the mutex, holders:", inside )
+      coroutine.yield() -- e.g. waiting for I/O while holding the lock
+      inside = inside - 1
+      shared:unlock()
+    end
+  end
+end
+dispatch( holder( "first" ), holder( "second" ) )
+local co = coroutine.create( function()
+  shared:ylock()
+  coroutine.yield()
+  return shared:unlock()
+end )
+coroutine.resume( co )
+print( "", "unlock by another coroutine:", coroutine.wrap( function()
+  return shared:unlock()
+end )() )
+print( "", "unlock by the holder:", coroutine.resume( co ) )
+
+
+print( "tokens can be polled directly" )
+local reader = coroutine.wrap( function() return rp3:yread() end )
+local token = reader()
+print( "", tlt.type( token ), token:ready() )
+wp3:write( "y" )
+print( "", token:ready(), reader() )
+
+
+print( "outside of a coroutine the methods block as usual" )
+wp3:ywrite( "x" )
+print( "", rp3:yread() )
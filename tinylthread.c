@@ -1,8 +1,24 @@
+/* the thread placement options need some GNU extensions on Linux */
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+#  define _GNU_SOURCE
+#endif
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <math.h>
 #include "tinylthread.h"
 
+#if defined( __linux__ ) && !defined( TLT_NO_PTHREAD_ATTRS )
+#  include <pthread.h>
+#  include <sched.h>
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  define TLT_USE_PTHREAD_ATTRS
+#endif
+
 
 
 /* compatibility for older Lua versions */
@@ -11,6 +27,10 @@
   (luaL_getmetatable( L, tn ), lua_setmetatable( L, -2 ))
 #endif
 
+#if LUA_VERSION_NUM == 501
+#  define lua_rawlen( L, i ) lua_objlen( L, i )
+#endif
+
 #if LUA_VERSION_NUM <= 502
 static int lua_isinteger( lua_State* L, int idx ) {
   if( lua_type( L, idx ) == LUA_TNUMBER ) {
@@ -79,12 +99,122 @@ static int has_uservalue( lua_State* L, int idx ) {
 #endif
 
 
+/* C functions can only yield (and continue later) since Lua 5.2 */
+#if LUA_VERSION_NUM == 502
+#  define TLT_HAVE_YIELDK
+typedef int tlt_kcontext;
+#  define TLT_KFUNCTION( _name ) \
+  static int _name##_k( lua_State* L, tlt_kcontext ctx ); \
+  static int _name( lua_State* L ) { \
+    int ctx = 0; \
+    lua_getctx( L, &ctx ); \
+    return _name##_k( L, ctx ); \
+  } \
+  static int _name##_k( lua_State* L, tlt_kcontext ctx )
+#elif LUA_VERSION_NUM >= 503
+#  define TLT_HAVE_YIELDK
+typedef lua_KContext tlt_kcontext;
+#  define TLT_KFUNCTION( _name ) \
+  static int _name##_k( lua_State* L, tlt_kcontext ctx ); \
+  static int _name( lua_State* L, int status, lua_KContext ctx ) { \
+    (void)status; \
+    return _name##_k( L, ctx ); \
+  } \
+  static int _name##_k( lua_State* L, tlt_kcontext ctx )
+#endif
+
+/* resumes a coroutine and removes the values it yields */
+static int resume_task( lua_State* co, lua_State* from, int nargs ) {
+  int status = 0;
+#if LUA_VERSION_NUM >= 504
+  int nres = 0;
+  status = lua_resume( co, from, nargs, &nres );
+  if( status == LUA_YIELD )
+    lua_pop( co, nres );
+#else
+#  if LUA_VERSION_NUM >= 502
+  status = lua_resume( co, from, nargs );
+#  else
+  (void)from;
+  status = lua_resume( co, nargs );
+#  endif
+  if( status == LUA_YIELD )
+    lua_settop( co, 0 );
+#endif
+  return status;
+}
+
+
+/* maximum number of values transferred by a single read operation */
+#ifndef TLT_BATCH_MAX
+#  define TLT_BATCH_MAX 1024
+#endif
+
+/* maximum nesting depth of tables copied between threads */
+#ifndef TLT_MAX_DEPTH
+#  define TLT_MAX_DEPTH 200
+#endif
+
+/* default number of independently locked stripes of a store */
+#ifndef TLT_STORE_STRIPES
+#  define TLT_STORE_STRIPES 16
+#endif
+
+/* upper limit for busy-wait iterations of adaptive mutexes */
+#ifndef TLT_SPIN_MAX
+#  define TLT_SPIN_MAX 200
+#endif
+
+/* number of worker threads for `map`/`reduce` if the number of CPUs
+ * is unknown */
+#ifndef TLT_MAP_WORKERS
+#  define TLT_MAP_WORKERS 4
+#endif
+
+/* hint for the CPU that we are in a spin-wait loop */
+#if defined( __GNUC__ ) && (defined( __i386__ ) || defined( __x86_64__ ))
+#  define spin_pause() __builtin_ia32_pause()
+#else
+#  define spin_pause() ((void)0)
+#endif
+
+
 static void* get_udata_from_registry( lua_State* L, char const* name ) {
   lua_getfield( L, LUA_REGISTRYINDEX, name );
   return lua_touserdata( L, -1 );
 }
 
 
+#ifdef TLT_HAVE_YIELDK
+/* returns the scheduler task if the given coroutine is one (and may
+ * yield right now) */
+static tinyltask* current_task( lua_State* L ) {
+  tinylsworker* w = get_udata_from_registry( L, TLT_THISWORKER );
+  lua_pop( L, 1 );
+  if( w == NULL || w->current == NULL || w->current->L != L )
+    return NULL;
+#if LUA_VERSION_NUM >= 503
+  if( !lua_isyieldable( L ) )
+    return NULL;
+#endif
+  return w->current;
+}
+#endif
+
+
+static void* test_udata( lua_State* L, int idx, char const* name ) {
+  void* p = lua_touserdata( L, idx );
+  if( p != NULL && lua_getmetatable( L, idx ) ) {
+    luaL_getmetatable( L, name );
+    if( !lua_rawequal( L, -1, -2 ) )
+      p = NULL;
+    lua_pop( L, 2 );
+    return p;
+  }
+  return NULL;
+}
+
+
 /* in many circumstances failure to use a synchronization primitive
  * should be fatal (i.e. raise a Lua error or even abort). */
 static void mtx_lock_or_throw( lua_State* L, mtx_t* m ) {
@@ -100,19 +230,61 @@ static void mtx_lock_or_throw( lua_State* L, mtx_t* m ) {
   } while( 0 )
 
 
+/* wakes up the thread behind a watcher and remembers which watcher
+ * it was (the mutex of the watched object must be held) */
+static void notify_watcher( tinylwatcher* w ) {
+  no_fail( mtx_lock( &(w->sel->mutex) ) );
+  w->sel->is_changed = 1;
+  if( !w->is_notified ) {
+    w->is_notified = 1;
+    w->next_notified = w->sel->notified;
+    w->sel->notified = w;
+  }
+  no_fail( cnd_signal( &(w->sel->changed) ) );
+  no_fail( mtx_unlock( &(w->sel->mutex) ) );
+}
+
+
 /* helper functions for managing the reference count of shared
- * objects */
+ * objects (lock-free if C11 atomics are available) */
+static int init_ref_count( tinylheader* ref, size_t cnt ) {
+#ifdef TLT_HAVE_ATOMICS
+  atomic_init( &(ref->cnt), cnt );
+  return 1;
+#else
+  ref->cnt = cnt;
+  return thrd_success == mtx_init( &(ref->mtx), mtx_plain );
+#endif
+}
+
+static void destroy_ref_count( tinylheader* ref ) {
+#ifdef TLT_HAVE_ATOMICS
+  (void)ref;
+#else
+  mtx_destroy( &(ref->mtx) );
+#endif
+}
+
 static void increment_ref_count( lua_State* L, tinylheader* ref ) {
+#ifdef TLT_HAVE_ATOMICS
+  atomic_fetch_add_explicit( &(ref->cnt), 1, memory_order_relaxed );
+#else
   no_fail( mtx_lock( &(ref->mtx) ) );
   ref->cnt++;
   no_fail( mtx_unlock( &(ref->mtx) ) );
+#endif
 }
 
 static size_t decrement_ref_count( lua_State* L, tinylheader* ref ) {
   size_t newcnt = 0;
+#ifdef TLT_HAVE_ATOMICS
+  newcnt = atomic_fetch_sub_explicit( &(ref->cnt), 1,
+                                      memory_order_acq_rel ) - 1;
+#else
   no_fail( mtx_lock( &(ref->mtx) ) );
   newcnt = --(ref->cnt);
   no_fail( mtx_unlock( &(ref->mtx) ) );
+#endif
   return newcnt;
 }
 
@@ -131,6 +303,48 @@ static tinylmutex* check_mutex( lua_State* L, int idx ) {
   return mutex;
 }
 
+static tinylrwlock* check_rwlock( lua_State* L, int idx ) {
+  tinylrwlock* rwlock = luaL_checkudata( L, idx, TLT_RWLOCK_NAME );
+  if( !rwlock->s )
+    luaL_error( L, "attempt to use invalid rwlock" );
+  return rwlock;
+}
+
+static tinylsemaphore* check_semaphore( lua_State* L, int idx ) {
+  tinylsemaphore* sem = luaL_checkudata( L, idx, TLT_SEM_NAME );
+  if( !sem->s )
+    luaL_error( L, "attempt to use invalid semaphore" );
+  return sem;
+}
+
+static tinylbarrier* check_barrier( lua_State* L, int idx ) {
+  tinylbarrier* barrier = luaL_checkudata( L, idx, TLT_BARRIER_NAME );
+  if( !barrier->s )
+    luaL_error( L, "attempt to use invalid barrier" );
+  return barrier;
+}
+
+static tinylcondition* check_condition( lua_State* L, int idx ) {
+  tinylcondition* cond = luaL_checkudata( L, idx, TLT_COND_NAME );
+  if( !cond->s )
+    luaL_error( L, "attempt to use invalid condition" );
+  return cond;
+}
+
+static tinylstore* check_store( lua_State* L, int idx ) {
+  tinylstore* store = luaL_checkudata( L, idx, TLT_STORE_NAME );
+  if( !store->s )
+    luaL_error( L, "attempt to use invalid store" );
+  return store;
+}
+
+static tinylatomic* check_atomic( lua_State* L, int idx ) {
+  tinylatomic* atomic = luaL_checkudata( L, idx, TLT_ATOMIC_NAME );
+  if( !atomic->s )
+    luaL_error( L, "attempt to use invalid atomic" );
+  return atomic;
+}
+
 static tinylport* check_rport( lua_State* L, int idx ) {
   tinylport* port = luaL_checkudata( L, idx, TLT_RPORT_NAME );
   if( !port->s )
@@ -145,6 +359,142 @@ static tinylport* check_wport( lua_State* L, int idx ) {
   return port;
 }
 
+static tinylbuffer* check_buffer( lua_State* L, int idx ) {
+  tinylbuffer* buffer = luaL_checkudata( L, idx, TLT_BUF_NAME );
+  if( !buffer->s )
+    luaL_error( L, "attempt to use invalid buffer" );
+  return buffer;
+}
+
+static tinylarray* check_array( lua_State* L, int idx ) {
+  tinylarray* array = luaL_checkudata( L, idx, TLT_ARRAY_NAME );
+  if( !array->s )
+    luaL_error( L, "attempt to use invalid array" );
+  return array;
+}
+
+static tinylpool* check_pool( lua_State* L, int idx ) {
+  tinylpool* pool = luaL_checkudata( L, idx, TLT_POOL_NAME );
+  if( !pool->s )
+    luaL_error( L, "attempt to use invalid pool" );
+  return pool;
+}
+
+static tinyljob* check_job( lua_State* L, int idx ) {
+  tinyljob* job = luaL_checkudata( L, idx, TLT_JOB_NAME );
+  if( !job->s )
+    luaL_error( L, "attempt to use invalid job" );
+  return job;
+}
+
+static tinylfuture* check_future( lua_State* L, int idx ) {
+  tinylfuture* future = luaL_checkudata( L, idx, TLT_FUTURE_NAME );
+  if( !future->s )
+    luaL_error( L, "attempt to use invalid future" );
+  return future;
+}
+
+
+static tinylsched* check_sched( lua_State* L, int idx ) {
+  tinylsched* sched = luaL_checkudata( L, idx, TLT_SCHED_NAME );
+  if( !sched->s )
+    luaL_error( L, "attempt to use invalid scheduler" );
+  return sched;
+}
+
+
+
+/* runtime statistics are collected using relaxed atomics, and can be
+ * switched off at load time (environment variable TINYLTHREAD_STATS=0)
+ * or via tlt.stats( false ) */
+#ifdef TLT_HAVE_ATOMICS
+#  define stat_init( _c ) atomic_init( &(_c), 0 )
+#else
+#  define stat_init( _c ) ((_c) = 0)
+#endif
+
+#ifdef TLT_HAVE_STATS
+static atomic_int stats_off;
+static atomic_flag stats_configured = ATOMIC_FLAG_INIT;
+
+static struct {
+  tinylstat threads;
+  tinylstat messages;
+  tinylstat bytes;
+  tinylstat acquisitions;
+  tinylstat contended;
+  tinylstat interrupts;
+  tinylwaitstats wait;
+} global_stats;
+
+#  define stats_on() \
+  (!atomic_load_explicit( &stats_off, memory_order_relaxed ))
+#  define stat_add( _c, _n ) \
+  ((void)atomic_fetch_add_explicit( &(_c), (_n), memory_order_relaxed ))
+#  define stat_get( _c ) \
+  atomic_load_explicit( &(_c), memory_order_relaxed )
+#  define stat_global( _g, _n ) \
+  do { \
+    if( stats_on() ) \
+      stat_add( global_stats._g, _n ); \
+  } while( 0 )
+/* counts for a single object and globally */
+#  define stat_count( _c, _g, _n ) \
+  do { \
+    if( stats_on() ) { \
+      stat_add( _c, _n ); \
+      stat_add( global_stats._g, _n ); \
+    } \
+  } while( 0 )
+
+static unsigned long long now_ns( void ) {
+  struct timespec ts;
+  if( TIME_UTC != timespec_get( &ts, TIME_UTC ) )
+    return 0;
+  return (unsigned long long)ts.tv_sec * 1000000000ULL +
+         (unsigned long long)ts.tv_nsec;
+}
+
+static unsigned long long elapsed_ns( unsigned long long t0 ) {
+  unsigned long long t1 = now_ns();
+  return t1 > t0 ? t1 - t0 : 0;
+}
+
+static void record_wait( tinylwaitstats* ws, unsigned long long ns ) {
+  unsigned long long max = stat_get( ws->max_wait_ns );
+  stat_add( ws->waits, 1 );
+  stat_add( ws->wait_ns, ns );
+  while( ns > max &&
+         !atomic_compare_exchange_weak_explicit( &(ws->max_wait_ns),
+                                                 &max, ns,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed ) )
+    ; /* retry */
+}
+#else
+#  define stats_on() 0
+#  define stat_get( _c ) 0
+#  define stat_global( _g, _n ) ((void)0)
+#  define stat_count( _c, _g, _n ) ((void)0)
+#endif
+
+static void init_wait_stats( tinylwaitstats* ws ) {
+  stat_init( ws->waits );
+  stat_init( ws->wait_ns );
+  stat_init( ws->max_wait_ns );
+}
+
+#define set_stat_field( _L, _name, _v ) \
+  (lua_pushinteger( _L, (lua_Integer)(_v) ), lua_setfield( _L, -2, _name ))
+#define set_stat_time( _L, _name, _ns ) \
+  (lua_pushnumber( _L, (lua_Number)(_ns) / 1e9 ), \
+   lua_setfield( _L, -2, _name ))
+
+static void push_wait_stats( lua_State* L, tinylwaitstats* ws ) {
+  set_stat_field( L, "waits", stat_get( ws->waits ) );
+  set_stat_time( L, "wait_time", stat_get( ws->wait_ns ) );
+  set_stat_time( L, "max_wait", stat_get( ws->max_wait_ns ) );
+}
 
 
 static int is_interrupted( tinylthread* thread, int* disabled ) {
@@ -155,10 +505,8 @@ static int is_interrupted( tinylthread* thread, int* disabled ) {
   if( thread != NULL ) {
     no_fail( mtx_lock( &(thread->s->mutex) ) );
     *disabled |= thread->s->ignore_interrupt;
-    if( thread->s->is_interrupted ) {
-      if( !*disabled )
-        v = 1;
-    }
+    if( thread->s->is_interrupted && !*disabled )
+      v = 1;
     thread->s->ignore_interrupt = 0;
     no_fail( mtx_unlock( &(thread->s->mutex) ) );
   }
@@ -166,6 +514,13 @@ static int is_interrupted( tinylthread* thread, int* disabled ) {
 }
 
 static void throw_interrupt( lua_State* L ) {
+#ifdef TLT_HAVE_STATS
+  /* count the interrupts that are actually delivered */
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_pop( L, 1 );
+  if( thread != NULL )
+    stat_count( thread->s->interrupts, interrupts, 1 );
+#endif
   get_udata_from_registry( L, TLT_INTERRUPT );
   lua_error( L );
 }
@@ -178,10 +533,77 @@ static void set_block( tinylthread* thread, tinylheader* h,
     thread->s->block.header = h;
     thread->s->block.condition = c;
     thread->s->block.mutex = m;
+#ifdef TLT_HAVE_STATS
+    /* measure how long this thread is blocked */
+    if( h != NULL )
+      thread->s->block_start = stats_on() ? now_ns() : 0;
+    else if( thread->s->block_start != 0 ) {
+      record_wait( &(thread->s->wait),
+                   elapsed_ns( thread->s->block_start ) );
+      thread->s->block_start = 0;
+    }
+#endif
     no_fail( mtx_unlock( &(thread->s->mutex) ) );
   }
 }
 
+/* for `set_block` if the object the thread waits on has no reference
+ * count (interrupts only check that the header is set) */
+static tinylheader unshared_block;
+
+
+/* largest value of a (signed, integral) time_t */
+#define TLT_TIME_MAX \
+  ((time_t)((((unsigned long long)1 << (sizeof( time_t )*CHAR_BIT-2)) \
+             - 1) * 2 + 1))
+
+/* computes the absolute time for cnd_timedwait; returns NULL (i.e.
+ * wait without a deadline) for timeouts that are too large for a
+ * time_t (including math.huge) */
+static struct timespec* make_deadline( lua_State* L,
+                                       struct timespec* ts,
+                                       lua_Number seconds ) {
+  if( TIME_UTC != timespec_get( ts, TIME_UTC ) )
+    luaL_error( L, "reading clock failed" );
+  if( !(seconds < (lua_Number)(TLT_TIME_MAX - ts->tv_sec) / 2) )
+    return NULL;
+  ts->tv_sec += (time_t)seconds;
+  ts->tv_nsec += (long)((seconds-floor(seconds))*1000000000L);
+  if( ts->tv_nsec >= 1000000000L ) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+  return ts;
+}
+
+
+/* waits on a condition variable, but only until the deadline (if
+ * any), and records the time spent waiting in the given (and the
+ * global) statistics */
+static int cnd_wait_until( cnd_t* c, mtx_t* m,
+                           struct timespec const* deadline,
+                           tinylwaitstats* ws ) {
+  int res = thrd_success;
+#ifdef TLT_HAVE_STATS
+  unsigned long long t0 = stats_on() ? now_ns() : 0;
+#endif
+  if( deadline != NULL )
+    res = cnd_timedwait( c, m, deadline );
+  else
+    res = cnd_wait( c, m );
+#ifdef TLT_HAVE_STATS
+  if( t0 != 0 ) {
+    unsigned long long dt = elapsed_ns( t0 );
+    record_wait( &(global_stats.wait), dt );
+    if( ws != NULL )
+      record_wait( ws, dt );
+  }
+#else
+  (void)ws;
+#endif
+  return res;
+}
+
 
 static int cleanup_thread( lua_State* L ) {
   int* memory_problem = lua_touserdata( L, 1 );
@@ -191,6 +613,9 @@ static int cleanup_thread( lua_State* L ) {
   if( thread != NULL &&
       thrd_success == mtx_lock( &(thread->s->mutex) ) ) {
     is_detached = thread->s->is_detached;
+    /* for joins with a timeout */
+    thread->s->is_finished = 1;
+    no_fail( cnd_broadcast( &(thread->s->finished) ) );
     no_fail( mtx_unlock( &(thread->s->mutex) ) );
   }
   lua_settop( L, 0 );
@@ -209,6 +634,8 @@ static int cleanup_thread( lua_State* L ) {
 }
 
 
+static void complete_future( lua_State* L, int status );
+
 static int tinylthread_thunk( void* arg ) {
   lua_State* L = arg;
   int memprob = 0;
@@ -220,7 +647,10 @@ static int tinylthread_thunk( void* arg ) {
   if( 0 != lua_cpcallr( L, cleanup_thread, &memprob, !!memprob ) &&
       !memprob )
     lua_pop( L, 1 ); /* pop error message if necessary */
-  return memprob ? LUA_ERRMEM : status;
+  if( memprob )
+    status = LUA_ERRMEM;
+  complete_future( L, status ); /* only for threads of tlt.async */
+  return status;
 }
 
 
@@ -248,6 +678,70 @@ static int copy_primitive( lua_State* toL, lua_State* fromL, int i ) {
   return 0;
 }
 
+/* Lua states that only hold values in transit (e.g. the results of a
+ * pool job) don't load any modules, so they get minimal proxy
+ * metatables that contain just enough to copy the userdata again and
+ * to collect it */
+static int init_slot_state( lua_State* L ) {
+  lua_pushboolean( L, 1 );
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_SLOT );
+  return 0;
+}
+
+/* Slot states are full Lua states, so creating one costs a few
+ * allocations, and values with handles need a collection to release
+ * them. Buffered pipes keep one per cell for reuse, and only for
+ * tables, functions and userdata: other values are serialized into
+ * the cell directly. */
+static lua_State* new_slot_state( void ) {
+  lua_State* L = luaL_newstate();
+  if( L != NULL && 0 != lua_cpcallr( L, init_slot_state, NULL, 0 ) ) {
+    lua_close( L );
+    L = NULL;
+  }
+  return L;
+}
+
+static int is_slot_state( lua_State* L ) {
+  int v = 0;
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_SLOT );
+  v = lua_toboolean( L, -1 );
+  lua_pop( L, 1 );
+  return v;
+}
+
+static void push_proxy_meta( lua_State* toL, lua_State* fromL, int midx,
+                             char const* name, size_t len ) {
+  lua_CFunction f = 0;
+  lua_createtable( toL, 0, 3 );
+  lua_pushlstring( toL, name, len );
+  lua_setfield( toL, -2, "__name" );
+  lua_pushliteral( fromL, "__copy@tinylthread" );
+  lua_rawget( fromL, midx );
+  lua_pushcfunction( toL, lua_tocfunction( fromL, -1 ) );
+  lua_setfield( toL, -2, "__copy@tinylthread" );
+  lua_pop( fromL, 1 );
+  /* only C functions without upvalues can be used in other states */
+  lua_pushliteral( fromL, "__gc" );
+  lua_rawget( fromL, midx );
+  f = lua_tocfunction( fromL, -1 );
+  if( f != 0 ) {
+    if( lua_getupvalue( fromL, -1, 1 ) != NULL ) {
+      lua_pop( fromL, 1 );
+      f = 0;
+    }
+  }
+  lua_pop( fromL, 1 );
+  if( f != 0 ) {
+    lua_pushcfunction( toL, f );
+    lua_setfield( toL, -2, "__gc" );
+  }
+  lua_pushlstring( toL, name, len );
+  lua_pushvalue( toL, -2 );
+  lua_rawset( toL, LUA_REGISTRYINDEX );
+}
+
+
 static int copy_udata( lua_State* toL, lua_State* fromL, int i ) {
   /* check that the userdata has `__name` and `__copy@tinylthread`
    * metafields, and that there exists a corresponding metatable
@@ -276,6 +770,11 @@ static int copy_udata( lua_State* toL, lua_State* fromL, int i ) {
           char const* name = lua_tolstring( fromL, -1, &len );
           lua_pushlstring( toL, name, len );
           lua_rawget( toL, LUA_REGISTRYINDEX );
+          if( !lua_istable( toL, -1 ) && is_slot_state( toL ) ) {
+            lua_pop( toL, 1 );
+            push_proxy_meta( toL, fromL, lua_gettop( fromL )-1,
+                             name, len );
+          }
           if( lua_istable( toL, -1 ) ) {
             int top = lua_gettop( toL );
             if( copyf( lua_touserdata( fromL, i ), toL, top ) ) {
@@ -293,27 +792,98 @@ static int copy_udata( lua_State* toL, lua_State* fromL, int i ) {
   return result;
 }
 
+typedef struct {
+  int idx;  /* stack index of the top-level value in the source */
+  int cache;  /* stack index of table of visited tables (or nil) */
+  int depth;
+} table_copy;
+
+static void copy_nested_table( lua_State* toL, lua_State* fromL, int i,
+                               table_copy* tc );
+
+static void copy_table_element( lua_State* toL, lua_State* fromL, int i,
+                                table_copy* tc ) {
+  if( !copy_primitive( toL, fromL, i ) &&
+      !copy_udata( toL, fromL, i ) ) {
+    if( lua_type( fromL, i ) == LUA_TTABLE &&
+        !lua_getmetatable( fromL, i ) )
+      copy_nested_table( toL, fromL, i, tc );
+    else
+      luaL_error( toL, "bad value #%d (unsupported type in table: '%s')",
+                  tc->idx, luaL_typename( fromL, i ) );
+  }
+}
+
+/* copies a table recursively, and a table referenced multiple times
+ * (or cyclically) is copied only once */
+static void copy_nested_table( lua_State* toL, lua_State* fromL, int i,
+                               table_copy* tc ) {
+  void* p = (void*)lua_topointer( fromL, i );
+  size_t narr = lua_rawlen( fromL, i );
+  size_t total = 0;
+  int has_tables = 0;
+  int t = 0;
+  if( lua_istable( toL, tc->cache ) ) {
+    lua_pushlightuserdata( toL, p );
+    lua_rawget( toL, tc->cache );
+    if( !lua_isnil( toL, -1 ) )
+      return;
+    lua_pop( toL, 1 );
+  }
+  if( tc->depth >= TLT_MAX_DEPTH )
+    luaL_error( toL, "bad value #%d (tables nested too deeply)", tc->idx );
+  luaL_checkstack( toL, 2*LUA_MINSTACK, "copy_nested_table" );
+  if( !lua_checkstack( fromL, LUA_MINSTACK ) )
+    luaL_error( toL, "stack overflow (copy_nested_table)" );
+  /* count the elements for pre-sizing the copy */
+  lua_pushnil( fromL );
+  while( lua_next( fromL, i ) != 0 ) {
+    total++;
+    if( lua_type( fromL, -1 ) == LUA_TTABLE ||
+        lua_type( fromL, -2 ) == LUA_TTABLE )
+      has_tables = 1;
+    lua_pop( fromL, 1 );
+  }
+  if( narr > total )
+    narr = total;
+  if( total > INT_MAX )
+    luaL_error( toL, "bad value #%d (table too large)", tc->idx );
+  lua_createtable( toL, (int)narr, (int)(total-narr) );
+  t = lua_gettop( toL );
+  if( has_tables && !lua_istable( toL, tc->cache ) ) {
+    lua_newtable( toL );
+    lua_replace( toL, tc->cache );
+  }
+  if( lua_istable( toL, tc->cache ) ) {
+    lua_pushlightuserdata( toL, p );
+    lua_pushvalue( toL, t );
+    lua_rawset( toL, tc->cache );
+  }
+  tc->depth++;
+  lua_pushnil( fromL );
+  while( lua_next( fromL, i ) != 0 ) {
+    int top = lua_gettop( fromL );
+    copy_table_element( toL, fromL, top-1, tc );
+    copy_table_element( toL, fromL, top, tc );
+    lua_rawset( toL, t );
+    lua_pop( fromL, 1 );
+  }
+  tc->depth--;
+}
+
 static int copy_table( lua_State* toL, lua_State* fromL, int i ) {
-  int top = lua_gettop( fromL );
   if( lua_type( fromL, i ) == LUA_TTABLE ) {
     if( !lua_getmetatable( fromL, i ) ) {
-      lua_newtable( toL );
-      lua_pushnil( fromL );
-      while( lua_next( fromL, i ) != 0 ) {
-        if( !copy_primitive( toL, fromL, top+1 ) ) {
-          lua_pop( fromL, 2 );
-          lua_pop( toL, 1 );
-          return 0;
-        }
-        if( !copy_primitive( toL, fromL, top+2 ) &&
-            !copy_udata( toL, fromL, top+2 ) ) {
-          lua_pop( fromL, 2 );
-          lua_pop( toL, 2 );
-          return 0;
-        }
-        lua_rawset( toL, -3 );
-        lua_pop( fromL, 1 );
-      }
+      table_copy tc;
+      if( i < 0 )
+        i = lua_gettop( fromL ) + i + 1;
+      luaL_checkstack( toL, LUA_MINSTACK, "copy_table" );
+      lua_pushnil( toL ); /* placeholder for the visited tables */
+      tc.idx = i;
+      tc.cache = lua_gettop( toL );
+      tc.depth = 0;
+      copy_nested_table( toL, fromL, i, &tc );
+      lua_remove( toL, tc.cache );
       return 1;
     } else
       lua_pop( fromL, 1 );
@@ -332,16 +902,62 @@ static void copy_value_to_thread( lua_State* toL, lua_State* fromL, int i ) {
 }
 
 
+/* code for threads and jobs can be a string or a precompiled chunk
+ * (which avoids running the parser every time) */
+static void check_code( lua_State* L, int idx ) {
+  if( lua_type( L, idx ) != LUA_TSTRING &&
+      !test_udata( L, idx, TLT_CHUNK_NAME ) )
+    luaL_argerror( L, idx, "string or chunk expected" );
+}
+
+static void load_code( lua_State* L, int idx, char const* name ) {
+  tinylchunk* chunk = test_udata( L, idx, TLT_CHUNK_NAME );
+  size_t len = 0;
+  char const* s = NULL;
+  if( chunk != NULL && chunk->s != NULL ) {
+    s = chunk->s->code;
+    len = chunk->s->len;
+  } else
+    s = lua_tolstring( L, idx, &len );
+  if( 0 != luaL_loadbuffer( L, s, len, name ) )
+    lua_error( L );
+  lua_replace( L, idx );
+}
+
+
+typedef struct {
+  lua_State* L;  /* the source Lua state */
+  int tidx;  /* stack index of source table, or 0 for stack values */
+  int first;
+  int n;
+} copy_data;
+
+/* all API calls on L are protected, but all API calls on the source
+ * Lua state are *unprotected* and could cause resource leaks if an
+ * unhandled error is thrown! */
+static int copy_values( lua_State* L ) {
+  copy_data* data = lua_touserdata( L, 1 );
+  int i = 0;
+  lua_pop( L, 1 );
+  luaL_checkstack( L, data->n+LUA_MINSTACK, "copy_values" );
+  for( i = 0; i < data->n; ++i ) {
+    if( data->tidx != 0 ) {
+      lua_rawgeti( data->L, data->tidx, data->first+i );
+      copy_value_to_thread( L, data->L, lua_gettop( data->L ) );
+      lua_pop( data->L, 1 );
+    } else
+      copy_value_to_thread( L, data->L, data->first+i );
+  }
+  return data->n;
+}
+
+
 /* all API calls on childL are protected, but all API calls on
  * parentL are *unprotected* and could cause resource leaks if
  * an unhandled error is thrown! */
-static int prepare_thread_state( lua_State* childL ) {
-  lua_State* parentL = lua_touserdata( childL, 1 );
+static void init_child_state( lua_State* childL, lua_State* parentL ) {
   size_t len = 0;
   char const* s = NULL;
-  int i = 1;
-  int top = 0;
-  lua_pop( childL, 1 );
   luaL_openlibs( childL );
   /* take package (c)path from parent thread */
   lua_getglobal( childL, "package" );
@@ -366,6 +982,14 @@ static int prepare_thread_state( lua_State* childL ) {
     luaL_error( childL, "tinylthread initialization failed" );
   lua_pushliteral( childL, "tinylthread" );
   lua_call( childL, 1, 0 );
+}
+
+static int prepare_thread_state( lua_State* childL ) {
+  lua_State* parentL = lua_touserdata( childL, 1 );
+  int i = 1;
+  int top = 0;
+  lua_pop( childL, 1 );
+  init_child_state( childL, parentL );
   /* copy arguments from the lua_State of the parent */
   top = lua_gettop( parentL );
   luaL_checkstack( childL, top+LUA_MINSTACK, "prepare_thread_state" );
@@ -374,10 +998,7 @@ static int prepare_thread_state( lua_State* childL ) {
   /* store away the child thread handle */
   lua_setfield( childL, LUA_REGISTRYINDEX, TLT_THISTHREAD );
   /* load lua code for the thread main function */
-  s = lua_tolstring( childL, 1, &len );
-  if( 0 != luaL_loadbuffer( childL, s, len, "=threadmain" ) )
-    lua_error( childL );
-  lua_replace( childL, 1 );
+  load_code( childL, 1, "=threadmain" );
   return lua_gettop( childL );
 }
 
@@ -396,16 +1017,8 @@ static int copy_stack_top( lua_State* L ) {
 }
 
 
-static int tinylthread_new_thread( lua_State* L ) {
-  tinylthread* thread = NULL;
-  thrd_start_t thunk = 0;
-  lua_State* tempL = NULL;
-  luaL_checkstring( L, 1 ); /* the Lua code */
-  thread = lua_newuserdata( L, sizeof( *thread ) );
-  thread->s = NULL;
-  thread->is_parent = 1;
-  luaL_setmetatable( L, TLT_THRD_NAME );
-  /* push package.(c)path to the stack for the child thread to copy */
+/* push package.(c)path to the stack for a child thread to copy */
+static void push_package_paths( lua_State* L ) {
   lua_getglobal( L, "package" );
   if( lua_istable( L, -1 ) ) {
     lua_getfield( L, -1, "cpath" );
@@ -415,66 +1028,402 @@ static int tinylthread_new_thread( lua_State* L ) {
     lua_pushnil( L );
   }
   lua_replace( L, -3 ); /* remove package table */
-  thread->s = malloc( sizeof( *thread->s ) );
-  if( !thread->s )
-    luaL_error( L, "memory allocation error" );
-  thread->s->block.header = NULL;
-  thread->s->block.condition = NULL;
-  thread->s->block.mutex = NULL;
-  thread->s->exit_status = 0;
-  thread->s->is_detached = 0;
-  thread->s->is_interrupted = 0;
-  thread->s->ignore_interrupt = 0;
-  thread->s->ref.cnt = 1;
-  if( thrd_success != mtx_init( &(thread->s->ref.mtx), mtx_plain ) ) {
-    free( thread->s );
-    thread->s = NULL;
-    luaL_error( L, "mutex initialization failed" );
-  }
-  if( thrd_success != mtx_init( &(thread->s->mutex), mtx_plain ) ) {
-    mtx_destroy( &(thread->s->ref.mtx ) );
-    free( thread->s );
-    thread->s = NULL;
-    luaL_error( L, "mutex initialization failed" );
-  }
-  thread->s->L = tempL = luaL_newstate();
-  if( !tempL )
-    luaL_error( L, "memory allocation error" );
-  /* prepare the Lua state for the child thread */
-  if( 0 != lua_cpcallr( thread->s->L, prepare_thread_state, L,
-                        LUA_MULTRET ) ) {
-    int r = lua_cpcallr( L, copy_stack_top, thread->s->L, 1 );
-    thread->s->L = NULL;
-    lua_close( tempL );
-    if( r != 0 )
-      lua_pushliteral( L, "thread initialization error" );
-    lua_error( L ); /* rethrow the error on this thread */
-  }
-  /* get thread main function from the child's registry (must not
-   * raise an error!) */
-  lua_getfield( thread->s->L, LUA_REGISTRYINDEX, TLT_THUNK );
-  thunk = (thrd_start_t)lua_tocfunction( thread->s->L, -1 );
-  lua_pop( thread->s->L, 1 );
-  /* lock this structure and create a C thread */
-  if( thrd_success != mtx_lock( &(thread->s->mutex) ) ) {
-    thread->s->L = NULL;
-    lua_close( tempL );
-    luaL_error( L, "locking mutex failed" );
-  }
-  if( thrd_success !=
-      thrd_create( &(thread->s->thread), thunk, thread->s->L ) ) {
-    no_fail( mtx_unlock( &(thread->s->mutex) ) );
-    thread->s->L = NULL;
-    lua_close( tempL );
-    luaL_error( L, "thread spawning failed" );
-  }
-  no_fail( mtx_unlock( &(thread->s->mutex) ) );
-  return 1;
 }
 
 
-static int tinylthread_copy( void* p, lua_State* L, int midx ) {
-  tinylthread* thread = p;
+/* per-thread allocator for Lua states of threads (see tinylalloc);
+ * it tracks the memory usage, enforces an optional limit, and
+ * optionally recycles small blocks via size class free lists */
+#ifdef TLT_HAVE_ATOMICS
+#  define count_get( _c ) atomic_load_explicit( &(_c), memory_order_relaxed )
+#  define count_set( _c, _v ) \
+  atomic_store_explicit( &(_c), (_v), memory_order_relaxed )
+#else
+#  define count_get( _c ) (_c)
+#  define count_set( _c, _v ) ((_c) = (_v))
+#endif
+
+#define POOL_MAX  (TLT_POOL_CLASSES*TLT_POOL_GRANULE)
+#define pool_class( _n )  (((_n)-1) / TLT_POOL_GRANULE)
+
+static void init_alloc( tinylalloc* a, size_t limit, int use_pool ) {
+  size_t i = 0;
+  stat_init( a->used );
+  stat_init( a->peak );
+  a->limit = limit;
+  a->use_pool = use_pool;
+  for( i = 0; i < TLT_POOL_CLASSES; ++i )
+    a->free[ i ] = NULL;
+  a->arenas = NULL;
+  a->next = a->end = NULL;
+}
+
+/* releases the arenas once the Lua state has been closed */
+static void destroy_alloc( tinylalloc* a ) {
+  size_t i = 0;
+  while( a->arenas != NULL ) {
+    tinylarena* next = a->arenas->next;
+    free( a->arenas );
+    a->arenas = next;
+  }
+  for( i = 0; i < TLT_POOL_CLASSES; ++i )
+    a->free[ i ] = NULL;
+  a->next = a->end = NULL;
+}
+
+static void* pool_get( tinylalloc* a, size_t cls ) {
+  size_t size = (cls+1) * TLT_POOL_GRANULE;
+  void* p = a->free[ cls ];
+  if( p != NULL ) {
+    a->free[ cls ] = *(void**)p;
+    return p;
+  }
+  if( (size_t)(a->end - a->next) < size ) {
+    /* the first granule of an arena holds the link to the next one,
+     * so that all blocks stay suitably aligned */
+    tinylarena* arena = malloc( TLT_POOL_ARENA );
+    if( arena == NULL )
+      return NULL;
+    arena->next = a->arenas;
+    a->arenas = arena;
+    a->next = (char*)arena + TLT_POOL_GRANULE;
+    a->end = (char*)arena + TLT_POOL_ARENA;
+  }
+  p = a->next;
+  a->next += size;
+  return p;
+}
+
+static void pool_put( tinylalloc* a, void* p, size_t cls ) {
+  *(void**)p = a->free[ cls ];
+  a->free[ cls ] = p;
+}
+
+static void* thread_alloc( void* ud, void* ptr, size_t osize,
+                           size_t nsize ) {
+  tinylalloc* a = ud;
+  size_t used = count_get( a->used );
+  int osmall = 0;
+  int nsmall = 0;
+  void* p = NULL;
+  if( ptr == NULL )
+    osize = 0; /* Lua 5.2+ passes the type of new objects here */
+  if( nsize > osize && a->limit > 0 &&
+      (used >= a->limit || nsize - osize > a->limit - used) )
+    return NULL;
+  osmall = a->use_pool && osize > 0 && osize <= POOL_MAX;
+  nsmall = a->use_pool && nsize > 0 && nsize <= POOL_MAX;
+  if( nsize == 0 ) {
+    if( osmall )
+      pool_put( a, ptr, pool_class( osize ) );
+    else
+      free( ptr );
+  } else if( !osmall && !nsmall ) {
+    p = realloc( ptr, nsize );
+    if( p == NULL ) {
+      if( nsize > osize )
+        return NULL;
+      p = ptr; /* Lua assumes that shrinking never fails */
+    }
+  } else if( osmall && nsmall &&
+             pool_class( osize ) == pool_class( nsize ) ) {
+    p = ptr;
+  } else {
+    p = nsmall ? pool_get( a, pool_class( nsize ) ) : malloc( nsize );
+    if( p == NULL ) {
+      if( nsize > osize )
+        return NULL;
+      /* keep the bigger block when shrinking; this can only happen
+       * if the system is out of memory, and in the worst case a
+       * malloc'ed block ends up in a free list */
+      p = ptr;
+    } else if( ptr != NULL ) {
+      memcpy( p, ptr, osize < nsize ? osize : nsize );
+      if( osmall )
+        pool_put( a, ptr, pool_class( osize ) );
+      else
+        free( ptr );
+    }
+  }
+  used = used - osize + nsize;
+  count_set( a->used, used );
+  if( used > count_get( a->peak ) )
+    count_set( a->peak, used );
+  return p;
+}
+
+#undef POOL_MAX
+#undef pool_class
+
+static int thread_panic( lua_State* L ) {
+  fprintf( stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+           lua_tostring( L, -1 ) );
+  fflush( stderr );
+  return 0;
+}
+
+
+typedef struct {
+  size_t memlimit;
+  int pool;
+  size_t stacksize;  /* 0 means platform default */
+  tinylattrs attrs;
+#ifdef TLT_USE_PTHREAD_ATTRS
+  cpu_set_t cpus;
+  char has_cpus;
+#endif
+} thread_options;
+
+static lua_Number opt_number( lua_State* L, char const* name,
+                              lua_Number def, lua_Number min ) {
+  lua_Number n = def;
+  lua_getfield( L, 1, name );
+  if( !lua_isnil( L, -1 ) ) {
+    n = lua_tonumber( L, -1 );
+    if( lua_type( L, -1 ) != LUA_TNUMBER || n < min )
+      luaL_error( L, "bad '%s' option (number >= %d expected)",
+                  name, (int)min );
+  }
+  lua_pop( L, 1 );
+  return n;
+}
+
+static void opt_cpu( lua_State* L, thread_options* opts, int idx ) {
+  lua_Number n = lua_tonumber( L, idx );
+  if( lua_type( L, idx ) != LUA_TNUMBER || n < 0 )
+    luaL_error( L, "bad 'cpu' option (CPU index expected)" );
+#ifdef TLT_USE_PTHREAD_ATTRS
+  if( n >= CPU_SETSIZE )
+    luaL_error( L, "bad 'cpu' option (CPU index too large)" );
+  CPU_SET( (int)n, &(opts->cpus) );
+  opts->has_cpus = 1;
+#else
+  (void)opts;
+#endif
+}
+
+/* tlt.thread accepts the code either directly or at index 1 of a
+ * table with additional options; the placement options (cpu,
+ * stacksize, priority, name) are ignored on platforms that don't
+ * support them */
+static void get_thread_options( lua_State* L, thread_options* opts ) {
+  memset( opts, 0, sizeof( *opts ) );
+#ifdef TLT_USE_PTHREAD_ATTRS
+  CPU_ZERO( &(opts->cpus) );
+#endif
+  if( lua_type( L, 1 ) == LUA_TTABLE ) {
+    lua_Number n = opt_number( L, "memlimit", 0, 0 );
+    opts->memlimit = n >= (lua_Number)((size_t)-1) ? 0 : (size_t)n;
+    n = opt_number( L, "stacksize", 0, 0 );
+    opts->stacksize = n >= (lua_Number)((size_t)-1) ? 0 : (size_t)n;
+    lua_getfield( L, 1, "pool" );
+    opts->pool = lua_toboolean( L, -1 );
+    lua_getfield( L, 1, "priority" );
+    if( !lua_isnil( L, -1 ) ) {
+      if( lua_type( L, -1 ) != LUA_TNUMBER )
+        luaL_error( L, "bad 'priority' option (number expected)" );
+      opts->attrs.priority = (int)lua_tointeger( L, -1 );
+      opts->attrs.has_priority = 1;
+    }
+    lua_getfield( L, 1, "name" );
+    if( !lua_isnil( L, -1 ) ) {
+      size_t len = 0;
+      char const* name = NULL;
+      if( lua_type( L, -1 ) != LUA_TSTRING )
+        luaL_error( L, "bad 'name' option (string expected)" );
+      name = lua_tolstring( L, -1, &len );
+      if( len >= sizeof( opts->attrs.name ) )
+        len = sizeof( opts->attrs.name )-1;
+      memcpy( opts->attrs.name, name, len );
+      opts->attrs.name[ len ] = '\0';
+    }
+    lua_getfield( L, 1, "cpu" );
+    if( lua_type( L, -1 ) == LUA_TTABLE ) {
+      size_t i = 1;
+      size_t len = lua_rawlen( L, -1 );
+      for( i = 1; i <= len; ++i ) {
+        lua_rawgeti( L, -1, (int)i );
+        opt_cpu( L, opts, -1 );
+        lua_pop( L, 1 );
+      }
+    } else if( !lua_isnil( L, -1 ) )
+      opt_cpu( L, opts, -1 );
+    lua_pop( L, 4 );
+#ifdef TLT_USE_PTHREAD_ATTRS
+    opts->attrs.use_pthread = opts->stacksize > 0 || opts->has_cpus ||
+                              opts->attrs.has_priority ||
+                              opts->attrs.name[ 0 ] != '\0';
+#endif
+    lua_rawgeti( L, 1, 1 );
+    lua_replace( L, 1 );
+  }
+  check_code( L, 1 );
+}
+
+
+#ifdef TLT_USE_PTHREAD_ATTRS
+/* C11 threads can't be created with attributes, so threads with
+ * placement options are created via pthreads; thrd_t is a pthread_t
+ * on Linux (for glibc, musl, and tinycthread), and because this
+ * function returns NULL, thrd_join works as usual (the exit status
+ * is passed via the shared thread data instead) */
+typedef char tlt_check_thrd_t[ sizeof( thrd_t ) == sizeof( pthread_t ) ?
+                               1 : -1 ];
+
+static void* pthread_thunk( void* arg ) {
+  tinylthread_shared* s = arg;
+  if( s->attrs.name[ 0 ] != '\0' )
+    (void)pthread_setname_np( pthread_self(), s->attrs.name );
+  /* a higher priority (= lower nice value) may need privileges, so
+   * failures are ignored */
+  if( s->attrs.has_priority )
+    (void)setpriority( PRIO_PROCESS, (id_t)syscall( SYS_gettid ),
+                       s->attrs.priority );
+  s->exit_status = s->attrs.thunk( s->L );
+  return NULL;
+}
+#endif
+
+static int spawn_thread( tinylthread_shared* s, thrd_start_t thunk,
+                         thread_options const* opts ) {
+#ifdef TLT_USE_PTHREAD_ATTRS
+  if( s->attrs.use_pthread ) {
+    pthread_attr_t attr;
+    pthread_t tid;
+    size_t stacksize = opts->stacksize;
+    int ok = 0;
+    if( 0 != pthread_attr_init( &attr ) )
+      return 0;
+    s->attrs.thunk = thunk;
+    if( stacksize > 0 && stacksize < (size_t)PTHREAD_STACK_MIN )
+      stacksize = PTHREAD_STACK_MIN;
+    ok = (stacksize == 0 ||
+          0 == pthread_attr_setstacksize( &attr, stacksize )) &&
+         (!opts->has_cpus ||
+          0 == pthread_attr_setaffinity_np( &attr, sizeof( cpu_set_t ),
+                                            &(opts->cpus) )) &&
+         0 == pthread_create( &tid, &attr, pthread_thunk, s );
+    pthread_attr_destroy( &attr );
+    if( ok )
+      memcpy( &(s->thread), &tid, sizeof( tid ) );
+    return ok;
+  }
+#else
+  (void)opts;
+#endif
+  return thrd_success == thrd_create( &(s->thread), thunk, s->L );
+}
+
+
+/* spawns a new thread, the results are passed via the given future
+ * if it isn't NULL (see tlt.async) */
+static int new_thread( lua_State* L, tinylfuture_shared* future ) {
+  tinylthread* thread = NULL;
+  thrd_start_t thunk = 0;
+  lua_State* tempL = NULL;
+  thread_options opts;
+  get_thread_options( L, &opts );
+  thread = lua_newuserdata( L, sizeof( *thread ) );
+  thread->s = NULL;
+  thread->is_parent = 1;
+  luaL_setmetatable( L, TLT_THRD_NAME );
+  push_package_paths( L );
+  thread->s = malloc( sizeof( *thread->s ) );
+  if( !thread->s )
+    luaL_error( L, "memory allocation error" );
+  thread->s->block.header = NULL;
+  thread->s->block.condition = NULL;
+  thread->s->block.mutex = NULL;
+  thread->s->exit_status = 0;
+  thread->s->is_detached = 0;
+  thread->s->is_finished = 0;
+  thread->s->is_interrupted = 0;
+  thread->s->ignore_interrupt = 0;
+  thread->s->block_start = 0;
+  init_alloc( &(thread->s->alloc), opts.memlimit, opts.pool );
+  thread->s->attrs = opts.attrs;
+  thread->s->future = NULL;
+  stat_init( thread->s->interrupts );
+  init_wait_stats( &(thread->s->wait) );
+  if( !init_ref_count( &(thread->s->ref), 1 ) ) {
+    free( thread->s );
+    thread->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(thread->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(thread->s->ref) );
+    free( thread->s );
+    thread->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(thread->s->finished) ) ) {
+    destroy_ref_count( &(thread->s->ref) );
+    mtx_destroy( &(thread->s->mutex) );
+    free( thread->s );
+    thread->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  thread->s->L = tempL = lua_newstate( thread_alloc,
+                                       &(thread->s->alloc) );
+  if( !tempL )
+    luaL_error( L, "memory allocation error" );
+  lua_atpanic( tempL, thread_panic );
+  /* prepare the Lua state for the child thread */
+  if( 0 != lua_cpcallr( thread->s->L, prepare_thread_state, L,
+                        LUA_MULTRET ) ) {
+    int r = lua_cpcallr( L, copy_stack_top, thread->s->L, 1 );
+    thread->s->L = NULL;
+    lua_close( tempL );
+    destroy_alloc( &(thread->s->alloc) );
+    if( r != 0 )
+      lua_pushliteral( L, "thread initialization error" );
+    lua_error( L ); /* rethrow the error on this thread */
+  }
+  /* get thread main function from the child's registry (must not
+   * raise an error!) */
+  lua_getfield( thread->s->L, LUA_REGISTRYINDEX, TLT_THUNK );
+  thunk = (thrd_start_t)lua_tocfunction( thread->s->L, -1 );
+  lua_pop( thread->s->L, 1 );
+  /* lock this structure and create a C thread */
+  if( thrd_success != mtx_lock( &(thread->s->mutex) ) ) {
+    thread->s->L = NULL;
+    lua_close( tempL );
+    destroy_alloc( &(thread->s->alloc) );
+    luaL_error( L, "locking mutex failed" );
+  }
+  if( future != NULL ) {
+    /* the thread and the future reference each other until the
+     * thread has completed the future */
+    increment_ref_count( L, &(future->ref) );
+    increment_ref_count( L, &(thread->s->ref) );
+    thread->s->future = future;
+    future->thread = thread->s;
+  }
+  if( !spawn_thread( thread->s, thunk, &opts ) ) {
+    if( future != NULL ) {
+      thread->s->future = NULL;
+      future->thread = NULL;
+      decrement_ref_count( L, &(future->ref) );
+      decrement_ref_count( L, &(thread->s->ref) );
+    }
+    no_fail( mtx_unlock( &(thread->s->mutex) ) );
+    thread->s->L = NULL;
+    lua_close( tempL );
+    destroy_alloc( &(thread->s->alloc) );
+    luaL_error( L, "thread spawning failed" );
+  }
+  no_fail( mtx_unlock( &(thread->s->mutex) ) );
+  stat_global( threads, 1 );
+  return 1;
+}
+
+static int tinylthread_new_thread( lua_State* L ) {
+  return new_thread( L, NULL );
+}
+
+
+static int tinylthread_copy( void* p, lua_State* L, int midx ) {
+  tinylthread* thread = p;
   tinylthread* copy = lua_newuserdata( L, sizeof( *copy ) );
   copy->s = NULL;
   copy->is_parent = 0;
@@ -498,8 +1447,10 @@ static int tinylthread_gc( lua_State* L ) {
       no_fail( mtx_unlock( &(thread->s->mutex) ) );
     }
     if( 0 == decrement_ref_count( L, &(thread->s->ref) ) ) {
-      mtx_destroy( &(thread->s->ref.mtx) );
+      destroy_ref_count( &(thread->s->ref) );
       mtx_destroy( &(thread->s->mutex) );
+      cnd_destroy( &(thread->s->finished) );
+      destroy_alloc( &(thread->s->alloc) );
       free( thread->s );
       thread->s = NULL;
     }
@@ -560,9 +1511,11 @@ static int copy_return_values( lua_State* L ) {
 
 static int tinylthread_join( lua_State* L ) {
   tinylthread* thread = check_thread( L, 1 );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
   int is_detached = 0;
   int is_joined = 0;
   join_data data = { 0, NULL };
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
   if( !thread->is_parent )
     luaL_error( L, "join attempt from non-parent thread" );
   mtx_lock_or_throw( L, &(thread->s->mutex) );
@@ -573,71 +1526,141 @@ static int tinylthread_join( lua_State* L ) {
     luaL_error( L, "attempt to join an already detached thread" );
   if( is_joined )
     luaL_error( L, "attempt to join an already joined thread" );
+  if( !lua_isnoneornil( L, 2 ) ) {
+    /* thrd_join can't time out, so wait until the thread is about
+     * to finish first */
+    struct timespec deadline;
+    struct timespec* dl = make_deadline( L, &deadline, timeout );
+    tinylthread* self = get_udata_from_registry( L, TLT_THISTHREAD );
+    int res = thrd_success;
+    int is_finished = 0;
+    int itr = 0;
+    int disabled = 0;
+    mtx_lock_or_throw( L, &(thread->s->mutex) );
+    while( !(itr=is_interrupted( self, &disabled )) &&
+           !thread->s->is_finished && res != thrd_timedout ) {
+      set_block( self, &(thread->s->ref), &(thread->s->finished),
+                 &(thread->s->mutex) );
+      if( dl != NULL )
+        res = cnd_timedwait( &(thread->s->finished),
+                             &(thread->s->mutex), dl );
+      else
+        res = cnd_wait( &(thread->s->finished), &(thread->s->mutex) );
+      set_block( self, NULL, NULL, NULL );
+      if( res != thrd_success && res != thrd_timedout ) {
+        no_fail( mtx_unlock( &(thread->s->mutex) ) );
+        luaL_error( L, "waiting for thread failed" );
+      }
+    }
+    is_finished = thread->s->is_finished;
+    no_fail( mtx_unlock( &(thread->s->mutex) ) );
+    if( itr ) /* handle interrupt request */
+      throw_interrupt( L );
+    if( !is_finished ) {
+      lua_pushnil( L );
+      lua_pushliteral( L, "timeout" );
+      return 2;
+    }
+  }
   if( thrd_success != thrd_join( thread->s->thread, &(data.status) ) )
     luaL_error( L, "joining thread failed" );
+  if( thread->s->attrs.use_pthread )
+    data.status = thread->s->exit_status;
   no_fail( mtx_lock( &(thread->s->mutex) ) );
   data.L = thread->s->L;
   thread->s->L = NULL;
   no_fail( mtx_unlock( &(thread->s->mutex) ) );
-  lua_settop( L, 0 );
+  /* keep the thread handle on the stack: it owns the allocator that
+   * lua_close still needs */
+  lua_settop( L, 1 );
   if( 0 != lua_cpcallr( L, copy_return_values, &data, LUA_MULTRET ) ) {
     lua_close( data.L );
+    destroy_alloc( &(thread->s->alloc) );
     lua_error( L );
   }
   lua_close( data.L );
-  return lua_gettop( L );
+  destroy_alloc( &(thread->s->alloc) );
+  return lua_gettop( L )-1;
 }
 
 
 static int tinylthread_interrupt( lua_State* L ) {
   tinylthread* thread = check_thread( L, 1 );
-  tinylblock block;
   no_fail( mtx_lock( &(thread->s->mutex) ) );
   thread->s->is_interrupted = 1;
-  block = thread->s->block;
-  if( block.header ) {
-    /* prevent structure containing block from disappearing */
-    no_fail( mtx_lock( &(block.header->mtx) ) );
-    /* we must release the thread mutex anyway to avoid a deadlock
-     * when acquiring the block mutex */
-    no_fail( mtx_unlock( &(thread->s->mutex) ) );
-    /* acquire the lock for the condition variable to make sure that
-     * the thread is actually waiting on it! */
-    no_fail( mtx_lock( block.mutex ) );
-    /* wake up the thread */
-    no_fail( cnd_broadcast( block.condition ) );
-    no_fail( mtx_unlock( block.mutex ) );
-    no_fail( mtx_unlock( &(block.header->mtx) ) );
-  } else
+  /* as long as we hold the thread mutex, the blocked thread can't
+   * unregister its block and release the object it waits on. But
+   * it might hold the block mutex while waiting for the thread
+   * mutex, so back off instead of deadlocking. */
+  while( thread->s->block.header != NULL &&
+         thrd_success != mtx_trylock( thread->s->block.mutex ) ) {
     no_fail( mtx_unlock( &(thread->s->mutex) ) );
+    thrd_yield();
+    no_fail( mtx_lock( &(thread->s->mutex) ) );
+  }
+  if( thread->s->block.header != NULL ) {
+    /* we hold the block mutex, so the thread is actually waiting on
+     * the condition variable: wake it up */
+    no_fail( cnd_broadcast( thread->s->block.condition ) );
+    no_fail( mtx_unlock( thread->s->block.mutex ) );
+  }
+  no_fail( mtx_unlock( &(thread->s->mutex) ) );
   return 0;
 }
 
 
+/* returns the current and the peak memory usage of the thread's Lua
+ * state (in bytes) */
+static int tinylthread_memory( lua_State* L ) {
+  tinylthread* thread = check_thread( L, 1 );
+  lua_pushnumber( L, (lua_Number)count_get( thread->s->alloc.used ) );
+  lua_pushnumber( L, (lua_Number)count_get( thread->s->alloc.peak ) );
+  return 2;
+}
+
+
+static int tinylthread_stats( lua_State* L ) {
+  tinylthread* thread = check_thread( L, 1 );
+  lua_createtable( L, 0, 4 );
+  set_stat_field( L, "interrupts", stat_get( thread->s->interrupts ) );
+  push_wait_stats( L, &(thread->s->wait) );
+  return 1;
+}
+
+
 
 static int tinylthread_new_mutex( lua_State* L ) {
+  static char const* const modes[] = { "plain", "adaptive", NULL };
+  int adaptive = luaL_checkoption( L, 1, "plain", modes );
   tinylmutex* mutex = lua_newuserdata( L, sizeof( *mutex ) );
   mutex->s = NULL;
+  mutex->holder = NULL;
   mutex->is_owner = 0;
   luaL_setmetatable( L, TLT_MTX_NAME );
   mutex->s = malloc( sizeof( *mutex->s ) );
   if( !mutex->s )
     luaL_error( L, "memory allocation error" );
-  mutex->s->ref.cnt = 1;
   mutex->s->count = 0;
-  if( thrd_success != mtx_init( &(mutex->s->ref.mtx), mtx_plain ) ) {
+  mutex->s->waiters = 0;
+  mutex->s->watchers = NULL;
+  mutex->s->spin = 0;
+  mutex->s->adaptive = adaptive;
+  stat_init( mutex->s->acquisitions );
+  stat_init( mutex->s->contended );
+  init_wait_stats( &(mutex->s->wait) );
+  if( !init_ref_count( &(mutex->s->ref), 1 ) ) {
     free( mutex->s );
     mutex->s = NULL;
     luaL_error( L, "mutex initialization failed" );
   }
   if( thrd_success != mtx_init( &(mutex->s->mutex), mtx_plain ) ) {
-    mtx_destroy( &(mutex->s->ref.mtx) );
+    destroy_ref_count( &(mutex->s->ref) );
     free( mutex->s );
     mutex->s = NULL;
     luaL_error( L, "mutex initialization failed" );
   }
   if( thrd_success != cnd_init( &(mutex->s->unlocked) ) ) {
-    mtx_destroy( &(mutex->s->ref.mtx) );
+    destroy_ref_count( &(mutex->s->ref) );
     mtx_destroy( &(mutex->s->mutex) );
     free( mutex->s );
     mutex->s = NULL;
@@ -651,6 +1674,7 @@ static int tinylmutex_copy( void* p, lua_State* L, int midx ) {
   tinylmutex* mutex = p;
   tinylmutex* copy = lua_newuserdata( L, sizeof( *copy ) );
   copy->s = NULL;
+  copy->holder = NULL;
   copy->is_owner = 0;
   lua_pushvalue( L, midx );
   lua_setmetatable( L, -2 );
@@ -662,52 +1686,204 @@ static int tinylmutex_copy( void* p, lua_State* L, int midx ) {
 }
 
 
+/* wakes up one blocked thread and all coroutine tasks waiting for
+ * the mutex (the inner mutex must be held) */
+static void wake_mutex_waiters( tinylmutex_shared* s ) {
+  tinylwatcher* w = s->watchers;
+  if( s->waiters > 0 )
+    no_fail( cnd_signal( &(s->unlocked) ) );
+  for( ; w != NULL; w = w->next )
+    notify_watcher( w );
+}
+
+
+static void unref_mutex( lua_State* L, tinylmutex_shared* s ) {
+  if( 0 == decrement_ref_count( L, &(s->ref) ) ) {
+    destroy_ref_count( &(s->ref) );
+    mtx_destroy( &(s->mutex) );
+    cnd_destroy( &(s->unlocked) );
+    free( s );
+  }
+}
+
+
 static int tinylmutex_gc( lua_State* L ) {
   tinylmutex* mutex = lua_touserdata( L, 1 );
   if( mutex->s ) {
     if( mutex->is_owner ) {
       no_fail( mtx_lock( &(mutex->s->mutex) ) );
       mutex->s->count = 0;
-      no_fail( cnd_signal( &(mutex->s->unlocked) ) );
+      wake_mutex_waiters( mutex->s );
       no_fail( mtx_unlock( &(mutex->s->mutex) ) );
     }
-    if( 0 == decrement_ref_count( L, &(mutex->s->ref) ) ) {
-      mtx_destroy( &(mutex->s->ref.mtx) );
-      mtx_destroy( &(mutex->s->mutex) );
-      cnd_destroy( &(mutex->s->unlocked) );
-      free( mutex->s );
-    }
+    unref_mutex( L, mutex->s );
     mutex->s = NULL;
   }
   return 0;
 }
 
 
+/* busy-waits for a contended adaptive mutex for a while before the
+ * caller parks on the condition variable; the number of iterations
+ * adapts to how long it took to get the lock in the past (similar to
+ * glibc's PTHREAD_MUTEX_ADAPTIVE_NP). The inner mutex is held on entry
+ * and on return. */
+static void spin_for_mutex( lua_State* L, tinylmutex* mutex ) {
+  int max = mutex->s->spin * 2 + 10;
+  int i = 0;
+  if( max > TLT_SPIN_MAX )
+    max = TLT_SPIN_MAX;
+  no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+  for( i = 0; i < max; ++i ) {
+    spin_pause();
+    if( thrd_success == mtx_trylock( &(mutex->s->mutex) ) ) {
+      if( mutex->s->count == 0 )
+        break;
+      no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+    }
+  }
+  if( i >= max )
+    mtx_lock_or_throw( L, &(mutex->s->mutex) );
+  mutex->s->spin += (i - mutex->s->spin) / 8;
+}
+
+
+/* checks whether the handle holds the lock on behalf of the given
+ * coroutine: a lock taken via `ylock` belongs to one coroutine only,
+ * other locks to the whole thread */
+static int owns_mutex( tinylmutex* mutex, lua_State* L ) {
+  return mutex->is_owner &&
+         (mutex->holder == NULL || mutex->holder == L);
+}
+
+
+/* removes a suspended scheduler task from the mutex */
+static void unwatch_mutex( tinylmutex_shared* s, tinylwatcher* w ) {
+  tinylwatcher** p = NULL;
+  no_fail( mtx_lock( &(s->mutex) ) );
+  for( p = &(s->watchers); *p != NULL; p = &((*p)->next) ) {
+    if( *p == w ) {
+      *p = w->next;
+      break;
+    }
+  }
+  no_fail( mtx_unlock( &(s->mutex) ) );
+}
+
+
+#ifdef TLT_HAVE_YIELDK
+/* remembers the deadline (if any) of a task that is about to yield
+ * because it has to wait */
+static void set_task_deadline( tinyltask* task,
+                               struct timespec const* dl ) {
+  task->has_deadline = dl != NULL;
+  if( dl != NULL )
+    task->deadline = *dl;
+}
+
+
+static int task_lock( lua_State* L, tinyltask* task,
+                      tinylmutex* mutex, struct timespec const* dl );
+
+TLT_KFUNCTION( continue_lock ) {
+  tinyltask* task = current_task( L );
+  (void)ctx;
+  if( task->is_timedout ) {
+    task->is_timedout = 0;
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  return task_lock( L, task, check_mutex( L, 1 ),
+                    task->has_deadline ? &(task->deadline) : NULL );
+}
+
+
+/* locks the mutex in a scheduler task, or registers the task at the
+ * mutex and yields until the mutex is unlocked (or the deadline has
+ * passed) */
+static int task_lock( lua_State* L, tinyltask* task,
+                      tinylmutex* mutex, struct timespec const* dl ) {
+  mtx_lock_or_throw( L, &(mutex->s->mutex) );
+  if( mutex->s->count > 0 && !owns_mutex( mutex, L ) ) {
+    stat_count( mutex->s->contended, contended, 1 );
+    task->w.next = mutex->s->watchers;
+    mutex->s->watchers = &(task->w);
+    no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+    task->mutex = mutex;
+    set_task_deadline( task, dl );
+    return lua_yieldk( L, 0, 0, continue_lock );
+  }
+  if( mutex->s->count == 0 )
+    mutex->holder = L;
+  mutex->is_owner = 1;
+  mutex->s->count++;
+  no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+  stat_count( mutex->s->acquisitions, acquisitions, 1 );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+#endif
+
+
 static int tinylmutex_lock( lua_State* L ) {
   tinylmutex* mutex = check_mutex( L, 1 );
   tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
   int disabled = 0;
   int itr = 0;
+  int res = thrd_success;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+#ifdef TLT_HAVE_YIELDK
+  {
+    tinyltask* task = current_task( L );
+    if( task != NULL )
+      return task_lock( L, task, mutex, dl );
+  }
+#endif
+  /* check for interrupts before taking the inner mutex, so that the
+   * uncontended case only needs a single lock/unlock of it */
+  if( is_interrupted( thread, &disabled ) )
+    throw_interrupt( L );
   mtx_lock_or_throw( L, &(mutex->s->mutex) );
-  while( !(itr=is_interrupted( thread, &disabled )) &&
-         mutex->s->count > 0 && !mutex->is_owner ) {
+  if( mutex->s->count > 0 && !mutex->is_owner ) {
+    stat_count( mutex->s->contended, contended, 1 );
+    if( mutex->s->adaptive )
+      spin_for_mutex( L, mutex );
+  }
+  while( res != thrd_timedout &&
+         mutex->s->count > 0 && !mutex->is_owner &&
+         !(itr=is_interrupted( thread, &disabled )) ) {
     set_block( thread, &(mutex->s->ref), &(mutex->s->unlocked),
                &(mutex->s->mutex) );
-    if( thrd_success !=
-        cnd_wait( &(mutex->s->unlocked), &(mutex->s->mutex) ) ) {
-      set_block( thread, NULL, NULL, NULL );
+    mutex->s->waiters++;
+    res = cnd_wait_until( &(mutex->s->unlocked), &(mutex->s->mutex),
+                          dl, &(mutex->s->wait) );
+    mutex->s->waiters--;
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
       no_fail( mtx_unlock( &(mutex->s->mutex) ) );
       luaL_error( L, "waiting for mutex failed" );
     }
-    set_block( thread, NULL, NULL, NULL );
   }
   if( itr ) {
     no_fail( mtx_unlock( &(mutex->s->mutex) ) );
     throw_interrupt( L );
   }
+  if( mutex->s->count > 0 && !mutex->is_owner ) { /* timed out */
+    no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
   mutex->is_owner = 1;
   mutex->s->count++;
   no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+  stat_count( mutex->s->acquisitions, acquisitions, 1 );
   lua_pushboolean( L, 1 );
   return 1;
 }
@@ -716,16 +1892,26 @@ static int tinylmutex_lock( lua_State* L ) {
 static int tinylmutex_trylock( lua_State* L ) {
   tinylmutex* mutex = check_mutex( L, 1 );
   tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_State* holder = NULL;
   if( is_interrupted( thread, NULL ) )
     throw_interrupt( L );
+#ifdef TLT_HAVE_YIELDK
+  /* tasks share the handle with the other tasks of their worker, so
+   * remember the owning coroutine like `task_lock` does */
+  if( current_task( L ) != NULL )
+    holder = L;
+#endif
   mtx_lock_or_throw( L, &(mutex->s->mutex) );
-  if( mutex->s->count > 0 && !mutex->is_owner ) {
+  if( mutex->s->count > 0 && !owns_mutex( mutex, L ) ) {
     no_fail( mtx_unlock( &(mutex->s->mutex) ) );
     lua_pushboolean( L, 0 );
   } else {
+    if( mutex->s->count == 0 )
+      mutex->holder = holder;
     mutex->s->count++;
     mutex->is_owner = 1;
     no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+    stat_count( mutex->s->acquisitions, acquisitions, 1 );
     lua_pushboolean( L, 1 );
   }
   return 1;
@@ -737,11 +1923,13 @@ static int tinylmutex_unlock( lua_State* L ) {
   tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
   int locked = 0;
   int owner = mutex->is_owner;
+  int other = owner && mutex->holder != NULL && mutex->holder != L;
   no_fail( mtx_lock( &(mutex->s->mutex) ) );
   locked = mutex->s->count > 0;
-  if( locked && owner && --(mutex->s->count) == 0 ) {
+  if( locked && owner && !other && --(mutex->s->count) == 0 ) {
     mutex->is_owner = 0;
-    no_fail( cnd_signal( &(mutex->s->unlocked) ) );
+    mutex->holder = NULL;
+    wake_mutex_waiters( mutex->s );
   }
   no_fail( mtx_unlock( &(mutex->s->mutex) ) );
   if( is_interrupted( thread, NULL ) )
@@ -756,229 +1944,5345 @@ static int tinylmutex_unlock( lua_State* L ) {
     lua_pushliteral( L, "mutex is locked by another thread" );
     return 2;
   }
+  if( other ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "mutex is locked by another coroutine" );
+    return 2;
+  }
   lua_pushboolean( L, 1 );
   return 1;
 }
 
 
+static int tinylmutex_stats( lua_State* L ) {
+  tinylmutex* mutex = check_mutex( L, 1 );
+  lua_createtable( L, 0, 5 );
+  set_stat_field( L, "acquisitions", stat_get( mutex->s->acquisitions ) );
+  set_stat_field( L, "contended", stat_get( mutex->s->contended ) );
+  push_wait_stats( L, &(mutex->s->wait) );
+  return 1;
+}
 
-static int tinylthread_new_pipe( lua_State* L ) {
-  tinylport* port1 = lua_newuserdata( L, sizeof( *port1 ) );
-  tinylport* port2 = lua_newuserdata( L, sizeof( *port2 ) );
-  port1->s = port2->s = NULL;
-  luaL_setmetatable( L, TLT_WPORT_NAME );
-  lua_pushvalue( L, -2 );
-  luaL_setmetatable( L, TLT_RPORT_NAME );
-  lua_pop( L, 1 );
-  port1->is_reader = 1;
-  port2->is_reader = 0;
-  port1->s = malloc( sizeof( *port1->s ) );
-  if( !port1->s )
+
+
+static int tinylthread_new_rwlock( lua_State* L ) {
+  tinylrwlock* rwlock = lua_newuserdata( L, sizeof( *rwlock ) );
+  rwlock->s = NULL;
+  rwlock->nread = 0;
+  rwlock->is_writer = 0;
+  luaL_setmetatable( L, TLT_RWLOCK_NAME );
+  rwlock->s = malloc( sizeof( *rwlock->s ) );
+  if( !rwlock->s )
     luaL_error( L, "memory allocation error" );
-  port1->s->ref.cnt = 2;
-  port1->s->L = NULL;
-  port1->s->rports = 1;
-  port1->s->wports = 1;
-  if( thrd_success != mtx_init( &(port1->s->ref.mtx), mtx_plain ) ) {
-    free( port1->s );
-    port1->s = NULL;
+  rwlock->s->readers = 0;
+  rwlock->s->waiting_writers = 0;
+  rwlock->s->has_writer = 0;
+  if( !init_ref_count( &(rwlock->s->ref), 1 ) ) {
+    free( rwlock->s );
+    rwlock->s = NULL;
     luaL_error( L, "mutex initialization failed" );
   }
-  if( thrd_success != mtx_init( &(port1->s->mutex), mtx_plain ) ) {
-    mtx_destroy( &(port1->s->ref.mtx) );
-    free( port1->s );
-    port1->s = NULL;
+  if( thrd_success != mtx_init( &(rwlock->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(rwlock->s->ref) );
+    free( rwlock->s );
+    rwlock->s = NULL;
     luaL_error( L, "mutex initialization failed" );
   }
-  if( thrd_success != cnd_init( &(port1->s->data_copied) ) ) {
-    mtx_destroy( &(port1->s->ref.mtx) );
-    mtx_destroy( &(port1->s->mutex) );
-    free( port1->s );
-    port1->s = NULL;
+  if( thrd_success != cnd_init( &(rwlock->s->readers_ok) ) ) {
+    destroy_ref_count( &(rwlock->s->ref) );
+    mtx_destroy( &(rwlock->s->mutex) );
+    free( rwlock->s );
+    rwlock->s = NULL;
     luaL_error( L, "condition variable initialization failed" );
   }
-  if( thrd_success != cnd_init( &(port1->s->waiting_senders) ) ) {
-    mtx_destroy( &(port1->s->ref.mtx) );
-    mtx_destroy( &(port1->s->mutex) );
-    cnd_destroy( &(port1->s->data_copied) );
-    free( port1->s );
-    port1->s = NULL;
+  if( thrd_success != cnd_init( &(rwlock->s->writers_ok) ) ) {
+    destroy_ref_count( &(rwlock->s->ref) );
+    mtx_destroy( &(rwlock->s->mutex) );
+    cnd_destroy( &(rwlock->s->readers_ok) );
+    free( rwlock->s );
+    rwlock->s = NULL;
     luaL_error( L, "condition variable initialization failed" );
   }
-  if( thrd_success != cnd_init( &(port1->s->waiting_receivers) ) ) {
-    mtx_destroy( &(port1->s->ref.mtx) );
-    mtx_destroy( &(port1->s->mutex) );
-    cnd_destroy( &(port1->s->data_copied) );
-    cnd_destroy( &(port1->s->waiting_senders) );
+  return 1;
+}
+
+
+static int tinylrwlock_copy( void* p, lua_State* L, int midx ) {
+  tinylrwlock* rwlock = p;
+  tinylrwlock* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  copy->nread = 0;
+  copy->is_writer = 0;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( rwlock->s ) {
+    increment_ref_count( L, &(rwlock->s->ref) );
+    copy->s = rwlock->s;
+  }
+  return 1;
+}
+
+
+/* wakes up the next writer, or all readers if no writer is waiting
+ * (the rwlock mutex must be held) */
+static void wake_rwlock_waiters( tinylrwlock_shared* s ) {
+  if( s->has_writer )
+    return;
+  if( s->waiting_writers > 0 ) {
+    if( s->readers == 0 )
+      no_fail( cnd_signal( &(s->writers_ok) ) );
+  } else
+    no_fail( cnd_broadcast( &(s->readers_ok) ) );
+}
+
+
+static int tinylrwlock_gc( lua_State* L ) {
+  tinylrwlock* rwlock = lua_touserdata( L, 1 );
+  if( rwlock->s ) {
+    if( rwlock->is_writer || rwlock->nread > 0 ) {
+      no_fail( mtx_lock( &(rwlock->s->mutex) ) );
+      if( rwlock->is_writer )
+        rwlock->s->has_writer = 0;
+      rwlock->s->readers -= rwlock->nread;
+      wake_rwlock_waiters( rwlock->s );
+      no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+    }
+    if( 0 == decrement_ref_count( L, &(rwlock->s->ref) ) ) {
+      destroy_ref_count( &(rwlock->s->ref) );
+      mtx_destroy( &(rwlock->s->mutex) );
+      cnd_destroy( &(rwlock->s->readers_ok) );
+      cnd_destroy( &(rwlock->s->writers_ok) );
+      free( rwlock->s );
+    }
+    rwlock->s = NULL;
+  }
+  return 0;
+}
+
+
+/* readers have to wait for active *and* waiting writers, unless they
+ * already hold a read lock (which would deadlock otherwise) */
+#define must_wait_for_read( _rw ) \
+  ((_rw)->s->has_writer || \
+   ((_rw)->s->waiting_writers > 0 && (_rw)->nread == 0))
+
+static int tinylrwlock_rdlock( lua_State* L ) {
+  tinylrwlock* rwlock = check_rwlock( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int disabled = 0;
+  int itr = 0;
+  int res = thrd_success;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( rwlock->is_writer )
+    luaL_error( L, "rwlock is already write-locked by this thread" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  mtx_lock_or_throw( L, &(rwlock->s->mutex) );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         must_wait_for_read( rwlock ) ) {
+    set_block( thread, &(rwlock->s->ref), &(rwlock->s->readers_ok),
+               &(rwlock->s->mutex) );
+    res = cnd_wait_until( &(rwlock->s->readers_ok),
+                          &(rwlock->s->mutex), dl, NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+      luaL_error( L, "waiting for rwlock failed" );
+    }
+  }
+  if( itr ) {
+    no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+    throw_interrupt( L );
+  }
+  if( must_wait_for_read( rwlock ) ) { /* timed out */
+    no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  rwlock->s->readers++;
+  rwlock->nread++;
+  no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+static int tinylrwlock_wrlock( lua_State* L ) {
+  tinylrwlock* rwlock = check_rwlock( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int disabled = 0;
+  int itr = 0;
+  int res = thrd_success;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( rwlock->is_writer || rwlock->nread > 0 )
+    luaL_error( L, "rwlock is already locked by this thread" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  mtx_lock_or_throw( L, &(rwlock->s->mutex) );
+  rwlock->s->waiting_writers++;
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         (rwlock->s->has_writer || rwlock->s->readers > 0) ) {
+    set_block( thread, &(rwlock->s->ref), &(rwlock->s->writers_ok),
+               &(rwlock->s->mutex) );
+    res = cnd_wait_until( &(rwlock->s->writers_ok),
+                          &(rwlock->s->mutex), dl, NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      rwlock->s->waiting_writers--;
+      wake_rwlock_waiters( rwlock->s );
+      no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+      luaL_error( L, "waiting for rwlock failed" );
+    }
+  }
+  rwlock->s->waiting_writers--;
+  if( itr || rwlock->s->has_writer || rwlock->s->readers > 0 ) {
+    /* readers may have been waiting for this writer */
+    wake_rwlock_waiters( rwlock->s );
+    no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+    if( itr )
+      throw_interrupt( L );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  rwlock->s->has_writer = 1;
+  rwlock->is_writer = 1;
+  no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+static int tinylrwlock_tryrdlock( lua_State* L ) {
+  tinylrwlock* rwlock = check_rwlock( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int ok = 0;
+  if( is_interrupted( thread, NULL ) )
+    throw_interrupt( L );
+  if( rwlock->is_writer )
+    luaL_error( L, "rwlock is already write-locked by this thread" );
+  mtx_lock_or_throw( L, &(rwlock->s->mutex) );
+  if( !must_wait_for_read( rwlock ) ) {
+    rwlock->s->readers++;
+    rwlock->nread++;
+    ok = 1;
+  }
+  no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+  lua_pushboolean( L, ok );
+  return 1;
+}
+
+#undef must_wait_for_read
+
+
+static int tinylrwlock_trywrlock( lua_State* L ) {
+  tinylrwlock* rwlock = check_rwlock( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int ok = 0;
+  if( is_interrupted( thread, NULL ) )
+    throw_interrupt( L );
+  if( rwlock->is_writer || rwlock->nread > 0 )
+    luaL_error( L, "rwlock is already locked by this thread" );
+  mtx_lock_or_throw( L, &(rwlock->s->mutex) );
+  if( !rwlock->s->has_writer && rwlock->s->readers == 0 ) {
+    rwlock->s->has_writer = 1;
+    rwlock->is_writer = 1;
+    ok = 1;
+  }
+  no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+  lua_pushboolean( L, ok );
+  return 1;
+}
+
+
+/* releases the write lock or one read lock held by this thread */
+static int tinylrwlock_unlock( lua_State* L ) {
+  tinylrwlock* rwlock = check_rwlock( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int locked = 1;
+  no_fail( mtx_lock( &(rwlock->s->mutex) ) );
+  if( rwlock->is_writer ) {
+    rwlock->is_writer = 0;
+    rwlock->s->has_writer = 0;
+    wake_rwlock_waiters( rwlock->s );
+  } else if( rwlock->nread > 0 ) {
+    rwlock->nread--;
+    rwlock->s->readers--;
+    wake_rwlock_waiters( rwlock->s );
+  } else
+    locked = 0;
+  no_fail( mtx_unlock( &(rwlock->s->mutex) ) );
+  if( is_interrupted( thread, NULL ) )
+    throw_interrupt( L );
+  if( !locked ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "rwlock is not locked by this thread" );
+    return 2;
+  }
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+
+static int tinylthread_new_semaphore( lua_State* L ) {
+  lua_Integer n = luaL_optinteger( L, 1, 0 );
+  tinylsemaphore* sem = NULL;
+  luaL_argcheck( L, n >= 0, 1, "non-negative integer expected" );
+  sem = lua_newuserdata( L, sizeof( *sem ) );
+  sem->s = NULL;
+  luaL_setmetatable( L, TLT_SEM_NAME );
+  sem->s = malloc( sizeof( *sem->s ) );
+  if( !sem->s )
+    luaL_error( L, "memory allocation error" );
+  sem->s->count = (size_t)n;
+  if( !init_ref_count( &(sem->s->ref), 1 ) ) {
+    free( sem->s );
+    sem->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(sem->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(sem->s->ref) );
+    free( sem->s );
+    sem->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(sem->s->available) ) ) {
+    destroy_ref_count( &(sem->s->ref) );
+    mtx_destroy( &(sem->s->mutex) );
+    free( sem->s );
+    sem->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  return 1;
+}
+
+
+static int tinylsemaphore_copy( void* p, lua_State* L, int midx ) {
+  tinylsemaphore* sem = p;
+  tinylsemaphore* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( sem->s ) {
+    increment_ref_count( L, &(sem->s->ref) );
+    copy->s = sem->s;
+  }
+  return 1;
+}
+
+
+static int tinylsemaphore_gc( lua_State* L ) {
+  tinylsemaphore* sem = lua_touserdata( L, 1 );
+  if( sem->s ) {
+    if( 0 == decrement_ref_count( L, &(sem->s->ref) ) ) {
+      destroy_ref_count( &(sem->s->ref) );
+      mtx_destroy( &(sem->s->mutex) );
+      cnd_destroy( &(sem->s->available) );
+      free( sem->s );
+    }
+    sem->s = NULL;
+  }
+  return 0;
+}
+
+
+static int tinylsemaphore_acquire( lua_State* L ) {
+  tinylsemaphore* sem = check_semaphore( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int disabled = 0;
+  int itr = 0;
+  int res = thrd_success;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  mtx_lock_or_throw( L, &(sem->s->mutex) );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         sem->s->count == 0 ) {
+    set_block( thread, &(sem->s->ref), &(sem->s->available),
+               &(sem->s->mutex) );
+    res = cnd_wait_until( &(sem->s->available), &(sem->s->mutex), dl,
+                          NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(sem->s->mutex) ) );
+      luaL_error( L, "waiting for semaphore failed" );
+    }
+  }
+  if( itr ) {
+    no_fail( mtx_unlock( &(sem->s->mutex) ) );
+    throw_interrupt( L );
+  }
+  if( sem->s->count == 0 ) { /* timed out */
+    no_fail( mtx_unlock( &(sem->s->mutex) ) );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  sem->s->count--;
+  no_fail( mtx_unlock( &(sem->s->mutex) ) );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+static int tinylsemaphore_tryacquire( lua_State* L ) {
+  tinylsemaphore* sem = check_semaphore( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int ok = 0;
+  if( is_interrupted( thread, NULL ) )
+    throw_interrupt( L );
+  mtx_lock_or_throw( L, &(sem->s->mutex) );
+  if( sem->s->count > 0 ) {
+    sem->s->count--;
+    ok = 1;
+  }
+  no_fail( mtx_unlock( &(sem->s->mutex) ) );
+  lua_pushboolean( L, ok );
+  return 1;
+}
+
+
+static int tinylsemaphore_release( lua_State* L ) {
+  tinylsemaphore* sem = check_semaphore( L, 1 );
+  lua_Integer n = luaL_optinteger( L, 2, 1 );
+  luaL_argcheck( L, n > 0, 2, "positive integer expected" );
+  mtx_lock_or_throw( L, &(sem->s->mutex) );
+  sem->s->count += (size_t)n;
+  if( n == 1 )
+    no_fail( cnd_signal( &(sem->s->available) ) );
+  else
+    no_fail( cnd_broadcast( &(sem->s->available) ) );
+  no_fail( mtx_unlock( &(sem->s->mutex) ) );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+static int tinylsemaphore_count( lua_State* L ) {
+  tinylsemaphore* sem = check_semaphore( L, 1 );
+  size_t n = 0;
+  mtx_lock_or_throw( L, &(sem->s->mutex) );
+  n = sem->s->count;
+  no_fail( mtx_unlock( &(sem->s->mutex) ) );
+  lua_pushinteger( L, (lua_Integer)n );
+  return 1;
+}
+
+
+
+static int tinylthread_new_barrier( lua_State* L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  tinylbarrier* barrier = NULL;
+  luaL_argcheck( L, n > 0, 1, "positive integer expected" );
+  barrier = lua_newuserdata( L, sizeof( *barrier ) );
+  barrier->s = NULL;
+  luaL_setmetatable( L, TLT_BARRIER_NAME );
+  barrier->s = malloc( sizeof( *barrier->s ) );
+  if( !barrier->s )
+    luaL_error( L, "memory allocation error" );
+  barrier->s->n = (size_t)n;
+  barrier->s->arrived = 0;
+  barrier->s->phase = 0;
+  if( !init_ref_count( &(barrier->s->ref), 1 ) ) {
+    free( barrier->s );
+    barrier->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(barrier->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(barrier->s->ref) );
+    free( barrier->s );
+    barrier->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(barrier->s->released) ) ) {
+    destroy_ref_count( &(barrier->s->ref) );
+    mtx_destroy( &(barrier->s->mutex) );
+    free( barrier->s );
+    barrier->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  return 1;
+}
+
+
+static int tinylbarrier_copy( void* p, lua_State* L, int midx ) {
+  tinylbarrier* barrier = p;
+  tinylbarrier* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( barrier->s ) {
+    increment_ref_count( L, &(barrier->s->ref) );
+    copy->s = barrier->s;
+  }
+  return 1;
+}
+
+
+static int tinylbarrier_gc( lua_State* L ) {
+  tinylbarrier* barrier = lua_touserdata( L, 1 );
+  if( barrier->s ) {
+    if( 0 == decrement_ref_count( L, &(barrier->s->ref) ) ) {
+      destroy_ref_count( &(barrier->s->ref) );
+      mtx_destroy( &(barrier->s->mutex) );
+      cnd_destroy( &(barrier->s->released) );
+      free( barrier->s );
+    }
+    barrier->s = NULL;
+  }
+  return 0;
+}
+
+
+/* returns true for exactly one thread (the last one to arrive) per
+ * phase, false for all others */
+static int tinylbarrier_wait( lua_State* L ) {
+  tinylbarrier* barrier = check_barrier( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int disabled = 0;
+  int itr = 0;
+  int res = thrd_success;
+  size_t phase = 0;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  mtx_lock_or_throw( L, &(barrier->s->mutex) );
+  if( is_interrupted( thread, &disabled ) ) {
+    no_fail( mtx_unlock( &(barrier->s->mutex) ) );
+    throw_interrupt( L );
+  }
+  phase = barrier->s->phase;
+  if( ++(barrier->s->arrived) == barrier->s->n ) {
+    barrier->s->arrived = 0;
+    barrier->s->phase++;
+    no_fail( cnd_broadcast( &(barrier->s->released) ) );
+    no_fail( mtx_unlock( &(barrier->s->mutex) ) );
+    lua_pushboolean( L, 1 );
+    return 1;
+  }
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         barrier->s->phase == phase ) {
+    set_block( thread, &(barrier->s->ref), &(barrier->s->released),
+               &(barrier->s->mutex) );
+    res = cnd_wait_until( &(barrier->s->released),
+                          &(barrier->s->mutex), dl, NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      if( barrier->s->phase == phase )
+        barrier->s->arrived--;
+      no_fail( mtx_unlock( &(barrier->s->mutex) ) );
+      luaL_error( L, "waiting for barrier failed" );
+    }
+  }
+  if( barrier->s->phase == phase ) {
+    /* interrupted or timed out: withdraw from the current phase */
+    barrier->s->arrived--;
+    no_fail( mtx_unlock( &(barrier->s->mutex) ) );
+    if( itr )
+      throw_interrupt( L );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  no_fail( mtx_unlock( &(barrier->s->mutex) ) );
+  lua_pushboolean( L, 0 );
+  return 1;
+}
+
+
+
+static int tinylthread_new_condition( lua_State* L ) {
+  tinylcondition* cond = lua_newuserdata( L, sizeof( *cond ) );
+  cond->s = NULL;
+  luaL_setmetatable( L, TLT_COND_NAME );
+  cond->s = malloc( sizeof( *cond->s ) );
+  if( !cond->s )
+    luaL_error( L, "memory allocation error" );
+  cond->s->waiters = 0;
+  cond->s->eligible = 0;
+  cond->s->wakeups = 0;
+  cond->s->generation = 0;
+  if( !init_ref_count( &(cond->s->ref), 1 ) ) {
+    free( cond->s );
+    cond->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(cond->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(cond->s->ref) );
+    free( cond->s );
+    cond->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(cond->s->signaled) ) ) {
+    destroy_ref_count( &(cond->s->ref) );
+    mtx_destroy( &(cond->s->mutex) );
+    free( cond->s );
+    cond->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  return 1;
+}
+
+
+static int tinylcondition_copy( void* p, lua_State* L, int midx ) {
+  tinylcondition* cond = p;
+  tinylcondition* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( cond->s ) {
+    increment_ref_count( L, &(cond->s->ref) );
+    copy->s = cond->s;
+  }
+  return 1;
+}
+
+
+static int tinylcondition_gc( lua_State* L ) {
+  tinylcondition* cond = lua_touserdata( L, 1 );
+  if( cond->s ) {
+    if( 0 == decrement_ref_count( L, &(cond->s->ref) ) ) {
+      destroy_ref_count( &(cond->s->ref) );
+      mtx_destroy( &(cond->s->mutex) );
+      cnd_destroy( &(cond->s->signaled) );
+      free( cond->s );
+    }
+    cond->s = NULL;
+  }
+  return 0;
+}
+
+
+/* releases a tinylthread mutex completely (even if locked
+ * recursively) and returns the old lock count */
+static size_t release_mutex( tinylmutex* mutex ) {
+  size_t count = 0;
+  no_fail( mtx_lock( &(mutex->s->mutex) ) );
+  count = mutex->s->count;
+  mutex->s->count = 0;
+  mutex->is_owner = 0;
+  wake_mutex_waiters( mutex->s );
+  no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+  return count;
+}
+
+
+/* reacquires a tinylthread mutex after waiting on a condition; this
+ * is not interruptible, because the caller expects to hold the lock
+ * when `wait` returns (or throws) */
+static void reacquire_mutex( tinylmutex* mutex, size_t count ) {
+  no_fail( mtx_lock( &(mutex->s->mutex) ) );
+  while( mutex->s->count > 0 ) {
+    mutex->s->waiters++;
+    no_fail( cnd_wait( &(mutex->s->unlocked), &(mutex->s->mutex) ) );
+    mutex->s->waiters--;
+  }
+  mutex->s->count = count;
+  mutex->is_owner = 1;
+  no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+}
+
+
+static int tinylcondition_wait( lua_State* L ) {
+  tinylcondition* cond = check_condition( L, 1 );
+  tinylmutex* mutex = check_mutex( L, 2 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 3, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int disabled = 0;
+  int itr = 0;
+  int res = thrd_success;
+  int woken = 0;
+  int eligible = 0;
+  size_t count = 0;
+  size_t gen = 0;
+  luaL_argcheck( L, timeout >= 0, 3, "non-negative number expected" );
+  if( !mutex->is_owner )
+    luaL_error( L, "mutex is not locked by this thread" );
+  if( !lua_isnoneornil( L, 3 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  mtx_lock_or_throw( L, &(cond->s->mutex) );
+  /* the condition's mutex is held while the tinylthread mutex is
+   * released, so no signal can get lost in between */
+  cond->s->waiters++;
+  gen = cond->s->generation;
+  count = release_mutex( mutex );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         (cond->s->wakeups == 0 || cond->s->generation == gen) ) {
+    set_block( thread, &(cond->s->ref), &(cond->s->signaled),
+               &(cond->s->mutex) );
+    res = cnd_wait_until( &(cond->s->signaled), &(cond->s->mutex), dl,
+                          NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout )
+      break;
+  }
+  cond->s->waiters--;
+  eligible = cond->s->generation != gen;
+  if( eligible )
+    cond->s->eligible--;
+  if( eligible && cond->s->wakeups > 0 && !itr ) {
+    cond->s->wakeups--;
+    woken = 1;
+  } else if( cond->s->wakeups > cond->s->eligible )
+    /* nobody left that could take this signal */
+    cond->s->wakeups = cond->s->eligible;
+  no_fail( mtx_unlock( &(cond->s->mutex) ) );
+  reacquire_mutex( mutex, count );
+  if( itr )
+    throw_interrupt( L );
+  if( !woken ) {
+    if( res != thrd_timedout )
+      luaL_error( L, "waiting for condition failed" );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+static int tinylcondition_signal( lua_State* L ) {
+  tinylcondition* cond = check_condition( L, 1 );
+  mtx_lock_or_throw( L, &(cond->s->mutex) );
+  if( cond->s->wakeups < cond->s->waiters ) {
+    cond->s->wakeups++;
+    cond->s->eligible = cond->s->waiters;
+    cond->s->generation++;
+    /* cnd_signal might pick a waiter of the new generation that
+     * can't take the signal */
+    no_fail( cnd_broadcast( &(cond->s->signaled) ) );
+  }
+  no_fail( mtx_unlock( &(cond->s->mutex) ) );
+  return 0;
+}
+
+
+static int tinylcondition_broadcast( lua_State* L ) {
+  tinylcondition* cond = check_condition( L, 1 );
+  mtx_lock_or_throw( L, &(cond->s->mutex) );
+  if( cond->s->wakeups < cond->s->waiters ) {
+    cond->s->wakeups = cond->s->waiters;
+    cond->s->eligible = cond->s->waiters;
+    cond->s->generation++;
+    no_fail( cnd_broadcast( &(cond->s->signaled) ) );
+  }
+  no_fail( mtx_unlock( &(cond->s->mutex) ) );
+  return 0;
+}
+
+
+
+static int tinylthread_new_atomic( lua_State* L ) {
+  lua_Integer v = luaL_optinteger( L, 1, 0 );
+  tinylatomic* atomic = lua_newuserdata( L, sizeof( *atomic ) );
+  atomic->s = NULL;
+  luaL_setmetatable( L, TLT_ATOMIC_NAME );
+  atomic->s = malloc( sizeof( *atomic->s ) );
+  if( !atomic->s )
+    luaL_error( L, "memory allocation error" );
+  if( !init_ref_count( &(atomic->s->ref), 1 ) ) {
+    free( atomic->s );
+    atomic->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+#ifdef TLT_HAVE_ATOMICS
+  atomic_init( &(atomic->s->value), (long long)v );
+#else
+  atomic->s->value = (long long)v;
+#endif
+  return 1;
+}
+
+
+static int tinylatomic_copy( void* p, lua_State* L, int midx ) {
+  tinylatomic* atomic = p;
+  tinylatomic* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( atomic->s ) {
+    increment_ref_count( L, &(atomic->s->ref) );
+    copy->s = atomic->s;
+  }
+  return 1;
+}
+
+
+static int tinylatomic_gc( lua_State* L ) {
+  tinylatomic* atomic = lua_touserdata( L, 1 );
+  if( atomic->s ) {
+    if( 0 == decrement_ref_count( L, &(atomic->s->ref) ) ) {
+      destroy_ref_count( &(atomic->s->ref) );
+      free( atomic->s );
+    }
+    atomic->s = NULL;
+  }
+  return 0;
+}
+
+
+/* without C11 atomics the value is protected by the mutex of the
+ * reference count */
+#ifdef TLT_HAVE_ATOMICS
+#  define atomic_begin( _a ) ((void)0)
+#  define atomic_end( _a ) ((void)0)
+#else
+#  define atomic_begin( _a ) no_fail( mtx_lock( &((_a)->s->ref.mtx) ) )
+#  define atomic_end( _a ) no_fail( mtx_unlock( &((_a)->s->ref.mtx) ) )
+#endif
+
+
+static int tinylatomic_load( lua_State* L ) {
+  tinylatomic* atomic = check_atomic( L, 1 );
+  long long v = 0;
+  atomic_begin( atomic );
+#ifdef TLT_HAVE_ATOMICS
+  v = atomic_load( &(atomic->s->value) );
+#else
+  v = atomic->s->value;
+#endif
+  atomic_end( atomic );
+  lua_pushinteger( L, (lua_Integer)v );
+  return 1;
+}
+
+
+static int tinylatomic_store( lua_State* L ) {
+  tinylatomic* atomic = check_atomic( L, 1 );
+  long long v = (long long)luaL_checkinteger( L, 2 );
+  atomic_begin( atomic );
+#ifdef TLT_HAVE_ATOMICS
+  atomic_store( &(atomic->s->value), v );
+#else
+  atomic->s->value = v;
+#endif
+  atomic_end( atomic );
+  return 0;
+}
+
+
+/* add, sub, and exchange return the previous value */
+static int tinylatomic_add( lua_State* L ) {
+  tinylatomic* atomic = check_atomic( L, 1 );
+  long long d = (long long)luaL_optinteger( L, 2, 1 );
+  long long v = 0;
+  atomic_begin( atomic );
+#ifdef TLT_HAVE_ATOMICS
+  v = atomic_fetch_add( &(atomic->s->value), d );
+#else
+  /* wrap around like the atomic version does */
+  v = atomic->s->value;
+  atomic->s->value = (long long)((unsigned long long)v +
+                                 (unsigned long long)d);
+#endif
+  atomic_end( atomic );
+  lua_pushinteger( L, (lua_Integer)v );
+  return 1;
+}
+
+
+static int tinylatomic_sub( lua_State* L ) {
+  tinylatomic* atomic = check_atomic( L, 1 );
+  long long d = (long long)luaL_optinteger( L, 2, 1 );
+  long long v = 0;
+  atomic_begin( atomic );
+#ifdef TLT_HAVE_ATOMICS
+  v = atomic_fetch_sub( &(atomic->s->value), d );
+#else
+  v = atomic->s->value;
+  atomic->s->value = (long long)((unsigned long long)v -
+                                 (unsigned long long)d);
+#endif
+  atomic_end( atomic );
+  lua_pushinteger( L, (lua_Integer)v );
+  return 1;
+}
+
+
+static int tinylatomic_exchange( lua_State* L ) {
+  tinylatomic* atomic = check_atomic( L, 1 );
+  long long d = (long long)luaL_checkinteger( L, 2 );
+  long long v = 0;
+  atomic_begin( atomic );
+#ifdef TLT_HAVE_ATOMICS
+  v = atomic_exchange( &(atomic->s->value), d );
+#else
+  v = atomic->s->value;
+  atomic->s->value = d;
+#endif
+  atomic_end( atomic );
+  lua_pushinteger( L, (lua_Integer)v );
+  return 1;
+}
+
+
+/* returns whether the value was replaced, and the value found */
+static int tinylatomic_compare_exchange( lua_State* L ) {
+  tinylatomic* atomic = check_atomic( L, 1 );
+  long long expected = (long long)luaL_checkinteger( L, 2 );
+  long long desired = (long long)luaL_checkinteger( L, 3 );
+  int ok = 0;
+  atomic_begin( atomic );
+#ifdef TLT_HAVE_ATOMICS
+  ok = atomic_compare_exchange_strong( &(atomic->s->value), &expected,
+                                       desired );
+#else
+  ok = atomic->s->value == expected;
+  if( ok )
+    atomic->s->value = desired;
+  else
+    expected = atomic->s->value;
+#endif
+  atomic_end( atomic );
+  lua_pushboolean( L, ok );
+  lua_pushinteger( L, (lua_Integer)expected );
+  return 2;
+}
+
+#undef atomic_begin
+#undef atomic_end
+
+
+/* the stripes of a store keep their part of the data in a table in
+ * the registry of a private slot state */
+static int init_store_state( lua_State* L ) {
+  init_slot_state( L );
+  lua_newtable( L );
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_STORE_DATA );
+  return 0;
+}
+
+static lua_State* new_store_state( void ) {
+  lua_State* L = luaL_newstate();
+  if( L != NULL && 0 != lua_cpcallr( L, init_store_state, NULL, 0 ) ) {
+    lua_close( L );
+    L = NULL;
+  }
+  return L;
+}
+
+
+static void destroy_stripes( tinylstore_shared* s, size_t n ) {
+  size_t i = 0;
+  for( i = 0; i < n; ++i ) {
+    mtx_destroy( &(s->stripes[ i ].mutex) );
+    lua_close( s->stripes[ i ].L );
+  }
+}
+
+
+static int tinylthread_new_store( lua_State* L ) {
+  lua_Integer n = luaL_optinteger( L, 1, TLT_STORE_STRIPES );
+  tinylstore* store = NULL;
+  size_t nstripes = 1;
+  size_t i = 0;
+  luaL_argcheck( L, n > 0 && n <= 4096, 1, "invalid number of stripes" );
+  while( nstripes < (size_t)n )
+    nstripes <<= 1;
+  store = lua_newuserdata( L, sizeof( *store ) );
+  store->s = NULL;
+  luaL_setmetatable( L, TLT_STORE_NAME );
+  store->s = malloc( offsetof( tinylstore_shared, stripes ) +
+                     nstripes * sizeof( tinylstripe ) );
+  if( !store->s )
+    luaL_error( L, "memory allocation error" );
+  store->s->nstripes = nstripes;
+  if( !init_ref_count( &(store->s->ref), 1 ) ) {
+    free( store->s );
+    store->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  for( i = 0; i < nstripes; ++i ) {
+    tinylstripe* stripe = store->s->stripes + i;
+    if( thrd_success != mtx_init( &(stripe->mutex), mtx_plain ) ) {
+      destroy_stripes( store->s, i );
+      destroy_ref_count( &(store->s->ref) );
+      free( store->s );
+      store->s = NULL;
+      luaL_error( L, "mutex initialization failed" );
+    }
+    stripe->L = new_store_state();
+    if( !stripe->L ) {
+      mtx_destroy( &(stripe->mutex) );
+      destroy_stripes( store->s, i );
+      destroy_ref_count( &(store->s->ref) );
+      free( store->s );
+      store->s = NULL;
+      luaL_error( L, "memory allocation error" );
+    }
+  }
+  return 1;
+}
+
+
+static int tinylstore_copy( void* p, lua_State* L, int midx ) {
+  tinylstore* store = p;
+  tinylstore* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( store->s ) {
+    increment_ref_count( L, &(store->s->ref) );
+    copy->s = store->s;
+  }
+  return 1;
+}
+
+
+static int tinylstore_gc( lua_State* L ) {
+  tinylstore* store = lua_touserdata( L, 1 );
+  if( store->s ) {
+    if( 0 == decrement_ref_count( L, &(store->s->ref) ) ) {
+      destroy_stripes( store->s, store->s->nstripes );
+      destroy_ref_count( &(store->s->ref) );
+      free( store->s );
+    }
+    store->s = NULL;
+  }
+  return 0;
+}
+
+
+/* keys are restricted to values that compare equal in all Lua
+ * states; the hash (FNV-1a) only selects the stripe */
+static size_t hash_key( lua_State* L, int idx ) {
+  size_t h = 2166136261u;
+  unsigned char const* p = NULL;
+  size_t len = 0;
+  lua_Number n = 0;
+  switch( lua_type( L, idx ) ) {
+    case LUA_TBOOLEAN:
+      return (size_t)lua_toboolean( L, idx );
+    case LUA_TNUMBER:
+      n = lua_tonumber( L, idx );
+      luaL_argcheck( L, n == n, idx, "key is NaN" );
+      if( n == 0 )
+        n = 0; /* -0.0 and 0.0 are the same key */
+      p = (unsigned char const*)&n;
+      len = sizeof( n );
+      break;
+    case LUA_TSTRING:
+      p = (unsigned char const*)lua_tolstring( L, idx, &len );
+      break;
+    default:
+      luaL_argerror( L, idx, "string, number, or boolean expected" );
+      break;
+  }
+  while( len-- > 0 )
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+
+/* locks the stripe responsible for the key at index 2 */
+static tinylstripe* lock_stripe( lua_State* L, tinylstore* store ) {
+  size_t h = hash_key( L, 2 );
+  tinylstripe* stripe = store->s->stripes +
+                        (h & (store->s->nstripes-1));
+  mtx_lock_or_throw( L, &(stripe->mutex) );
+  return stripe;
+}
+
+
+/* runs a store operation in the Lua state of the stripe (with the
+ * stripe's mutex held) and copies its single result (or the error
+ * message) back */
+static void store_call( lua_State* L, tinylstripe* stripe,
+                        lua_CFunction f ) {
+  int status = lua_cpcallr( stripe->L, f, L, 1 );
+  int res = lua_cpcallr( L, copy_stack_top, stripe->L, 1 );
+  lua_settop( stripe->L, 0 );
+  no_fail( mtx_unlock( &(stripe->mutex) ) );
+  if( res != 0 || status != 0 )
+    lua_error( L );
+}
+
+
+/* the following functions run in the Lua state of a stripe, all API
+ * calls on the caller's Lua state (fromL) are *unprotected*! */
+static int store_get( lua_State* L ) {
+  lua_State* fromL = lua_touserdata( L, 1 );
+  lua_pop( L, 1 );
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_STORE_DATA );
+  copy_value_to_thread( L, fromL, 2 );
+  lua_rawget( L, -2 );
+  return 1;
+}
+
+static int store_set( lua_State* L ) {
+  lua_State* fromL = lua_touserdata( L, 1 );
+  lua_pop( L, 1 );
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_STORE_DATA );
+  copy_value_to_thread( L, fromL, 2 );
+  copy_value_to_thread( L, fromL, 3 );
+  lua_rawset( L, -3 );
+  return 0;
+}
+
+static int store_cas( lua_State* L ) {
+  lua_State* fromL = lua_touserdata( L, 1 );
+  int ok = 0;
+  lua_pop( L, 1 );
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_STORE_DATA );
+  copy_value_to_thread( L, fromL, 2 );
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, -3 );
+  copy_value_to_thread( L, fromL, 3 );
+  /* tables and non-shareable values can never compare equal */
+  ok = lua_rawequal( L, -1, -2 );
+  lua_pop( L, 2 );
+  if( ok ) {
+    copy_value_to_thread( L, fromL, 4 );
+    lua_rawset( L, -3 );
+  }
+  lua_pushboolean( L, ok );
+  return 1;
+}
+
+static int store_incr( lua_State* L ) {
+  lua_State* fromL = lua_touserdata( L, 1 );
+  lua_pop( L, 1 );
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_STORE_DATA );
+  copy_value_to_thread( L, fromL, 2 );
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, -3 );
+  if( lua_isnil( L, -1 ) )
+    copy_value_to_thread( L, fromL, 3 );
+  else if( lua_type( L, -1 ) != LUA_TNUMBER )
+    luaL_error( L, "attempt to increment a %s value",
+                luaL_typename( L, -1 ) );
+  else if( lua_isinteger( L, -1 ) && lua_isinteger( fromL, 3 ) ) {
+    /* wrap around like Lua 5.3 integer arithmetic does */
+    unsigned long long a = (unsigned long long)lua_tointeger( L, -1 );
+    unsigned long long b = (unsigned long long)lua_tointeger( fromL, 3 );
+    lua_pushinteger( L, (lua_Integer)(a + b) );
+  } else
+    lua_pushnumber( L, lua_tonumber( L, -1 ) + lua_tonumber( fromL, 3 ) );
+  lua_replace( L, -2 );
+  lua_pushvalue( L, -1 );
+  lua_insert( L, -3 );
+  lua_rawset( L, -4 );
+  return 1;
+}
+
+static int store_delete( lua_State* L ) {
+  lua_State* fromL = lua_touserdata( L, 1 );
+  int existed = 0;
+  lua_pop( L, 1 );
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_STORE_DATA );
+  copy_value_to_thread( L, fromL, 2 );
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, -3 );
+  existed = !lua_isnil( L, -1 );
+  lua_pop( L, 1 );
+  lua_pushnil( L );
+  lua_rawset( L, -3 );
+  lua_pushboolean( L, existed );
+  return 1;
+}
+
+
+static int tinylstore_get( lua_State* L ) {
+  tinylstore* store = check_store( L, 1 );
+  tinylstripe* stripe = NULL;
+  luaL_checkany( L, 2 );
+  lua_settop( L, 2 );
+  stripe = lock_stripe( L, store );
+  store_call( L, stripe, store_get );
+  return 1;
+}
+
+
+/* A store that holds a handle to itself keeps its own reference
+ * count above zero and is never freed, so storing a store in itself is
+ * an error. Handles inside stored tables and cycles between different
+ * stores are not detected and leak the same way. */
+static void check_not_self( lua_State* L, tinylstore* store, int idx ) {
+  tinylstore* v = lua_touserdata( L, idx );
+  int same = 0;
+  if( v != NULL && lua_getmetatable( L, idx ) ) {
+    luaL_getmetatable( L, TLT_STORE_NAME );
+    same = lua_rawequal( L, -1, -2 ) && v->s == store->s;
+    lua_pop( L, 2 );
+  }
+  luaL_argcheck( L, !same, idx, "store can't contain itself" );
+}
+
+
+/* setting a key to nil removes it */
+static int tinylstore_set( lua_State* L ) {
+  tinylstore* store = check_store( L, 1 );
+  tinylstripe* stripe = NULL;
+  luaL_checkany( L, 2 );
+  lua_settop( L, 3 );
+  check_not_self( L, store, 3 );
+  stripe = lock_stripe( L, store );
+  store_call( L, stripe, store_set );
+  return 0;
+}
+
+
+/* sets a new value only if the current value is (raw) equal to the
+ * expected one; returns whether the value was replaced */
+static int tinylstore_cas( lua_State* L ) {
+  tinylstore* store = check_store( L, 1 );
+  tinylstripe* stripe = NULL;
+  luaL_checkany( L, 2 );
+  lua_settop( L, 4 );
+  check_not_self( L, store, 4 );
+  stripe = lock_stripe( L, store );
+  store_call( L, stripe, store_cas );
+  return 1;
+}
+
+
+/* adds a number (default 1) to the value of a key (missing keys
+ * count as 0), and returns the new value */
+static int tinylstore_incr( lua_State* L ) {
+  tinylstore* store = check_store( L, 1 );
+  tinylstripe* stripe = NULL;
+  luaL_checkany( L, 2 );
+  if( lua_isnoneornil( L, 3 ) ) {
+    lua_settop( L, 2 );
+    lua_pushinteger( L, 1 );
+  } else {
+    luaL_checknumber( L, 3 );
+    lua_settop( L, 3 );
+  }
+  stripe = lock_stripe( L, store );
+  store_call( L, stripe, store_incr );
+  return 1;
+}
+
+
+/* removes a key and returns whether it existed */
+static int tinylstore_delete( lua_State* L ) {
+  tinylstore* store = check_store( L, 1 );
+  tinylstripe* stripe = NULL;
+  luaL_checkany( L, 2 );
+  lua_settop( L, 2 );
+  stripe = lock_stripe( L, store );
+  store_call( L, stripe, store_delete );
+  return 1;
+}
+
+
+
+static int tinylthread_new_pipe( lua_State* L ) {
+  lua_Integer capacity = luaL_optinteger( L, 1, 0 );
+  tinylport* port1 = NULL;
+  tinylport* port2 = NULL;
+  luaL_argcheck( L, capacity >= 0, 1, "non-negative number expected" );
+  luaL_argcheck( L, capacity <= INT_MAX, 1, "capacity too large" );
+  port1 = lua_newuserdata( L, sizeof( *port1 ) );
+  port2 = lua_newuserdata( L, sizeof( *port2 ) );
+  port1->s = port2->s = NULL;
+  luaL_setmetatable( L, TLT_WPORT_NAME );
+  lua_pushvalue( L, -2 );
+  luaL_setmetatable( L, TLT_RPORT_NAME );
+  lua_pop( L, 1 );
+  port1->is_reader = 1;
+  port2->is_reader = 0;
+  port1->timeout = port2->timeout = -1;
+  port1->s = malloc( sizeof( *port1->s ) );
+  if( !port1->s )
+    luaL_error( L, "memory allocation error" );
+  port1->s->L = NULL;
+  port1->s->want = 0;
+  port1->s->rports = 1;
+  port1->s->wports = 1;
+  port1->s->senders = 0;
+  port1->s->offer = NULL;
+  port1->s->watchers = NULL;
+  port1->s->buffer = NULL;
+  port1->s->capacity = (size_t)capacity;
+  port1->s->size = (size_t)capacity;
+  stat_init( port1->s->messages );
+  stat_init( port1->s->bytes );
+  init_wait_stats( &(port1->s->wait) );
+#ifdef TLT_HAVE_ATOMICS
+  /* the lock-free queue needs a power of two as size, the capacity
+   * is enforced separately */
+  if( capacity > 0 ) {
+    port1->s->size = 1;
+    while( port1->s->size < (size_t)capacity )
+      port1->s->size <<= 1;
+  }
+  atomic_init( &(port1->s->enq_pos), 0 );
+  atomic_init( &(port1->s->deq_pos), 0 );
+  atomic_init( &(port1->s->parked_senders), 0 );
+  atomic_init( &(port1->s->parked_receivers), 0 );
+#else
+  port1->s->head = 0;
+  port1->s->count = 0;
+#endif
+  if( capacity > 0 ) {
+    size_t i = 0;
+    port1->s->buffer = calloc( port1->s->size, sizeof( tinylcell ) );
+    if( !port1->s->buffer ) {
+      free( port1->s );
+      port1->s = NULL;
+      luaL_error( L, "memory allocation error" );
+    }
+    for( i = 0; i < port1->s->size; ++i ) {
+      port1->s->buffer[ i ].L = NULL;
+#ifdef TLT_HAVE_ATOMICS
+      atomic_init( &(port1->s->buffer[ i ].seq), i );
+#endif
+    }
+  }
+  if( !init_ref_count( &(port1->s->ref), 2 ) ) {
+    free( port1->s->buffer );
+    free( port1->s );
+    port1->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(port1->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(port1->s->ref) );
+    free( port1->s->buffer );
+    free( port1->s );
+    port1->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(port1->s->data_copied) ) ) {
+    destroy_ref_count( &(port1->s->ref) );
+    mtx_destroy( &(port1->s->mutex) );
+    free( port1->s->buffer );
+    free( port1->s );
+    port1->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(port1->s->waiting_senders) ) ) {
+    destroy_ref_count( &(port1->s->ref) );
+    mtx_destroy( &(port1->s->mutex) );
+    cnd_destroy( &(port1->s->data_copied) );
+    free( port1->s->buffer );
+    free( port1->s );
+    port1->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(port1->s->waiting_receivers) ) ) {
+    destroy_ref_count( &(port1->s->ref) );
+    mtx_destroy( &(port1->s->mutex) );
+    cnd_destroy( &(port1->s->data_copied) );
+    cnd_destroy( &(port1->s->waiting_senders) );
+    free( port1->s->buffer );
     free( port1->s );
     port1->s = NULL;
     luaL_error( L, "condition variable initialization failed" );
   }
-  port2->s = port1->s;
-  return 2;
+  port2->s = port1->s;
+  return 2;
+}
+
+
+static int tinylport_copy( void* p, lua_State* L, int midx ) {
+  tinylport* port = p;
+  tinylport* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  copy->is_reader = port->is_reader;
+  copy->timeout = port->timeout;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( port->s ) {
+    increment_ref_count( L, &(port->s->ref) );
+    copy->s = port->s;
+  }
+  return 1;
+}
+
+
+/* special return values of the functions for reading/writing */
+#define PORT_BROKEN   (-1)
+#define PORT_TIMEOUT  (-2)
+
+
+/* wakes up all threads waiting in `select` (and all suspended
+ * scheduler tasks) for the given port (the port mutex must be held) */
+static void notify_watchers( tinylport_shared* port ) {
+  tinylwatcher* w = port->watchers;
+  for( ; w != NULL; w = w->next )
+    notify_watcher( w );
+}
+
+
+static void unref_port( lua_State* L, tinylport_shared* s ) {
+  if( 0 == decrement_ref_count( L, &(s->ref) ) ) {
+    destroy_ref_count( &(s->ref) );
+    mtx_destroy( &(s->mutex) );
+    cnd_destroy( &(s->data_copied) );
+    cnd_destroy( &(s->waiting_senders) );
+    cnd_destroy( &(s->waiting_receivers) );
+    if( s->buffer ) {
+      size_t i = 0;
+      for( i = 0; i < s->size; ++i ) {
+        if( s->buffer[ i ].L )
+          lua_close( s->buffer[ i ].L );
+        free( s->buffer[ i ].str );
+      }
+      free( s->buffer );
+    }
+    free( s );
+  }
+}
+
+
+static int tinylport_gc( lua_State* L ) {
+  tinylport* port = lua_touserdata( L, 1 );
+  if( port->s ) {
+    no_fail( mtx_lock( &(port->s->mutex) ) );
+    if( port->is_reader ) {
+      if( 0 == --(port->s->rports) ) {
+        no_fail( cnd_broadcast( &(port->s->waiting_senders) ) );
+        notify_watchers( port->s );
+      }
+    } else {
+      if( 0 == --(port->s->wports) ) {
+        no_fail( cnd_broadcast( &(port->s->data_copied) ) );
+        no_fail( cnd_broadcast( &(port->s->waiting_receivers) ) );
+        notify_watchers( port->s );
+      }
+    }
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    unref_port( L, port->s );
+    port->s = NULL;
+  }
+  return 0;
+}
+
+
+/* serializes a nil, boolean, number or string value into a cell of a
+ * buffered pipe, so that it doesn't need the cell's Lua state; returns
+ * zero for other values (or if the string buffer can't grow) */
+static int store_inline( tinylcell* cell, lua_State* L, int idx ) {
+  switch( lua_type( L, idx ) ) {
+    case LUA_TNIL:
+      cell->kind = TLT_CELL_NIL;
+      return 1;
+    case LUA_TBOOLEAN:
+      cell->v.b = lua_toboolean( L, idx );
+      cell->kind = TLT_CELL_BOOLEAN;
+      return 1;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if( lua_isinteger( L, idx ) ) {
+        cell->v.i = lua_tointeger( L, idx );
+        cell->kind = TLT_CELL_INTEGER;
+        return 1;
+      }
+#endif
+      cell->v.n = lua_tonumber( L, idx );
+      cell->kind = TLT_CELL_NUMBER;
+      return 1;
+    case LUA_TSTRING: {
+      size_t len = 0;
+      char const* str = lua_tolstring( L, idx, &len );
+      if( len > cell->cap ) {
+        char* p = realloc( cell->str, len );
+        if( p == NULL )
+          return 0;
+        cell->str = p;
+        cell->cap = len;
+      }
+      if( len > 0 )
+        memcpy( cell->str, str, len );
+      cell->len = len;
+      cell->kind = TLT_CELL_STRING;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static int push_cell_string( lua_State* L ) {
+  tinylcell* cell = lua_touserdata( L, 1 );
+  lua_pushlstring( L, cell->str, cell->len );
+  return 1;
+}
+
+
+/* pushes the value serialized into a cell; returns non-zero (with the
+ * error message on the stack) if that fails */
+static int push_inline( lua_State* L, tinylcell* cell ) {
+  int r = 0;
+  switch( cell->kind ) {
+    case TLT_CELL_NIL:
+      lua_pushnil( L );
+      break;
+    case TLT_CELL_BOOLEAN:
+      lua_pushboolean( L, cell->v.b );
+      break;
+    case TLT_CELL_NUMBER:
+      lua_pushnumber( L, cell->v.n );
+      break;
+    case TLT_CELL_INTEGER:
+      lua_pushinteger( L, cell->v.i );
+      break;
+    case TLT_CELL_STRING:
+      r = lua_cpcallr( L, push_cell_string, cell, 1 );
+      if( cell->cap > TLT_CELL_KEEP ) {
+        free( cell->str );
+        cell->str = NULL;
+        cell->cap = 0;
+      }
+      break;
+  }
+  return r;
+}
+
+
+/* empties a Lua state of the ring buffer of a buffered pipe; returns
+ * non-zero if the value may have contained handles, which should be
+ * collected right away, so that they don't prevent broken pipe
+ * detection (but not while holding the port mutex, because their
+ * finalizers may need it) */
+static int clear_slot( lua_State* L ) {
+  int t = lua_type( L, -1 );
+  lua_settop( L, 0 );
+  return t == LUA_TUSERDATA || t == LUA_TTABLE;
+}
+
+
+#ifdef TLT_HAVE_ATOMICS
+/* Lock-free ring buffer for buffered pipes: readers and writers only
+ * take the port mutex to park when the queue is empty/full, or to
+ * wake up parked threads. Values are copied without holding a lock,
+ * because a claimed cell belongs to the claiming thread until it
+ * updates the sequence number again. */
+
+static ptrdiff_t cell_state( tinylport_shared* port,
+                             atomic_size_t* pos, size_t offset ) {
+  size_t p = atomic_load_explicit( pos, memory_order_relaxed );
+  tinylcell* cell = port->buffer + (p & (port->size-1));
+  size_t seq = atomic_load_explicit( &(cell->seq),
+                                     memory_order_acquire );
+  return (ptrdiff_t)(seq - (p + offset));
+}
+
+/* the queue is empty (or the next value is still being written) */
+#define queue_is_empty( port ) \
+  (cell_state( (port), &((port)->deq_pos), 1 ) < 0)
+/* the requested capacity is used up (the ring may be larger) */
+#define capacity_used( port, p ) \
+  ((ptrdiff_t)((p) - atomic_load_explicit( &((port)->deq_pos), \
+                                           memory_order_relaxed )) >= \
+   (ptrdiff_t)(port)->capacity)
+/* the queue is full (or the next cell is still being read) */
+#define queue_is_full( port ) \
+  (cell_state( (port), &((port)->enq_pos), 0 ) < 0 || \
+   capacity_used( (port), atomic_load_explicit( &((port)->enq_pos), \
+                                                memory_order_relaxed ) ))
+
+
+/* claims the next cell for reading (offset 1) or writing (offset 0),
+ * returns NULL if the queue is empty/full */
+static tinylcell* claim_cell( tinylport_shared* port,
+                              atomic_size_t* pos, size_t offset,
+                              size_t* claimed ) {
+  size_t p = atomic_load_explicit( pos, memory_order_relaxed );
+  for( ;; ) {
+    tinylcell* cell = port->buffer + (p & (port->size-1));
+    size_t seq = atomic_load_explicit( &(cell->seq),
+                                       memory_order_acquire );
+    ptrdiff_t diff = (ptrdiff_t)(seq - (p + offset));
+    if( offset == 0 && capacity_used( port, p ) )
+      return NULL;
+    if( diff == 0 ) {
+      /* on failure the CAS updates p to the current position */
+      if( atomic_compare_exchange_weak_explicit( pos, &p, p+1,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed ) ) {
+        *claimed = p;
+        return cell;
+      }
+    } else if( diff < 0 )
+      return NULL;
+    else
+      p = atomic_load_explicit( pos, memory_order_relaxed );
+  }
+}
+
+
+/* threads waiting in `select` and suspended scheduler tasks count as
+ * parked, too */
+static void wake_parked( tinylport_shared* port, atomic_size_t* parked,
+                         cnd_t* cnd, int all ) {
+  /* pairs with the increment of the parked counter before the
+   * parked thread rechecks the queue */
+  atomic_thread_fence( memory_order_seq_cst );
+  if( atomic_load_explicit( parked, memory_order_relaxed ) > 0 ) {
+    no_fail( mtx_lock( &(port->mutex) ) );
+    if( all )
+      no_fail( cnd_broadcast( cnd ) );
+    else
+      no_fail( cnd_signal( cnd ) );
+    notify_watchers( port );
+    no_fail( mtx_unlock( &(port->mutex) ) );
+  }
+}
+
+
+static int park_receiver( lua_State* L, tinylport* port,
+                          tinylthread* thread, int* disabled,
+                          struct timespec const* deadline ) {
+  int itr = 0;
+  int res = thrd_success;
+  mtx_lock_or_throw( L, &(port->s->mutex) );
+  atomic_fetch_add( &(port->s->parked_receivers), 1 );
+  atomic_thread_fence( memory_order_seq_cst );
+  while( !(itr=is_interrupted( thread, disabled )) &&
+         res != thrd_timedout &&
+         queue_is_empty( port->s ) &&
+         port->s->wports > 0 ) {
+    set_block( thread, &(port->s->ref), &(port->s->waiting_receivers),
+               &(port->s->mutex) );
+    res = cnd_wait_until( &(port->s->waiting_receivers),
+                          &(port->s->mutex), deadline,
+                          &(port->s->wait) );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      atomic_fetch_sub( &(port->s->parked_receivers), 1 );
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "waiting for data failed" );
+    }
+  }
+  atomic_fetch_sub( &(port->s->parked_receivers), 1 );
+  no_fail( mtx_unlock( &(port->s->mutex) ) );
+  if( itr ) /* handle interrupt request */
+    throw_interrupt( L );
+  /* wports can't increase again, so no more values will arrive */
+  if( queue_is_empty( port->s ) && port->s->wports == 0 )
+    luaL_error( L, "broken pipe" );
+  return res == thrd_timedout ? PORT_TIMEOUT : 0;
+}
+
+
+static int park_sender( lua_State* L, tinylport* port,
+                        tinylthread* thread, int* disabled,
+                        struct timespec const* deadline ) {
+  int itr = 0;
+  int res = thrd_success;
+  mtx_lock_or_throw( L, &(port->s->mutex) );
+  atomic_fetch_add( &(port->s->parked_senders), 1 );
+  atomic_thread_fence( memory_order_seq_cst );
+  while( !(itr=is_interrupted( thread, disabled )) &&
+         res != thrd_timedout &&
+         queue_is_full( port->s ) &&
+         port->s->rports > 0 ) {
+    set_block( thread, &(port->s->ref), &(port->s->waiting_senders),
+               &(port->s->mutex) );
+    res = cnd_wait_until( &(port->s->waiting_senders),
+                          &(port->s->mutex), deadline,
+                          &(port->s->wait) );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      atomic_fetch_sub( &(port->s->parked_senders), 1 );
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "waiting for buffer space failed" );
+    }
+  }
+  atomic_fetch_sub( &(port->s->parked_senders), 1 );
+  no_fail( mtx_unlock( &(port->s->mutex) ) );
+  if( itr ) /* handle interrupt request */
+    throw_interrupt( L );
+  return res == thrd_timedout ? PORT_TIMEOUT : 0;
+}
+
+
+static int read_buffered( lua_State* L, tinylport* port,
+                          tinylthread* thread, size_t want,
+                          int block, struct timespec const* deadline ) {
+  int r = 0;
+  int timedout = 0;
+  int disabled = 0;
+  size_t n = 0;
+  /* like the mutex-based version, check for interrupts even if the
+   * value is available right away */
+  if( block && is_interrupted( thread, &disabled ) )
+    throw_interrupt( L );
+  while( r == 0 && n < want ) {
+    size_t pos = 0;
+    tinylcell* cell = claim_cell( port->s, &(port->s->deq_pos), 1,
+                                  &pos );
+    if( !cell ) {
+      if( n > 0 ) /* don't block if we already have something */
+        break;
+      if( !block )
+        return (queue_is_empty( port->s ) &&
+                port->s->wports == 0) ? PORT_BROKEN : 0;
+      if( timedout )
+        return PORT_TIMEOUT;
+      timedout = park_receiver( L, port, thread, &disabled,
+                                deadline ) != 0;
+      continue;
+    }
+    /* cells without a value are left by failed writes; the value is
+     * consumed even if copying it fails */
+    if( cell->kind == TLT_CELL_STATE ) {
+      r = lua_cpcallr( L, copy_stack_top, cell->L, 1 );
+      if( clear_slot( cell->L ) )
+        lua_gc( cell->L, LUA_GCCOLLECT, 0 );
+      n++;
+    } else if( cell->kind != TLT_CELL_EMPTY ) {
+      r = push_inline( L, cell );
+      n++;
+    }
+    cell->kind = TLT_CELL_EMPTY;
+    atomic_store_explicit( &(cell->seq), pos + port->s->size,
+                           memory_order_release );
+  }
+  if( n > 0 )
+    wake_parked( port->s, &(port->s->parked_senders),
+                 &(port->s->waiting_senders), n > 1 );
+  if( r != 0 )
+    lua_error( L );
+  return (int)n;
+}
+
+
+static int write_buffered( lua_State* L, tinylport* port,
+                           tinylthread* thread, copy_data* data,
+                           int block, struct timespec const* deadline ) {
+  int total = data->n;
+  int n = 0;
+  int timedout = 0;
+  int disabled = 0;
+  if( block && is_interrupted( thread, &disabled ) )
+    throw_interrupt( L );
+  while( data->n > 0 ) {
+    size_t pos = 0;
+    tinylcell* cell = NULL;
+    int ok = 0;
+    if( port->s->rports == 0 ) { /* no more receivers alive */
+      wake_parked( port->s, &(port->s->parked_receivers),
+                   &(port->s->waiting_receivers), n > 1 );
+      luaL_error( L, "broken pipe" );
+    }
+    cell = claim_cell( port->s, &(port->s->enq_pos), 0, &pos );
+    if( !cell ) {
+      if( n > 0 )
+        wake_parked( port->s, &(port->s->parked_receivers),
+                     &(port->s->waiting_receivers), n > 1 );
+      n = 0;
+      if( timedout || !block )
+        return PORT_TIMEOUT;
+      timedout = park_sender( L, port, thread, &disabled,
+                              deadline ) != 0;
+      continue;
+    }
+    ok = store_inline( cell, data->L, data->first );
+    if( !ok ) {
+      copy_data one = *data;
+      one.n = 1;
+      if( !cell->L )
+        cell->L = new_slot_state();
+      ok = cell->L && 0 == lua_cpcallr( cell->L, copy_values, &one, 1 );
+      if( ok )
+        cell->kind = TLT_CELL_STATE;
+    }
+    if( ok ) {
+      atomic_store_explicit( &(cell->seq), pos+1, memory_order_release );
+      n++;
+      data->first++;
+      data->n--;
+      continue;
+    }
+    /* the claimed cell must be published anyway, but without a
+     * value, so that receivers skip it */
+    if( cell->L ) {
+      int res = lua_cpcallr( L, copy_stack_top, cell->L, 1 );
+      if( clear_slot( cell->L ) )
+        lua_gc( cell->L, LUA_GCCOLLECT, 0 );
+      if( res != 0 )
+        lua_pushliteral( L, "unknown error" );
+    } else
+      lua_pushliteral( L, "memory allocation error" );
+    atomic_store_explicit( &(cell->seq), pos+1, memory_order_release );
+    wake_parked( port->s, &(port->s->parked_receivers),
+                 &(port->s->waiting_receivers), 1 );
+    lua_error( L );
+  }
+  wake_parked( port->s, &(port->s->parked_receivers),
+               &(port->s->waiting_receivers), n > 1 );
+  return total;
+}
+
+#else /* no atomics */
+
+static int read_buffered( lua_State* L, tinylport* port,
+                          tinylthread* thread, size_t want,
+                          int block, struct timespec const* deadline ) {
+  lua_State* slotL = NULL;
+  lua_State* garbage = NULL;
+  int itr = 0;
+  int disabled = 0;
+  int r = 0;
+  int res = thrd_success;
+  size_t n = 0;
+  mtx_lock_or_throw( L, &(port->s->mutex) );
+  while( block && !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         port->s->count == 0 &&
+         port->s->wports > 0 ) {
+    set_block( thread, &(port->s->ref), &(port->s->waiting_receivers),
+               &(port->s->mutex) );
+    res = cnd_wait_until( &(port->s->waiting_receivers),
+                          &(port->s->mutex), deadline,
+                          &(port->s->wait) );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "waiting for data failed" );
+    }
+  }
+  if( itr ) { /* handle interrupt request */
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    throw_interrupt( L );
+  }
+  if( port->s->count == 0 ) {
+    int broken = port->s->wports == 0;
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    if( broken && block )
+      luaL_error( L, "broken pipe" ); /* no more senders alive */
+    if( broken )
+      return PORT_BROKEN;
+    return block ? PORT_TIMEOUT : 0;
+  }
+  while( r == 0 && n < want && port->s->count > 0 && !garbage ) {
+    tinylcell* cell = port->s->buffer + port->s->head;
+    slotL = cell->L;
+    /* the value is consumed even if copying it failed; a slot that
+     * needs collecting is closed after unlocking (and replaced by
+     * the next writer) */
+    if( cell->kind == TLT_CELL_STATE ) {
+      r = lua_cpcallr( L, copy_stack_top, slotL, 1 );
+      if( clear_slot( slotL ) ) {
+        cell->L = NULL;
+        garbage = slotL;
+      }
+    } else
+      r = push_inline( L, cell );
+    cell->kind = TLT_CELL_EMPTY;
+    port->s->head = (port->s->head + 1) % port->s->capacity;
+    port->s->count--;
+    n++;
+  }
+  if( n > 1 )
+    no_fail( cnd_broadcast( &(port->s->waiting_senders) ) );
+  else
+    no_fail( cnd_signal( &(port->s->waiting_senders) ) );
+  notify_watchers( port->s );
+  no_fail( mtx_unlock( &(port->s->mutex) ) );
+  if( garbage )
+    lua_close( garbage );
+  if( r != 0 )
+    lua_error( L );
+  return (int)n;
+}
+
+
+static int write_buffered( lua_State* L, tinylport* port,
+                           tinylthread* thread, copy_data* data,
+                           int block, struct timespec const* deadline ) {
+  lua_State* slotL = NULL;
+  int total = data->n;
+  int n = 0;
+  size_t i = 0;
+  int itr = 0;
+  int disabled = 0;
+  int res = thrd_success;
+  mtx_lock_or_throw( L, &(port->s->mutex) );
+  while( data->n > 0 ) {
+    while( block && !(itr=is_interrupted( thread, &disabled )) &&
+           res != thrd_timedout &&
+           port->s->count == port->s->capacity &&
+           port->s->rports > 0 ) {
+      set_block( thread, &(port->s->ref), &(port->s->waiting_senders),
+                 &(port->s->mutex) );
+      res = cnd_wait_until( &(port->s->waiting_senders),
+                            &(port->s->mutex), deadline,
+                            &(port->s->wait) );
+      set_block( thread, NULL, NULL, NULL );
+      if( res != thrd_success && res != thrd_timedout ) {
+        no_fail( mtx_unlock( &(port->s->mutex) ) );
+        luaL_error( L, "waiting for buffer space failed" );
+      }
+    }
+    if( itr ) { /* handle interrupt request */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      throw_interrupt( L );
+    }
+    if( port->s->rports == 0 ) { /* no more receivers alive */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "broken pipe" );
+    }
+    if( port->s->count == port->s->capacity ) { /* no space left */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      return PORT_TIMEOUT;
+    }
+    /* fill as much of the free buffer space as possible */
+    for( n = 0; data->n > 0 &&
+                port->s->count < port->s->capacity; ++n ) {
+      copy_data one = *data;
+      one.n = 1;
+      i = (port->s->head + port->s->count) % port->s->capacity;
+      if( store_inline( port->s->buffer + i, data->L, data->first ) ) {
+        port->s->count++;
+        data->first++;
+        data->n--;
+        continue;
+      }
+      if( !port->s->buffer[ i ].L ) {
+        port->s->buffer[ i ].L = new_slot_state();
+        if( !port->s->buffer[ i ].L ) {
+          no_fail( mtx_unlock( &(port->s->mutex) ) );
+          luaL_error( L, "memory allocation error" );
+        }
+      }
+      slotL = port->s->buffer[ i ].L;
+      if( 0 != lua_cpcallr( slotL, copy_values, &one, 1 ) ) {
+        int res = lua_cpcallr( L, copy_stack_top, slotL, 1 );
+        int collect = clear_slot( slotL );
+        if( collect )
+          port->s->buffer[ i ].L = NULL;
+        if( n > 0 ) {
+          no_fail( cnd_broadcast( &(port->s->waiting_receivers) ) );
+          notify_watchers( port->s );
+        }
+        no_fail( mtx_unlock( &(port->s->mutex) ) );
+        if( collect )
+          lua_close( slotL );
+        if( res != 0 )
+          lua_pushliteral( L, "unknown error" );
+        lua_error( L );
+      }
+      port->s->buffer[ i ].kind = TLT_CELL_STATE;
+      port->s->count++;
+      data->first++;
+      data->n--;
+    }
+    if( n > 1 )
+      no_fail( cnd_broadcast( &(port->s->waiting_receivers) ) );
+    else
+      no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
+    notify_watchers( port->s );
+  }
+  no_fail( mtx_unlock( &(port->s->mutex) ) );
+  return total;
+}
+
+#endif /* TLT_HAVE_ATOMICS */
+
+
+/* copies up to `want` values offered by a sender that waits for a
+ * receiver (the port mutex must be held) */
+static int take_offer( lua_State* L, tinylport* port, size_t want ) {
+  copy_data* offer = port->s->offer;
+  copy_data chunk = *offer;
+  if( (size_t)chunk.n > want )
+    chunk.n = (int)want;
+  if( 0 != lua_cpcallr( L, copy_values, &chunk, LUA_MULTRET ) ) {
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    lua_error( L );
+  }
+  offer->first += chunk.n;
+  offer->n -= chunk.n;
+  if( offer->n == 0 )
+    port->s->offer = NULL;
+  /* wake up the sender (and the others, they just wait again) */
+  no_fail( cnd_broadcast( &(port->s->waiting_senders) ) );
+  return chunk.n;
+}
+
+
+static int read_direct( lua_State* L, tinylport* port,
+                        tinylthread* thread, size_t want, int block,
+                        struct timespec const* deadline ) {
+  int itr = 0;
+  int disabled = 0;
+  int res = thrd_success;
+  int base = lua_gettop( L );
+  mtx_lock_or_throw( L, &(port->s->mutex) );
+  if( !block ) {
+    /* don't wait for a sender thread to copy the values, take them
+     * from a waiting sender directly (if there is one) */
+    int broken = port->s->wports == 0;
+    int n = 0;
+    if( port->s->L == NULL && port->s->offer != NULL )
+      n = take_offer( L, port, want );
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    if( n > 0 )
+      return n;
+    return broken ? PORT_BROKEN : 0;
+  }
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         port->s->L != NULL &&
+         port->s->wports > 0 ) {
+    set_block( thread, &(port->s->ref), &(port->s->waiting_receivers),
+               &(port->s->mutex) );
+    res = cnd_wait_until( &(port->s->waiting_receivers),
+                          &(port->s->mutex), deadline,
+                          &(port->s->wait) );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "waiting for port access failed" );
+    }
+  }
+  if( itr ) { /* handle interrupt request */
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    throw_interrupt( L );
+  }
+  if( port->s->wports == 0 ) { /* no more senders alive */
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    luaL_error( L, "broken pipe" );
+  }
+  if( port->s->L != NULL ) { /* timed out */
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    return PORT_TIMEOUT;
+  }
+  port->s->L = L;
+  port->s->want = want;
+  if( thrd_success !=
+      cnd_signal( &(port->s->waiting_senders) ) ) {
+    port->s->L = NULL;
+    no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    luaL_error( L, "waking up sender thread failed" );
+  }
+  notify_watchers( port->s );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout &&
+         port->s->L == L &&
+         port->s->wports > 0 ) {
+    set_block( thread, &(port->s->ref), &(port->s->data_copied),
+               &(port->s->mutex) );
+    res = cnd_wait_until( &(port->s->data_copied),
+                          &(port->s->mutex), deadline,
+                          &(port->s->wait) );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      port->s->L = NULL;
+      no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "waiting for data transfer failed" );
+    }
+  }
+  if( port->s->L == L ) { /* no data received */
+    int broken = port->s->wports == 0;
+    /* make room for the next receiver */
+    port->s->L = NULL;
+    no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
+    notify_watchers( port->s );
+    no_fail( mtx_unlock( &(port->s->mutex) ) );
+    if( itr ) /* handle interrupt request */
+      throw_interrupt( L );
+    if( broken )
+      luaL_error( L, "broken pipe" );
+    return PORT_TIMEOUT;
+  }
+  no_fail( mtx_unlock( &(port->s->mutex) ) );
+  return lua_gettop( L ) - base;
+}
+
+
+static int write_direct( lua_State* L, tinylport* port,
+                         tinylthread* thread, copy_data* data,
+                         int block, struct timespec const* deadline ) {
+  int total = data->n;
+  int itr = 0;
+  int disabled = 0;
+  int res = thrd_success;
+  mtx_lock_or_throw( L, &(port->s->mutex) );
+  while( data->n > 0 ) {
+    copy_data chunk;
+    if( !block && port->s->L == NULL && port->s->rports > 0 ) {
+      /* no receiver waiting right now */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      return PORT_TIMEOUT;
+    }
+    port->s->senders++;
+    if( port->s->L == NULL ) /* receivers in `select` may take it */
+      notify_watchers( port->s );
+    while( !(itr=is_interrupted( thread, &disabled )) &&
+           res != thrd_timedout &&
+           port->s->L == NULL &&
+           port->s->rports > 0 &&
+           data->n > 0 ) {
+      /* non-blocking receivers may take the values meanwhile */
+      if( port->s->offer == NULL ) {
+        port->s->offer = data;
+        notify_watchers( port->s );
+      }
+      set_block( thread, &(port->s->ref), &(port->s->waiting_senders),
+                 &(port->s->mutex) );
+      res = cnd_wait_until( &(port->s->waiting_senders),
+                            &(port->s->mutex), deadline,
+                            &(port->s->wait) );
+      set_block( thread, NULL, NULL, NULL );
+      if( res != thrd_success && res != thrd_timedout ) {
+        if( port->s->offer == data )
+          port->s->offer = NULL;
+        port->s->senders--;
+        no_fail( mtx_unlock( &(port->s->mutex) ) );
+        luaL_error( L, "waiting for a receiver thread failed" );
+      }
+    }
+    if( port->s->offer == data ) {
+      port->s->offer = NULL;
+      /* let another waiting sender offer its values */
+      if( port->s->senders > 1 )
+        no_fail( cnd_broadcast( &(port->s->waiting_senders) ) );
+    }
+    port->s->senders--;
+    if( data->n == 0 ) /* taken by non-blocking receivers */
+      break;
+    if( itr ) { /* handle interrupt request */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      throw_interrupt( L );
+    }
+    if( port->s->rports == 0 ) { /* no more receivers alive */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "broken pipe" );
+    }
+    if( port->s->L == NULL ) { /* timed out */
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      return PORT_TIMEOUT;
+    }
+    /* copy as many values as the receiver wants */
+    chunk = *data;
+    if( (size_t)chunk.n > port->s->want )
+      chunk.n = (int)port->s->want;
+    if( 0 != lua_cpcallr( port->s->L, copy_values, &chunk,
+                          LUA_MULTRET ) ) {
+      int res = lua_cpcallr( L, copy_stack_top, port->s->L, 1 );
+      lua_pop( port->s->L, 1 ); /* remove error object */
+      /* leave the receiver to other senders */
+      no_fail( cnd_signal( &(port->s->waiting_senders) ) );
+      no_fail( cnd_broadcast( &(port->s->data_copied) ) );
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      if( res != 0 )
+        lua_pushliteral( L, "unknown error" );
+      lua_error( L );
+    }
+    /* signal waiting receiver */
+    if( thrd_success !=
+        cnd_signal( &(port->s->data_copied) ) ) {
+      lua_pop( port->s->L, chunk.n );
+      no_fail( mtx_unlock( &(port->s->mutex) ) );
+      luaL_error( L, "waking up receiver thread failed" );
+    }
+    port->s->L = NULL;
+    no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
+    notify_watchers( port->s );
+    data->first += chunk.n;
+    data->n -= chunk.n;
+  }
+  no_fail( mtx_unlock( &(port->s->mutex) ) );
+  return total;
+}
+
+
+/* returns the number of values read or PORT_TIMEOUT */
+static int read_values( lua_State* L, size_t want ) {
+  tinylport* port = check_rport( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  luaL_checkstack( L, (int)want+LUA_MINSTACK, "too many values" );
+  if( port->timeout >= 0 )
+    dl = make_deadline( L, &deadline, port->timeout );
+  if( port->s->capacity > 0 )
+    return read_buffered( L, port, thread, want, 1, dl );
+  else
+    return read_direct( L, port, thread, want, 1, dl );
+}
+
+
+/* updates the message and byte (of strings and buffers) counts of a
+ * port after n values have been written */
+static void count_messages( tinylport* port, copy_data const* data,
+                            int first, int n ) {
+#ifdef TLT_HAVE_STATS
+  if( stats_on() && n > 0 ) {
+    size_t nbytes = 0;
+    int i = 0;
+    for( i = 0; i < n; ++i ) {
+      int idx = first+i;
+      tinylbuffer* buffer = NULL;
+      if( data->tidx != 0 ) {
+        lua_rawgeti( data->L, data->tidx, idx );
+        idx = lua_gettop( data->L );
+      }
+      if( lua_type( data->L, idx ) == LUA_TSTRING )
+        nbytes += lua_rawlen( data->L, idx );
+      else if( (buffer = test_udata( data->L, idx, TLT_BUF_NAME )) )
+        nbytes += buffer->len;
+      if( data->tidx != 0 )
+        lua_pop( data->L, 1 );
+    }
+    stat_count( port->s->messages, messages, (unsigned long long)n );
+    stat_count( port->s->bytes, bytes, nbytes );
+  }
+#else
+  (void)port;
+  (void)data;
+  (void)first;
+  (void)n;
+#endif
+}
+
+
+/* sends the values described by `data` and returns `true` (or, with
+ * `count` set, the number of values sent); on synchronous pipes the
+ * values are handed over in chunks as the receivers accept them, so
+ * the values of concurrent multi-value writes may interleave */
+static int write_values( lua_State* L, copy_data* data, int count ) {
+  tinylport* port = check_wport( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int total = data->n;
+  int first = data->first;
+  int n = 0;
+  if( data->n <= 0 ) {
+    if( count )
+      lua_pushinteger( L, 0 );
+    else
+      lua_pushboolean( L, 1 );
+    return 1;
+  }
+  if( port->timeout >= 0 )
+    dl = make_deadline( L, &deadline, port->timeout );
+  if( port->s->capacity > 0 )
+    n = write_buffered( L, port, thread, data, 1, dl );
+  else
+    n = write_direct( L, port, thread, data, 1, dl );
+  if( n == PORT_TIMEOUT ) {
+    count_messages( port, data, first, total - data->n );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    lua_pushinteger( L, total - data->n );
+    return 3;
+  }
+  count_messages( port, data, first, n );
+  if( count )
+    lua_pushinteger( L, n );
+  else
+    lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+#ifdef TLT_HAVE_YIELDK
+static int watch_port( tinylport* port, tinylwatcher* w );
+static int task_read( lua_State* L, tinyltask* task, tinylport* port,
+                      size_t want, struct timespec const* dl );
+static int task_write( lua_State* L, tinyltask* task, int written,
+                       struct timespec const* dl );
+
+TLT_KFUNCTION( continue_read ) {
+  tinyltask* task = current_task( L );
+  (void)ctx;
+  if( task->is_timedout ) {
+    task->is_timedout = 0;
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  return task_read( L, task, check_rport( L, 1 ),
+                    (size_t)luaL_optinteger( L, 2, 1 ),
+                    task->has_deadline ? &(task->deadline) : NULL );
+}
+
+TLT_KFUNCTION( continue_write ) {
+  tinyltask* task = current_task( L );
+  if( task->is_timedout ) {
+    task->is_timedout = 0;
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    lua_pushinteger( L, (int)ctx );
+    return 3;
+  }
+  return task_write( L, task, (int)ctx,
+                     task->has_deadline ? &(task->deadline) : NULL );
+}
+
+
+/* reads from a buffered port in a scheduler task: instead of blocking
+ * the worker thread, the task yields until the port becomes ready
+ * (and then tries again) or the deadline has passed */
+static int task_read( lua_State* L, tinyltask* task, tinylport* port,
+                      size_t want, struct timespec const* dl ) {
+  lua_settop( L, 2 );
+  luaL_checkstack( L, (int)want+LUA_MINSTACK, "too many values" );
+  for( ;; ) {
+    int r = read_buffered( L, port, NULL, want, 0, NULL );
+    if( r == PORT_BROKEN )
+      luaL_error( L, "broken pipe" );
+    if( r > 0 )
+      return r;
+    if( !watch_port( port, &(task->w) ) ) {
+      task->port = port;
+      set_task_deadline( task, dl );
+      return lua_yieldk( L, 0, 0, continue_read );
+    }
+  }
+}
+
+
+/* writes as many of the values above index 1 to a buffered port as
+ * possible without blocking, removes them from the stack and adds
+ * their number to `written`; returns non-zero if all values have been
+ * written */
+static int write_available( lua_State* L, tinylport* port,
+                            int* written ) {
+  copy_data data;
+  int r = 0;
+  int i = 0;
+  data.L = L;
+  data.tidx = 0;
+  data.first = 2;
+  data.n = lua_gettop( L )-1;
+  r = write_buffered( L, port, NULL, &data, 0, NULL );
+  count_messages( port, &data, 2, data.first-2 );
+  *written += data.first-2;
+  for( i = 2; i < data.first; ++i )
+    lua_remove( L, 2 );
+  return r != PORT_TIMEOUT;
+}
+
+
+/* writes the values at the top of the stack to a buffered port in a
+ * scheduler task; the number of values written so far is kept in the
+ * continuation context */
+static int task_write( lua_State* L, tinyltask* task, int written,
+                       struct timespec const* dl ) {
+  tinylport* port = check_wport( L, 1 );
+  for( ;; ) {
+    if( write_available( L, port, &written ) ) {
+      lua_pushboolean( L, 1 );
+      return 1;
+    }
+    if( !watch_port( port, &(task->w) ) ) {
+      task->port = port;
+      set_task_deadline( task, dl );
+      return lua_yieldk( L, 0, written, continue_write );
+    }
+  }
+}
+#endif
+
+
+static int tinylport_read( lua_State* L ) {
+  lua_Integer n = luaL_optinteger( L, 2, 1 );
+  int r = 0;
+  luaL_argcheck( L, n > 0 && n <= TLT_BATCH_MAX, 2, "invalid count" );
+#ifdef TLT_HAVE_YIELDK
+  {
+    tinylport* port = check_rport( L, 1 );
+    tinyltask* task = current_task( L );
+    if( task != NULL && port->s->capacity > 0 ) {
+      struct timespec deadline;
+      struct timespec* dl = NULL;
+      if( port->timeout >= 0 )
+        dl = make_deadline( L, &deadline, port->timeout );
+      return task_read( L, task, port, (size_t)n, dl );
+    }
+  }
+#endif
+  lua_settop( L, 1 );
+  r = read_values( L, (size_t)n );
+  if( r == PORT_TIMEOUT ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  return r;
+}
+
+
+static int tinylport_readall( lua_State* L ) {
+  int n = 0;
+  int i = 0;
+  lua_settop( L, 1 );
+  n = read_values( L, TLT_BATCH_MAX );
+  if( n == PORT_TIMEOUT ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  lua_createtable( L, n, 0 );
+  lua_insert( L, -n-1 );
+  for( i = n; i > 0; --i )
+    lua_rawseti( L, -i-1, i );
+  lua_pushinteger( L, n );
+  return 2;
+}
+
+
+static int tinylport_write( lua_State* L ) {
+  copy_data data;
+  tinylport* port = check_wport( L, 1 );
+  luaL_checkany( L, 2 );
+#ifdef TLT_HAVE_YIELDK
+  {
+    tinyltask* task = current_task( L );
+    if( task != NULL && port->s->capacity > 0 ) {
+      struct timespec deadline;
+      struct timespec* dl = NULL;
+      if( port->timeout >= 0 )
+        dl = make_deadline( L, &deadline, port->timeout );
+      return task_write( L, task, 0, dl );
+    }
+  }
+#else
+  (void)port;
+#endif
+  data.L = L;
+  data.tidx = 0;
+  data.first = 2;
+  data.n = lua_gettop( L )-1;
+  return write_values( L, &data, 0 );
+}
+
+
+/* reads a single value if that is possible without waiting */
+static int tinylport_tryread( lua_State* L ) {
+  tinylport* port = check_rport( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int r = 0;
+  lua_settop( L, 1 );
+  lua_pushboolean( L, 1 );
+  luaL_checkstack( L, LUA_MINSTACK, "too many values" );
+  if( port->s->capacity > 0 )
+    r = read_buffered( L, port, thread, 1, 0, NULL );
+  else
+    r = read_direct( L, port, thread, 1, 0, NULL );
+  if( r == PORT_BROKEN )
+    luaL_error( L, "broken pipe" );
+  if( r == 0 ) {
+    lua_pushboolean( L, 0 );
+    return 1;
+  }
+  return 2;
+}
+
+
+/* writes a single value if that is possible without waiting */
+static int tinylport_trywrite( lua_State* L ) {
+  tinylport* port = check_wport( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  copy_data data;
+  int r = 0;
+  luaL_checkany( L, 2 );
+  lua_settop( L, 2 );
+  data.L = L;
+  data.tidx = 0;
+  data.first = 2;
+  data.n = 1;
+  if( port->s->capacity > 0 )
+    r = write_buffered( L, port, thread, &data, 0, NULL );
+  else
+    r = write_direct( L, port, thread, &data, 0, NULL );
+  if( r != PORT_TIMEOUT )
+    count_messages( port, &data, 2, 1 );
+  lua_pushboolean( L, r != PORT_TIMEOUT );
+  return 1;
+}
+
+
+/* sets the timeout for all following reads/writes via this handle */
+static int tinylport_settimeout( lua_State* L ) {
+  tinylport* port = test_udata( L, 1, TLT_RPORT_NAME );
+  lua_Number t = luaL_optnumber( L, 2, -1 );
+  if( !port )
+    port = check_wport( L, 1 );
+  luaL_argcheck( L, lua_isnoneornil( L, 2 ) || t >= 0, 2,
+                 "non-negative number expected" );
+  port->timeout = lua_isnoneornil( L, 2 ) ? -1 : t;
+  return 0;
+}
+
+
+/* both ends of a pipe share the same statistics */
+static int tinylport_stats( lua_State* L ) {
+  tinylport* port = test_udata( L, 1, TLT_RPORT_NAME );
+  if( !port )
+    port = check_wport( L, 1 );
+  lua_createtable( L, 0, 5 );
+  set_stat_field( L, "messages", stat_get( port->s->messages ) );
+  set_stat_field( L, "bytes", stat_get( port->s->bytes ) );
+  push_wait_stats( L, &(port->s->wait) );
+  return 1;
+}
+
+
+static int tinylport_writev( lua_State* L ) {
+  copy_data data;
+  lua_Integer i = 0;
+  lua_Integer j = 0;
+  check_wport( L, 1 );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  i = luaL_optinteger( L, 3, 1 );
+  j = luaL_optinteger( L, 4, (lua_Integer)lua_rawlen( L, 2 ) );
+  luaL_argcheck( L, i >= 1 && i <= INT_MAX, 3, "invalid start index" );
+  luaL_argcheck( L, j < i || j-i < INT_MAX, 4, "too many values" );
+  lua_settop( L, 2 );
+  data.L = L;
+  data.tidx = 2;
+  data.first = (int)i;
+  data.n = j < i ? 0 : (int)(j-i+1);
+  return write_values( L, &data, 1 );
+}
+
+
+/* checks whether reading from/writing to a port would complete right
+ * away (or fail with a broken pipe); the port mutex must be held */
+static int port_is_ready( tinylport* port ) {
+  tinylport_shared* s = port->s;
+  if( port->is_reader ) {
+    if( s->wports == 0 )
+      return 1;
+    if( s->capacity > 0 )
+#ifdef TLT_HAVE_ATOMICS
+      return !queue_is_empty( s );
+#else
+      return s->count > 0;
+#endif
+    return s->L == NULL && s->offer != NULL; /* see `take_offer` */
+  } else {
+    if( s->rports == 0 )
+      return 1;
+    if( s->capacity > 0 )
+#ifdef TLT_HAVE_ATOMICS
+      return !queue_is_full( s );
+#else
+      return s->count < s->capacity;
+#endif
+    return s->L != NULL;
+  }
+}
+
+
+typedef struct {
+  tinylport* port;
+  tinylwatcher w;
+  char is_registered;
+} select_entry;
+
+/* returns non-zero if the port is ready, registers the watcher
+ * otherwise */
+static int watch_port( tinylport* port, tinylwatcher* w ) {
+  tinylport_shared* s = port->s;
+  int ready = 0;
+  no_fail( mtx_lock( &(s->mutex) ) );
+#ifdef TLT_HAVE_ATOMICS
+  /* count as parked, so that the other side takes the mutex to wake
+   * us up */
+  if( s->capacity > 0 ) {
+    atomic_fetch_add( port->is_reader ? &(s->parked_receivers)
+                                      : &(s->parked_senders), 1 );
+    atomic_thread_fence( memory_order_seq_cst );
+  }
+#endif
+  ready = port_is_ready( port );
+  if( ready ) {
+#ifdef TLT_HAVE_ATOMICS
+    if( s->capacity > 0 )
+      atomic_fetch_sub( port->is_reader ? &(s->parked_receivers)
+                                        : &(s->parked_senders), 1 );
+#endif
+  } else {
+    w->next = s->watchers;
+    s->watchers = w;
+  }
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  return ready;
+}
+
+static void unwatch_port( tinylport_shared* s, int is_reader,
+                          tinylwatcher* w ) {
+  tinylwatcher** p = NULL;
+  no_fail( mtx_lock( &(s->mutex) ) );
+  for( p = &(s->watchers); *p != NULL; p = &((*p)->next) ) {
+    if( *p == w ) {
+      *p = w->next;
+      break;
+    }
+  }
+#ifdef TLT_HAVE_ATOMICS
+  if( s->capacity > 0 )
+    atomic_fetch_sub( is_reader ? &(s->parked_receivers)
+                                : &(s->parked_senders), 1 );
+#else
+  (void)is_reader;
+#endif
+  no_fail( mtx_unlock( &(s->mutex) ) );
+}
+
+
+
+#ifdef TLT_HAVE_YIELDK
+/* checks whether the running coroutine may yield from a C function
+ *
+ * Lua 5.2 has no lua_isyieldable, so there every coroutine except the
+ * main one counts as yieldable. If the coroutine calls through a C
+ * function without continuation (e.g. a callback of `table.sort` or
+ * `string.gsub`), the `y*` methods raise "attempt to yield across a
+ * C-call boundary" instead of falling back to blocking the thread.
+ * The same goes for port and mutex operations in scheduler tasks. */
+static int can_yield( lua_State* L ) {
+#if LUA_VERSION_NUM >= 503
+  return lua_isyieldable( L );
+#else
+  int is_main = lua_pushthread( L );
+  lua_pop( L, 1 );
+  return !is_main;
+#endif
+}
+
+
+/* creates a token that keeps the handle at index `hidx` alive */
+static tinyltoken* new_token( lua_State* L, int hidx ) {
+  tinyltoken* token = lua_newuserdata( L, sizeof( *token ) );
+  token->port = NULL;
+  token->mutex = NULL;
+  token->count = 0;
+  token->w.sel = &(token->sel);
+  token->w.next = NULL;
+  token->w.next_notified = NULL;
+  token->w.is_notified = 0;
+  token->sel.notified = NULL;
+  token->sel.is_changed = 0;
+  if( thrd_success != mtx_init( &(token->sel.mutex), mtx_plain ) )
+    luaL_error( L, "mutex initialization failed" );
+  if( thrd_success != cnd_init( &(token->sel.changed) ) ) {
+    mtx_destroy( &(token->sel.mutex) );
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  luaL_setmetatable( L, TLT_TOKEN_NAME );
+#if LUA_VERSION_NUM == 502
+  /* Lua 5.2 only allows tables as uservalues */
+  lua_createtable( L, 1, 0 );
+  lua_pushvalue( L, hidx );
+  lua_rawseti( L, -2, 1 );
+#else
+  lua_pushvalue( L, hidx );
+#endif
+  lua_setuservalue( L, -2 );
+  return token;
+}
+
+
+/* registers the token's watcher at the port and takes a reference to
+ * the shared port, so that it can be unregistered even if the handle
+ * is finalized first; returns non-zero if the port is ready instead */
+static int watch_port_token( lua_State* L, tinyltoken* token,
+                             tinylport* port ) {
+  if( watch_port( port, &(token->w) ) )
+    return 1;
+  increment_ref_count( L, &(port->s->ref) );
+  token->port = port->s;
+  token->is_reader = port->is_reader;
+  return 0;
+}
+
+
+/* removes the token's watcher from the port or mutex and drops the
+ * reference to it */
+static void release_token( lua_State* L, tinyltoken* token ) {
+  if( token->port != NULL ) {
+    unwatch_port( token->port, token->is_reader, &(token->w) );
+    unref_port( L, token->port );
+  } else if( token->mutex != NULL ) {
+    unwatch_mutex( token->mutex, &(token->w) );
+    unref_mutex( L, token->mutex );
+  }
+  token->port = NULL;
+  token->mutex = NULL;
+}
+
+
+static int tinyltoken_gc( lua_State* L ) {
+  tinyltoken* token = lua_touserdata( L, 1 );
+  release_token( L, token );
+  mtx_destroy( &(token->sel.mutex) );
+  cnd_destroy( &(token->sel.changed) );
+  return 0;
+}
+
+
+/* checks whether the operation that yielded the token may continue */
+static int tinyltoken_ready( lua_State* L ) {
+  tinyltoken* token = luaL_checkudata( L, 1, TLT_TOKEN_NAME );
+  int ready = 0;
+  no_fail( mtx_lock( &(token->sel.mutex) ) );
+  ready = token->sel.is_changed;
+  no_fail( mtx_unlock( &(token->sel.mutex) ) );
+  lua_pushboolean( L, ready );
+  return 1;
+}
+
+
+/* blocks the thread until the token is ready (for dispatchers that
+ * have nothing else to do) */
+static int tinyltoken_wait( lua_State* L ) {
+  tinyltoken* token = luaL_checkudata( L, 1, TLT_TOKEN_NAME );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  tinylheader* h = NULL;
+  int itr = 0;
+  int disabled = 0;
+  int res = thrd_success;
+  int ready = 0;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  if( token->port != NULL )
+    h = &(token->port->ref);
+  else if( token->mutex != NULL )
+    h = &(token->mutex->ref);
+  mtx_lock_or_throw( L, &(token->sel.mutex) );
+  /* a token that isn't registered anymore won't become ready */
+  while( h != NULL && res != thrd_timedout &&
+         !token->sel.is_changed &&
+         !(itr=is_interrupted( thread, &disabled )) ) {
+    set_block( thread, h, &(token->sel.changed), &(token->sel.mutex) );
+    res = cnd_wait_until( &(token->sel.changed), &(token->sel.mutex),
+                          dl, NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(token->sel.mutex) ) );
+      luaL_error( L, "waiting for token failed" );
+    }
+  }
+  ready = token->sel.is_changed;
+  no_fail( mtx_unlock( &(token->sel.mutex) ) );
+  if( itr )
+    throw_interrupt( L );
+  lua_pushboolean( L, ready );
+  return 1;
+}
+
+
+static int tinylport_yread( lua_State* L );
+static int ywrite_values( lua_State* L, int written );
+static int tinylmutex_ylock( lua_State* L );
+
+TLT_KFUNCTION( continue_yread ) {
+  (void)ctx;
+  release_token( L, lua_touserdata( L, 3 ) );
+  lua_settop( L, 2 );
+  return tinylport_yread( L );
+}
+
+TLT_KFUNCTION( continue_ywrite ) {
+  tinyltoken* token = lua_touserdata( L, (int)ctx );
+  int written = token->count;
+  release_token( L, token );
+  lua_settop( L, (int)ctx-1 );
+  return ywrite_values( L, written );
+}
+
+TLT_KFUNCTION( continue_ylock ) {
+  (void)ctx;
+  release_token( L, lua_touserdata( L, 2 ) );
+  lua_settop( L, 1 );
+  return tinylmutex_ylock( L );
+}
+
+
+/* like `read`, but a coroutine yields a token instead of blocking
+ * the thread while the (buffered) port is empty, and tries again
+ * when it is resumed */
+static int tinylport_yread( lua_State* L ) {
+  tinylport* port = check_rport( L, 1 );
+  lua_Integer n = luaL_optinteger( L, 2, 1 );
+  luaL_argcheck( L, n > 0 && n <= TLT_BATCH_MAX, 2, "invalid count" );
+  if( port->s->capacity == 0 || !can_yield( L ) ||
+      current_task( L ) != NULL )
+    return tinylport_read( L );
+  lua_settop( L, 2 );
+  luaL_checkstack( L, (int)n+LUA_MINSTACK, "too many values" );
+  for( ;; ) {
+    tinyltoken* token = NULL;
+    int r = read_buffered( L, port, NULL, (size_t)n, 0, NULL );
+    if( r == PORT_BROKEN )
+      luaL_error( L, "broken pipe" );
+    if( r > 0 )
+      return r;
+    token = new_token( L, 1 );
+    if( !watch_port_token( L, token, port ) ) {
+      lua_pushvalue( L, -1 );
+      return lua_yieldk( L, 1, 0, continue_yread );
+    }
+    lua_settop( L, 2 );
+  }
+}
+
+
+static int ywrite_values( lua_State* L, int written ) {
+  tinylport* port = check_wport( L, 1 );
+  for( ;; ) {
+    tinyltoken* token = NULL;
+    if( write_available( L, port, &written ) ) {
+      lua_pushboolean( L, 1 );
+      return 1;
+    }
+    token = new_token( L, 1 );
+    if( !watch_port_token( L, token, port ) ) {
+      token->count = written;
+      lua_pushvalue( L, -1 );
+      return lua_yieldk( L, 1, lua_gettop( L )-1, continue_ywrite );
+    }
+    lua_pop( L, 1 );
+  }
+}
+
+
+/* like `write`, but a coroutine yields a token instead of blocking
+ * the thread while the (buffered) port is full */
+static int tinylport_ywrite( lua_State* L ) {
+  tinylport* port = check_wport( L, 1 );
+  luaL_checkany( L, 2 );
+  if( port->s->capacity == 0 || !can_yield( L ) ||
+      current_task( L ) != NULL )
+    return tinylport_write( L );
+  return ywrite_values( L, 0 );
+}
+
+
+/* like `lock`, but a coroutine yields a token instead of blocking
+ * the thread while another thread (or another coroutine using `ylock`
+ * on the same handle) holds the mutex */
+static int tinylmutex_ylock( lua_State* L ) {
+  tinylmutex* mutex = check_mutex( L, 1 );
+  tinyltoken* token = NULL;
+  if( !can_yield( L ) || current_task( L ) != NULL )
+    return tinylmutex_lock( L );
+  lua_settop( L, 1 );
+  for( ;; ) {
+    mtx_lock_or_throw( L, &(mutex->s->mutex) );
+    if( mutex->s->count == 0 || owns_mutex( mutex, L ) )
+      break;
+    if( token != NULL ) {
+      stat_count( mutex->s->contended, contended, 1 );
+      token->w.next = mutex->s->watchers;
+      mutex->s->watchers = &(token->w);
+      increment_ref_count( L, &(mutex->s->ref) );
+      no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+      token->mutex = mutex->s;
+      lua_pushvalue( L, -1 );
+      return lua_yieldk( L, 1, 0, continue_ylock );
+    }
+    /* don't allocate while holding the mutex */
+    no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+    token = new_token( L, 1 );
+  }
+  if( mutex->s->count == 0 )
+    mutex->holder = L;
+  mutex->is_owner = 1;
+  mutex->s->count++;
+  no_fail( mtx_unlock( &(mutex->s->mutex) ) );
+  stat_count( mutex->s->acquisitions, acquisitions, 1 );
+  lua_settop( L, 1 );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+#else /* Lua 5.1 can't yield from C functions */
+
+#  define tinylport_yread tinylport_read
+#  define tinylport_ywrite tinylport_write
+#  define tinylmutex_ylock tinylmutex_lock
+
+#endif
+
+
+
+static int prepare_worker_state( lua_State* childL ) {
+  lua_State* parentL = lua_touserdata( childL, 1 );
+  lua_pop( childL, 1 );
+  init_child_state( childL, parentL );
+  /* run the prelude code once for every worker */
+  if( lua_type( parentL, 2 ) == LUA_TSTRING ) {
+    size_t len = 0;
+    char const* s = lua_tolstring( parentL, 2, &len );
+    if( 0 != luaL_loadbuffer( childL, s, len, "=prelude" ) )
+      lua_error( childL );
+    lua_call( childL, 0, 0 );
+  }
+  lua_settop( childL, 0 );
+  return 0;
+}
+
+
+static void start_worker( lua_State* L, tinylpool_shared* pool ) {
+  tinylworker* w = pool->workers + pool->nworkers;
+  thrd_start_t workerf = 0;
+  w->pool = pool;
+  w->L = luaL_newstate();
+  if( !w->L )
+    luaL_error( L, "memory allocation error" );
+  push_package_paths( L );
+  if( 0 != lua_cpcallr( w->L, prepare_worker_state, L, 0 ) ) {
+    int r = lua_cpcallr( L, copy_stack_top, w->L, 1 );
+    lua_close( w->L );
+    w->L = NULL;
+    if( r != 0 )
+      lua_pushliteral( L, "thread initialization error" );
+    lua_error( L ); /* rethrow the error on this thread */
+  }
+  /* get worker main function from the worker's registry (must not
+   * raise an error!) */
+  lua_getfield( w->L, LUA_REGISTRYINDEX, TLT_WORKER );
+  workerf = (thrd_start_t)lua_tocfunction( w->L, -1 );
+  lua_pop( w->L, 1 );
+  if( thrd_success != thrd_create( &(w->thread), workerf, w ) ) {
+    lua_close( w->L );
+    w->L = NULL;
+    luaL_error( L, "thread spawning failed" );
+  }
+  pool->nworkers++;
+}
+
+
+static int tinylthread_new_pool( lua_State* L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  tinylpool* pool = NULL;
+  size_t i = 0;
+  luaL_argcheck( L, n > 0, 1, "positive number expected" );
+  luaL_argcheck( L, (uintmax_t)n <= SIZE_MAX / sizeof( tinylworker ), 1,
+                 "too many workers" );
+  luaL_optstring( L, 2, NULL ); /* the prelude code */
+  lua_settop( L, 2 );
+  pool = lua_newuserdata( L, sizeof( *pool ) );
+  pool->s = NULL;
+  luaL_setmetatable( L, TLT_POOL_NAME );
+  pool->s = malloc( sizeof( *pool->s ) );
+  if( !pool->s )
+    luaL_error( L, "memory allocation error" );
+  pool->s->head = NULL;
+  pool->s->tail = NULL;
+  pool->s->nworkers = 0;
+  pool->s->is_closed = 0;
+  pool->s->workers = malloc( (size_t)n * sizeof( tinylworker ) );
+  if( !pool->s->workers ) {
+    free( pool->s );
+    pool->s = NULL;
+    luaL_error( L, "memory allocation error" );
+  }
+  if( thrd_success != mtx_init( &(pool->s->mutex), mtx_plain ) ) {
+    free( pool->s->workers );
+    free( pool->s );
+    pool->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(pool->s->job_available) ) ) {
+    mtx_destroy( &(pool->s->mutex) );
+    free( pool->s->workers );
+    free( pool->s );
+    pool->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  /* on errors the __gc metamethod cleans up the workers started so
+   * far */
+  for( i = 0; i < (size_t)n; ++i )
+    start_worker( L, pool->s );
+  return 1;
+}
+
+
+static void close_pool( tinylpool_shared* pool ) {
+  size_t i = 0;
+  /* the workers finish all queued jobs before they exit */
+  no_fail( mtx_lock( &(pool->mutex) ) );
+  pool->is_closed = 1;
+  no_fail( cnd_broadcast( &(pool->job_available) ) );
+  no_fail( mtx_unlock( &(pool->mutex) ) );
+  for( i = 0; i < pool->nworkers; ++i ) {
+    no_fail( thrd_join( pool->workers[ i ].thread, NULL ) );
+    lua_close( pool->workers[ i ].L );
+  }
+  mtx_destroy( &(pool->mutex) );
+  cnd_destroy( &(pool->job_available) );
+  free( pool->workers );
+  free( pool );
+}
+
+
+static int tinylpool_gc( lua_State* L ) {
+  tinylpool* pool = lua_touserdata( L, 1 );
+  if( pool->s ) {
+    close_pool( pool->s );
+    pool->s = NULL;
+  }
+  return 0;
+}
+
+
+static int tinylpool_close( lua_State* L ) {
+  tinylpool* pool = check_pool( L, 1 );
+  close_pool( pool->s );
+  pool->s = NULL;
+  return 0;
+}
+
+
+static void release_job( lua_State* L, tinyljob_shared* job ) {
+  if( 0 == decrement_ref_count( L, &(job->ref) ) ) {
+    if( job->L )
+      lua_close( job->L );
+    destroy_ref_count( &(job->ref) );
+    mtx_destroy( &(job->mutex) );
+    cnd_destroy( &(job->finished) );
+    free( job );
+  }
+}
+
+
+static int tinylpool_run( lua_State* L ) {
+  tinylpool* pool = check_pool( L, 1 );
+  tinyljob* job = NULL;
+  copy_data data;
+  check_code( L, 2 );
+  data.L = L;
+  data.tidx = 0;
+  data.first = 2;
+  data.n = lua_gettop( L )-1;
+  job = lua_newuserdata( L, sizeof( *job ) );
+  job->s = NULL;
+  luaL_setmetatable( L, TLT_JOB_NAME );
+  job->s = malloc( sizeof( *job->s ) );
+  if( !job->s )
+    luaL_error( L, "memory allocation error" );
+  job->s->next = NULL;
+  job->s->L = NULL;
+  job->s->run = 0;
+  job->s->ud = NULL;
+  job->s->is_done = 0;
+  if( !init_ref_count( &(job->s->ref), 1 ) ) {
+    free( job->s );
+    job->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(job->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(job->s->ref) );
+    free( job->s );
+    job->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(job->s->finished) ) ) {
+    destroy_ref_count( &(job->s->ref) );
+    mtx_destroy( &(job->s->mutex) );
+    free( job->s );
+    job->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  job->s->L = new_slot_state();
+  if( !job->s->L )
+    luaL_error( L, "memory allocation error" );
+  /* copy code and arguments into the job's Lua state */
+  if( 0 != lua_cpcallr( job->s->L, copy_values, &data, LUA_MULTRET ) ) {
+    int r = lua_cpcallr( L, copy_stack_top, job->s->L, 1 );
+    if( r != 0 )
+      lua_pushliteral( L, "job initialization error" );
+    lua_error( L ); /* rethrow the error on this thread */
+  }
+  /* put the job into the queue and wake up a worker */
+  mtx_lock_or_throw( L, &(pool->s->mutex) );
+  increment_ref_count( L, &(job->s->ref) );
+  if( pool->s->tail )
+    pool->s->tail->next = job->s;
+  else
+    pool->s->head = job->s;
+  pool->s->tail = job->s;
+  no_fail( cnd_signal( &(pool->s->job_available) ) );
+  no_fail( mtx_unlock( &(pool->s->mutex) ) );
+  return 1;
+}
+
+
+/* runs in the worker thread, code and arguments are taken from the
+ * job's Lua state */
+static int execute_job( lua_State* L ) {
+  tinyljob_shared* job = lua_touserdata( L, 1 );
+  int i = 1;
+  int top = lua_gettop( job->L );
+  lua_pop( L, 1 );
+  luaL_checkstack( L, top+LUA_MINSTACK, "execute_job" );
+  for( i = 1; i <= top; ++i )
+    copy_value_to_thread( L, job->L, i );
+  load_code( L, 1, "=jobmain" );
+  lua_call( L, top-1, LUA_MULTRET );
+  return lua_gettop( L );
+}
+
+
+static void run_job( lua_State* L, tinyljob_shared* job ) {
+  join_data data = { 0, NULL };
+  if( job->run != 0 ) { /* internal job */
+    job->run( L, job );
+    return;
+  }
+  data.status = lua_cpcallr( L, execute_job, job, LUA_MULTRET );
+  data.L = L;
+  /* replace code and arguments with the status and return values
+   * (collect the arguments now, so that copied port handles don't
+   * prevent broken pipe detection) */
+  lua_settop( job->L, 0 );
+  lua_gc( job->L, LUA_GCCOLLECT, 0 );
+  if( 0 != lua_cpcallr( job->L, copy_return_values, &data,
+                        LUA_MULTRET ) ) {
+    lua_pushboolean( job->L, 0 );
+    lua_insert( job->L, -2 );
+  }
+  lua_settop( L, 0 );
+  no_fail( mtx_lock( &(job->mutex) ) );
+  job->is_done = 1;
+  no_fail( cnd_broadcast( &(job->finished) ) );
+  no_fail( mtx_unlock( &(job->mutex) ) );
+  release_job( L, job );
+}
+
+
+static int tinylpool_worker( void* arg ) {
+  tinylworker* w = arg;
+  tinylpool_shared* pool = w->pool;
+  tinyljob_shared* job = NULL;
+  do {
+    no_fail( mtx_lock( &(pool->mutex) ) );
+    while( pool->head == NULL && !pool->is_closed )
+      no_fail( cnd_wait( &(pool->job_available), &(pool->mutex) ) );
+    job = pool->head;
+    if( job != NULL ) {
+      pool->head = job->next;
+      if( pool->head == NULL )
+        pool->tail = NULL;
+      job->next = NULL;
+    }
+    no_fail( mtx_unlock( &(pool->mutex) ) );
+    if( job != NULL )
+      run_job( w->L, job );
+  } while( job != NULL );
+  return 0;
+}
+
+
+static int tinyljob_gc( lua_State* L ) {
+  tinyljob* job = lua_touserdata( L, 1 );
+  if( job->s ) {
+    release_job( L, job->s );
+    job->s = NULL;
+  }
+  return 0;
+}
+
+
+static int tinyljob_join( lua_State* L ) {
+  tinyljob* job = check_job( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int itr = 0;
+  int disabled = 0;
+  copy_data data;
+  mtx_lock_or_throw( L, &(job->s->mutex) );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         !job->s->is_done ) {
+    set_block( thread, &(job->s->ref), &(job->s->finished),
+               &(job->s->mutex) );
+    if( thrd_success !=
+        cnd_wait( &(job->s->finished), &(job->s->mutex) ) ) {
+      set_block( thread, NULL, NULL, NULL );
+      no_fail( mtx_unlock( &(job->s->mutex) ) );
+      luaL_error( L, "waiting for job failed" );
+    }
+    set_block( thread, NULL, NULL, NULL );
+  }
+  if( itr ) { /* handle interrupt request */
+    no_fail( mtx_unlock( &(job->s->mutex) ) );
+    throw_interrupt( L );
+  }
+  /* the results stay in the job's Lua state, so joining a job more
+   * than once is fine (keep the job handle on the stack) */
+  lua_settop( L, 1 );
+  data.L = job->s->L;
+  data.tidx = 0;
+  data.first = 1;
+  data.n = lua_gettop( job->s->L );
+  if( 0 != lua_cpcallr( L, copy_values, &data, LUA_MULTRET ) ) {
+    lua_settop( job->s->L, data.n ); /* remove leftovers on error */
+    no_fail( mtx_unlock( &(job->s->mutex) ) );
+    lua_error( L );
+  }
+  no_fail( mtx_unlock( &(job->s->mutex) ) );
+  return lua_gettop( L )-1;
+}
+
+
+static void destroy_future( tinylfuture_shared* f ) {
+  if( f->L )
+    lua_close( f->L );
+  destroy_ref_count( &(f->ref) );
+  mtx_destroy( &(f->mutex) );
+  cnd_destroy( &(f->finished) );
+  free( f );
+}
+
+
+/* takes the thread of a finished future (the future mutex must be
+ * held), so that it can be joined after unlocking */
+static tinylthread_shared* detach_future_thread( tinylfuture_shared* f ) {
+  tinylthread_shared* t = f->thread;
+  if( t == NULL || !f->is_done )
+    return NULL;
+  f->thread = NULL;
+  return t;
+}
+
+
+/* joins a thread detached from its future and closes its Lua state
+ * (without holding the future mutex, because finalizers in that state
+ * may use the future) */
+static void join_future_thread( lua_State* L, tinylthread_shared* t ) {
+  lua_State* childL = NULL;
+  if( t == NULL )
+    return;
+  no_fail( thrd_join( t->thread, NULL ) );
+  no_fail( mtx_lock( &(t->mutex) ) );
+  childL = t->L;
+  t->L = NULL;
+  no_fail( mtx_unlock( &(t->mutex) ) );
+  if( childL != NULL )
+    lua_close( childL );
+  destroy_alloc( &(t->alloc) );
+  if( 0 == decrement_ref_count( L, &(t->ref) ) ) {
+    destroy_ref_count( &(t->ref) );
+    mtx_destroy( &(t->mutex) );
+    cnd_destroy( &(t->finished) );
+    free( t );
+  }
+}
+
+
+static void release_future( lua_State* L, tinylfuture_shared* f ) {
+  if( 0 == decrement_ref_count( L, &(f->ref) ) ) {
+    /* the thread has dropped its reference, so it is done */
+    join_future_thread( L, detach_future_thread( f ) );
+    destroy_future( f );
+  }
+}
+
+
+/* runs in the thread of tlt.async after the thread main function has
+ * returned: moves the status and the return values into the future
+ * and wakes up everybody waiting for it */
+static void complete_future( lua_State* L, int status ) {
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  tinylfuture_shared* f = NULL;
+  tinylwatcher* w = NULL;
+  join_data data;
+  lua_pop( L, 1 );
+  if( thread == NULL || thread->s->future == NULL )
+    return;
+  f = thread->s->future;
+  thread->s->future = NULL;
+  data.status = status;
+  data.L = L;
+  if( 0 != lua_cpcallr( f->L, copy_return_values, &data,
+                        LUA_MULTRET ) ) {
+    lua_pushboolean( f->L, 0 );
+    lua_insert( f->L, -2 );
+  }
+  lua_settop( L, 0 );
+  no_fail( mtx_lock( &(f->mutex) ) );
+  f->is_done = 1;
+  no_fail( cnd_broadcast( &(f->finished) ) );
+  for( w = f->watchers; w != NULL; w = w->next )
+    notify_watcher( w );
+  no_fail( mtx_unlock( &(f->mutex) ) );
+  if( 0 == decrement_ref_count( L, &(f->ref) ) ) {
+    /* nobody is interested in the results anymore, so this thread
+     * has to clean up after itself like a detached thread */
+    no_fail( mtx_lock( &(thread->s->mutex) ) );
+    thread->s->is_detached = 1;
+    no_fail( mtx_unlock( &(thread->s->mutex) ) );
+    no_fail( thrd_detach( thrd_current() ) );
+    f->thread = NULL;
+    decrement_ref_count( L, &(thread->s->ref) );
+    destroy_future( f );
+    lua_gc( L, LUA_GCCOLLECT, 0 );
+  }
+}
+
+
+static int spawn_async( lua_State* L ) {
+  tinylfuture_shared* f = lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+  return new_thread( L, f );
+}
+
+
+static int tinylthread_async( lua_State* L ) {
+  tinylfuture* future = NULL;
+  tinylthread* thread = NULL;
+  int top = lua_gettop( L );
+  future = lua_newuserdata( L, sizeof( *future ) );
+  future->s = NULL;
+  luaL_setmetatable( L, TLT_FUTURE_NAME );
+  future->s = malloc( sizeof( *future->s ) );
+  if( !future->s )
+    luaL_error( L, "memory allocation error" );
+  future->s->L = NULL;
+  future->s->watchers = NULL;
+  future->s->thread = NULL;
+  future->s->is_done = 0;
+  if( !init_ref_count( &(future->s->ref), 1 ) ) {
+    free( future->s );
+    future->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != mtx_init( &(future->s->mutex), mtx_plain ) ) {
+    destroy_ref_count( &(future->s->ref) );
+    free( future->s );
+    future->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(future->s->finished) ) ) {
+    destroy_ref_count( &(future->s->ref) );
+    mtx_destroy( &(future->s->mutex) );
+    free( future->s );
+    future->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  future->s->L = new_slot_state();
+  if( !future->s->L )
+    luaL_error( L, "memory allocation error" );
+  /* the thread copies all values on the stack, so spawn it from a
+   * separate stack frame that contains only the code and the
+   * arguments */
+  lua_insert( L, 1 );
+  lua_pushcfunction( L, spawn_async );
+  lua_insert( L, 2 );
+  lua_pushlightuserdata( L, future->s );
+  lua_call( L, top+1, 1 );
+  thread = lua_touserdata( L, -1 );
+  thread->is_parent = 0; /* the future joins the thread */
+  lua_settop( L, 1 );
+  return 1;
+}
+
+
+static int tinylfuture_copy( void* p, lua_State* L, int midx ) {
+  tinylfuture* future = p;
+  tinylfuture* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( future->s ) {
+    increment_ref_count( L, &(future->s->ref) );
+    copy->s = future->s;
+  }
+  return 1;
+}
+
+
+static int tinylfuture_gc( lua_State* L ) {
+  tinylfuture* future = lua_touserdata( L, 1 );
+  if( future->s ) {
+    release_future( L, future->s );
+    future->s = NULL;
+  }
+  return 0;
+}
+
+
+/* waits until the future is done or the deadline has passed, and
+ * returns with the future mutex held */
+static void wait_future( lua_State* L, tinylthread* thread,
+                         tinylfuture_shared* f,
+                         struct timespec const* deadline ) {
+  int itr = 0;
+  int disabled = 0;
+  int res = thrd_success;
+  mtx_lock_or_throw( L, &(f->mutex) );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         !f->is_done && res != thrd_timedout ) {
+    set_block( thread, &(f->ref), &(f->finished), &(f->mutex) );
+    res = cnd_wait_until( &(f->finished), &(f->mutex), deadline,
+                          NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(f->mutex) ) );
+      luaL_error( L, "waiting for future failed" );
+    }
+  }
+  if( itr ) { /* handle interrupt request */
+    no_fail( mtx_unlock( &(f->mutex) ) );
+    throw_interrupt( L );
+  }
+}
+
+
+static int tinylfuture_get( lua_State* L ) {
+  tinylfuture* future = check_future( L, 1 );
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int has_timeout = !lua_isnoneornil( L, 2 );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  copy_data data;
+  tinylthread_shared* t = NULL;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( has_timeout )
+    has_timeout = NULL != make_deadline( L, &deadline, timeout );
+  wait_future( L, thread, future->s, has_timeout ? &deadline : NULL );
+  if( !future->s->is_done ) {
+    no_fail( mtx_unlock( &(future->s->mutex) ) );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  t = detach_future_thread( future->s );
+  /* the results stay in the future's Lua state, so every thread may
+   * get them (keep the future handle on the stack) */
+  lua_settop( L, 1 );
+  data.L = future->s->L;
+  data.tidx = 0;
+  data.first = 1;
+  data.n = lua_gettop( future->s->L );
+  if( 0 != lua_cpcallr( L, copy_values, &data, LUA_MULTRET ) ) {
+    lua_settop( future->s->L, data.n ); /* remove leftovers on error */
+    no_fail( mtx_unlock( &(future->s->mutex) ) );
+    join_future_thread( L, t );
+    lua_error( L );
+  }
+  no_fail( mtx_unlock( &(future->s->mutex) ) );
+  join_future_thread( L, t );
+  return lua_gettop( L )-1;
+}
+
+
+static int tinylfuture_ready( lua_State* L ) {
+  tinylfuture* future = check_future( L, 1 );
+  tinylthread_shared* t = NULL;
+  int is_done = 0;
+  mtx_lock_or_throw( L, &(future->s->mutex) );
+  is_done = future->s->is_done;
+  t = detach_future_thread( future->s );
+  no_fail( mtx_unlock( &(future->s->mutex) ) );
+  join_future_thread( L, t );
+  lua_pushboolean( L, is_done );
+  return 1;
+}
+
+
+static tinylfuture_shared* future_at( lua_State* L, int i ) {
+  tinylfuture* future = NULL;
+  lua_rawgeti( L, 1, i );
+  future = test_udata( L, -1, TLT_FUTURE_NAME );
+  if( !future || !future->s )
+    luaL_argerror( L, 1, lua_pushfstring( L, "future expected at index %d",
+                                          i ) );
+  lua_pop( L, 1 );
+  return future->s;
+}
+
+
+static int tinylthread_wait_all( lua_State* L ) {
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int has_timeout = !lua_isnoneornil( L, 2 );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  size_t n = 0;
+  size_t i = 0;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  n = lua_rawlen( L, 1 );
+  luaL_argcheck( L, n <= INT_MAX, 1, "invalid number of futures" );
+  lua_settop( L, 1 );
+  for( i = 1; i <= n; ++i )
+    future_at( L, (int)i );
+  if( has_timeout )
+    has_timeout = NULL != make_deadline( L, &deadline, timeout );
+  for( i = 1; i <= n; ++i ) {
+    tinylfuture_shared* f = future_at( L, (int)i );
+    tinylthread_shared* t = NULL;
+    wait_future( L, thread, f, has_timeout ? &deadline : NULL );
+    if( !f->is_done ) {
+      no_fail( mtx_unlock( &(f->mutex) ) );
+      lua_pushnil( L );
+      lua_pushliteral( L, "timeout" );
+      return 2;
+    }
+    t = detach_future_thread( f );
+    no_fail( mtx_unlock( &(f->mutex) ) );
+    join_future_thread( L, t );
+  }
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+typedef struct {
+  tinylfuture_shared* f;
+  tinylwatcher w;
+  char is_registered;
+} wait_entry;
+
+static int tinylthread_wait_any( lua_State* L ) {
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int has_timeout = !lua_isnoneornil( L, 2 );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  wait_entry* entries = NULL;
+  tinylselect sel;
+  size_t n = 0;
+  size_t i = 0;
+  int ready = 0;
+  int itr = 0;
+  int disabled = 0;
+  int timedout = 0;
+  int failed = 0;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  n = lua_rawlen( L, 1 );
+  luaL_argcheck( L, n > 0 && n <= INT_MAX, 1,
+                 "invalid number of futures" );
+  lua_settop( L, 1 );
+  entries = lua_newuserdata( L, n * sizeof( *entries ) );
+  for( i = 0; i < n; ++i ) {
+    entries[ i ].f = future_at( L, (int)i+1 );
+    entries[ i ].w.sel = &sel;
+    entries[ i ].w.next = NULL;
+    entries[ i ].w.next_notified = NULL;
+    entries[ i ].w.is_notified = 0;
+    entries[ i ].is_registered = 0;
+  }
+  if( has_timeout )
+    has_timeout = NULL != make_deadline( L, &deadline, timeout );
+  if( thrd_success != mtx_init( &(sel.mutex), mtx_plain ) )
+    luaL_error( L, "mutex initialization failed" );
+  if( thrd_success != cnd_init( &(sel.changed) ) ) {
+    mtx_destroy( &(sel.mutex) );
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  sel.notified = NULL;
+  sel.is_changed = 0;
+  /* register at every future until we find one that is done */
+  for( i = 0; i < n && !ready; ++i ) {
+    tinylfuture_shared* f = entries[ i ].f;
+    no_fail( mtx_lock( &(f->mutex) ) );
+    if( f->is_done )
+      ready = (int)i+1;
+    else {
+      entries[ i ].w.next = f->watchers;
+      f->watchers = &(entries[ i ].w);
+      entries[ i ].is_registered = 1;
+    }
+    no_fail( mtx_unlock( &(f->mutex) ) );
+  }
+  if( !ready ) {
+    no_fail( mtx_lock( &(sel.mutex) ) );
+    while( !(itr=is_interrupted( thread, &disabled )) &&
+           !sel.is_changed && !timedout && !failed ) {
+      int res = 0;
+      set_block( thread, &(entries[ 0 ].f->ref), &(sel.changed),
+                 &(sel.mutex) );
+      res = cnd_wait_until( &(sel.changed), &(sel.mutex),
+                            has_timeout ? &deadline : NULL, NULL );
+      set_block( thread, NULL, NULL, NULL );
+      if( res == thrd_timedout )
+        timedout = 1;
+      else if( res != thrd_success )
+        failed = 1;
+    }
+    no_fail( mtx_unlock( &(sel.mutex) ) );
+  }
+  for( i = 0; i < n; ++i ) {
+    tinylfuture_shared* f = entries[ i ].f;
+    if( entries[ i ].is_registered ) {
+      tinylwatcher** p = NULL;
+      no_fail( mtx_lock( &(f->mutex) ) );
+      for( p = &(f->watchers); *p != NULL; p = &((*p)->next) ) {
+        if( *p == &(entries[ i ].w) ) {
+          *p = entries[ i ].w.next;
+          break;
+        }
+      }
+      /* find the future that woke us up */
+      if( !ready && f->is_done )
+        ready = (int)i+1;
+      no_fail( mtx_unlock( &(f->mutex) ) );
+    }
+  }
+  cnd_destroy( &(sel.changed) );
+  mtx_destroy( &(sel.mutex) );
+  if( itr ) /* handle interrupt request */
+    throw_interrupt( L );
+  if( failed )
+    luaL_error( L, "waiting for futures failed" );
+  if( !ready ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  lua_pushinteger( L, ready );
+  return 1;
+}
+
+
+/* state of a `map`/`reduce` call: the jobs claim chunks of the input
+ * table one after the other, so that jobs that start early or finish
+ * early just take more chunks */
+typedef struct {
+  mtx_t mutex;
+  cnd_t finished;
+  lua_State* L;  /* the calling Lua state (only with mutex held) */
+  size_t n;  /* number of input items */
+  size_t chunk;  /* items per chunk */
+  size_t next;  /* first item of the next unclaimed chunk */
+  size_t done;  /* number of finished jobs */
+  char failed;
+  char is_reduce;
+} map_data;
+
+/* a job of a `map`/`reduce` call that runs in a pool worker; its bare
+ * Lua state holds the code, and afterwards a table with the results
+ * keyed by item index (or an error message) */
+typedef struct {
+  tinyljob_shared job;
+  map_data* md;
+  int status;
+} map_worker;
+
+typedef struct {
+  map_data* md;
+  map_worker* workers;
+  size_t nworkers;
+} map_context;
+
+
+static size_t cpu_count( void ) {
+#ifdef TLT_USE_PTHREAD_ATTRS
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+  if( n > 0 )
+    return (size_t)n;
+#endif
+  return TLT_MAP_WORKERS;
+}
+
+
+/* all API calls on L are protected, but all API calls on the source
+ * Lua state are *unprotected* and could cause resource leaks if an
+ * unhandled error is thrown! */
+static int copy_chunk( lua_State* L ) {
+  copy_data* data = lua_touserdata( L, 1 );
+  int i = 0;
+  lua_pop( L, 1 );
+  lua_createtable( L, data->n, 0 );
+  for( i = 0; i < data->n; ++i ) {
+    lua_rawgeti( data->L, data->tidx, data->first+i );
+    copy_value_to_thread( L, data->L, lua_gettop( data->L ) );
+    lua_pop( data->L, 1 );
+    lua_rawseti( L, -2, i+1 );
+  }
+  return 1;
+}
+
+
+/* runs in a pool worker: claims the next chunk, copies it from the
+ * input table, and maps (or reduces) it; the function and the result
+ * table are upvalues */
+static int map_chunk( lua_State* L ) {
+  map_worker* w = lua_touserdata( L, 1 );
+  map_data* md = w->md;
+  copy_data data;
+  int first = 0;
+  int i = 0;
+  lua_settop( L, 0 );
+  no_fail( mtx_lock( &(md->mutex) ) );
+  if( md->failed || md->next >= md->n ) {
+    no_fail( mtx_unlock( &(md->mutex) ) );
+    lua_pushboolean( L, 0 );
+    return 1;
+  }
+  first = (int)md->next+1;
+  data.L = md->L;
+  data.tidx = 2;
+  data.first = first;
+  data.n = (int)(md->n - md->next < md->chunk ? md->n - md->next
+                                                : md->chunk);
+  md->next += data.n;
+  if( 0 != lua_cpcallr( L, copy_chunk, &data, 1 ) ) {
+    no_fail( mtx_unlock( &(md->mutex) ) );
+    lua_error( L );
+  }
+  no_fail( mtx_unlock( &(md->mutex) ) );
+  if( md->is_reduce ) {
+    /* the chunk is reduced to a single value that is combined with
+     * the values of the other chunks later */
+    lua_rawgeti( L, 1, 1 );
+    for( i = 2; i <= data.n; ++i ) {
+      lua_pushvalue( L, lua_upvalueindex( 1 ) );
+      lua_insert( L, -2 );
+      lua_rawgeti( L, 1, i );
+      lua_call( L, 2, 1 );
+    }
+    lua_rawseti( L, lua_upvalueindex( 2 ), first );
+  } else {
+    for( i = 1; i <= data.n; ++i ) {
+      lua_pushvalue( L, lua_upvalueindex( 1 ) );
+      lua_rawgeti( L, 1, i );
+      lua_pushinteger( L, first+i-1 );
+      lua_call( L, 2, 1 );
+      lua_rawseti( L, lua_upvalueindex( 2 ), first+i-1 );
+    }
+  }
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+
+/* runs in the bare Lua state of a map job and copies the result
+ * table from the worker's Lua state */
+static int copy_map_results( lua_State* L ) {
+  lua_State* wL = lua_touserdata( L, 1 );
+  lua_pop( L, 1 );
+  lua_newtable( L );
+  lua_pushnil( wL );
+  while( lua_next( wL, 2 ) ) {
+    copy_value_to_thread( L, wL, lua_gettop( wL ) );
+    lua_rawseti( L, -2, (int)lua_tointeger( wL, -2 ) );
+    lua_pop( wL, 1 );
+  }
+  return 1;
+}
+
+
+/* runs in a pool worker: loads the code from the job's Lua state and
+ * handles chunks until there are none left */
+static int map_job( lua_State* L ) {
+  map_worker* w = lua_touserdata( L, 1 );
+  int more = 1;
+  lua_settop( L, 0 );
+  copy_value_to_thread( L, w->job.L, 1 );
+  load_code( L, 1, "=map" );
+  lua_newtable( L );
+  lua_pushvalue( L, 1 );
+  lua_pushvalue( L, 2 );
+  lua_pushcclosure( L, map_chunk, 2 );
+  while( more ) {
+    lua_pushvalue( L, 3 );
+    lua_pushlightuserdata( L, w );
+    lua_call( L, 1, 1 );
+    more = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+  }
+  lua_settop( w->job.L, 0 );
+  if( 0 != lua_cpcallr( w->job.L, copy_map_results, L, 1 ) ) {
+    lua_settop( w->job.L, 0 );
+    luaL_error( L, "copying map results failed" );
+  }
+  return 0;
+}
+
+
+/* `run` function of map jobs (see `run_job`) */
+static void run_map_job( lua_State* L, tinyljob_shared* job ) {
+  map_worker* w = job->ud;
+  map_data* md = w->md;
+  w->status = lua_cpcallr( L, map_job, w, 0 );
+  if( w->status != 0 ) {
+    /* the error message goes to the job's Lua state */
+    lua_settop( w->job.L, 0 );
+    if( 0 != lua_cpcallr( w->job.L, copy_stack_top, L, 1 ) )
+      lua_settop( w->job.L, 0 );
+  }
+  lua_settop( L, 0 );
+  /* the caller may return as soon as the last job is done, so don't
+   * touch `md` or `w` after unlocking */
+  no_fail( mtx_lock( &(md->mutex) ) );
+  if( w->status != 0 ) /* other jobs stop after their current chunk */
+    md->failed = 1;
+  md->done++;
+  no_fail( cnd_signal( &(md->finished) ) );
+  no_fail( mtx_unlock( &(md->mutex) ) );
+}
+
+
+/* removes the jobs of a `map`/`reduce` call that no worker has picked
+ * up yet from the queue of the pool, and returns their number */
+static size_t cancel_map_jobs( tinylpool_shared* pool, map_data* md ) {
+  tinyljob_shared** p = &(pool->head);
+  tinyljob_shared* last = NULL;
+  size_t n = 0;
+  no_fail( mtx_lock( &(pool->mutex) ) );
+  while( *p != NULL ) {
+    if( (*p)->run == run_map_job &&
+        ((map_worker*)(*p)->ud)->md == md ) {
+      *p = (*p)->next;
+      n++;
+    } else {
+      last = *p;
+      p = &((*p)->next);
+    }
+  }
+  pool->tail = last;
+  no_fail( mtx_unlock( &(pool->mutex) ) );
+  return n;
+}
+
+
+static int collect_results( lua_State* L ) {
+  map_context* ctx = lua_touserdata( L, 1 );
+  size_t i = 0;
+  lua_pop( L, 1 );
+  lua_createtable( L, ctx->md->is_reduce ? 0 : (int)ctx->md->n, 0 );
+  for( i = 0; i < ctx->nworkers; ++i ) {
+    lua_State* wL = ctx->workers[ i ].job.L;
+    lua_pushnil( wL );
+    while( lua_next( wL, 1 ) ) {
+      copy_value_to_thread( L, wL, lua_gettop( wL ) );
+      lua_rawseti( L, -2, (int)lua_tointeger( wL, -2 ) );
+      lua_pop( wL, 1 );
+    }
+  }
+  return 1;
+}
+
+
+static void close_map_workers( map_context* ctx ) {
+  size_t i = 0;
+  for( i = 0; i < ctx->nworkers; ++i )
+    lua_close( ctx->workers[ i ].job.L );
+  ctx->nworkers = 0;
+  mtx_destroy( &(ctx->md->mutex) );
+  cnd_destroy( &(ctx->md->finished) );
+}
+
+
+/* pushes the pool for `map`/`reduce` calls without a `pool` option:
+ * it has a worker per CPU, and is created on first use and kept in
+ * the registry */
+static void push_map_pool( lua_State* L ) {
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_MAP_POOL );
+  if( lua_isnil( L, -1 ) ) {
+    lua_pop( L, 1 );
+    lua_pushcfunction( L, tinylthread_new_pool );
+    lua_pushinteger( L, (lua_Integer)cpu_count() );
+    lua_call( L, 1, 1 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, TLT_MAP_POOL );
+  }
+}
+
+
+static int map_reduce( lua_State* L, int is_reduce ) {
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  tinylpool_shared* pool = NULL;
+  lua_Integer nworkers = 0;
+  lua_Integer chunk = 0;
+  map_data md;
+  map_context ctx;
+  size_t nchunks = 0;
+  size_t i = 0;
+  int itr = 0;
+  int disabled = 0;
+  check_code( L, 1 );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  if( !lua_isnoneornil( L, 3 ) )
+    luaL_checktype( L, 3, LUA_TTABLE );
+  lua_settop( L, 3 );
+  lua_pushnil( L ); /* the pool goes to index 4 */
+  md.n = lua_rawlen( L, 2 );
+  luaL_argcheck( L, md.n <= INT_MAX, 2, "table too large" );
+  if( lua_istable( L, 3 ) ) {
+    /* `workers` limits how many workers of the pool take part */
+    lua_getfield( L, 3, "workers" );
+    if( !lua_isnil( L, -1 ) ) {
+      nworkers = luaL_checkinteger( L, -1 );
+      luaL_argcheck( L, nworkers > 0, 3,
+                     "positive number of workers expected" );
+    }
+    lua_getfield( L, 3, "chunk" );
+    chunk = luaL_optinteger( L, -1, 0 );
+    lua_getfield( L, 3, "pool" );
+    if( !lua_isnil( L, -1 ) )
+      check_pool( L, -1 );
+    lua_replace( L, 4 );
+    lua_getfield( L, 3, "init" );
+    lua_replace( L, 3 );
+    lua_settop( L, 4 ); /* init value for reduce is at index 3 now */
+  }
+  luaL_argcheck( L, chunk >= 0, 3, "non-negative chunk size expected" );
+  if( md.n == 0 ) {
+    if( is_reduce )
+      lua_pushvalue( L, 3 );
+    else
+      lua_newtable( L );
+    return 1;
+  }
+  if( lua_isnil( L, 4 ) ) {
+    push_map_pool( L );
+    lua_replace( L, 4 );
+  }
+  pool = check_pool( L, 4 )->s;
+  if( nworkers == 0 )
+    nworkers = (lua_Integer)pool->nworkers;
+  if( chunk == 0 ) /* a few chunks per worker for load balancing */
+    chunk = (lua_Integer)(md.n / (4 * (size_t)nworkers)) + 1;
+  if( (size_t)chunk > md.n )
+    chunk = (lua_Integer)md.n;
+  nchunks = (md.n + (size_t)chunk - 1) / (size_t)chunk;
+  if( (size_t)nworkers > nchunks )
+    nworkers = (lua_Integer)nchunks;
+  luaL_argcheck( L, (size_t)nworkers <= SIZE_MAX / sizeof( map_worker ),
+                 3, "too many workers" );
+  md.L = L;
+  md.chunk = (size_t)chunk;
+  md.next = 0;
+  md.done = 0;
+  md.failed = 0;
+  md.is_reduce = is_reduce;
+  ctx.md = &md;
+  ctx.nworkers = 0;
+  ctx.workers = lua_newuserdata( L, (size_t)nworkers*sizeof( map_worker ) );
+  if( thrd_success != mtx_init( &(md.mutex), mtx_plain ) )
+    luaL_error( L, "mutex initialization failed" );
+  if( thrd_success != cnd_init( &(md.finished) ) ) {
+    mtx_destroy( &(md.mutex) );
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  /* set up the jobs first, so that cleaning up after errors is easy */
+  for( i = 0; i < (size_t)nworkers; ++i ) {
+    map_worker* w = ctx.workers + i;
+    copy_data data;
+    w->md = &md;
+    w->status = 0;
+    w->job.next = NULL;
+    w->job.run = run_map_job;
+    w->job.ud = w;
+    w->job.is_done = 0;
+    w->job.L = new_slot_state();
+    if( !w->job.L ) {
+      close_map_workers( &ctx );
+      luaL_error( L, "memory allocation error" );
+    }
+    ctx.nworkers++;
+    data.L = L;
+    data.tidx = 0;
+    data.first = 1;
+    data.n = 1;
+    if( 0 != lua_cpcallr( w->job.L, copy_values, &data, LUA_MULTRET ) ) {
+      int r = lua_cpcallr( L, copy_stack_top, w->job.L, 1 );
+      close_map_workers( &ctx );
+      if( r != 0 )
+        lua_pushliteral( L, "job initialization error" );
+      lua_error( L ); /* rethrow the error on this thread */
+    }
+  }
+  /* the jobs access this Lua state from now on until they are done */
+  no_fail( mtx_lock( &(pool->mutex) ) );
+  for( i = 0; i < ctx.nworkers; ++i ) {
+    tinyljob_shared* job = &(ctx.workers[ i ].job);
+    if( pool->tail )
+      pool->tail->next = job;
+    else
+      pool->head = job;
+    pool->tail = job;
+  }
+  no_fail( cnd_broadcast( &(pool->job_available) ) );
+  no_fail( mtx_unlock( &(pool->mutex) ) );
+  no_fail( mtx_lock( &(md.mutex) ) );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         md.done < ctx.nworkers ) {
+    set_block( thread, &unshared_block, &(md.finished), &(md.mutex) );
+    no_fail( cnd_wait( &(md.finished), &(md.mutex) ) );
+    set_block( thread, NULL, NULL, NULL );
+  }
+  if( itr ) {
+    /* the running jobs stop after their current chunk, the queued
+     * ones don't start at all */
+    md.failed = 1;
+    no_fail( mtx_unlock( &(md.mutex) ) );
+    i = cancel_map_jobs( pool, &md );
+    no_fail( mtx_lock( &(md.mutex) ) );
+    md.done += i;
+    while( md.done < ctx.nworkers )
+      no_fail( cnd_wait( &(md.finished), &(md.mutex) ) );
+  }
+  no_fail( mtx_unlock( &(md.mutex) ) );
+  if( itr ) { /* handle interrupt request */
+    close_map_workers( &ctx );
+    throw_interrupt( L );
+  }
+  for( i = 0; i < ctx.nworkers; ++i ) {
+    if( ctx.workers[ i ].status != 0 ) {
+      int r = lua_cpcallr( L, copy_stack_top, ctx.workers[ i ].job.L,
+                           1 );
+      close_map_workers( &ctx );
+      if( r != 0 )
+        lua_pushliteral( L, "map worker error" );
+      lua_error( L ); /* rethrow the error on this thread */
+    }
+  }
+  if( 0 != lua_cpcallr( L, collect_results, &ctx, 1 ) ) {
+    close_map_workers( &ctx );
+    lua_error( L );
+  }
+  close_map_workers( &ctx );
+  if( is_reduce ) {
+    /* combine the values of the chunks (in order) */
+    int has_acc = !lua_isnil( L, 3 );
+    load_code( L, 1, "=reduce" );
+    for( i = 1; i <= md.n; i += md.chunk ) {
+      lua_rawgeti( L, -1, (int)i );
+      if( has_acc ) {
+        lua_pushvalue( L, 1 );
+        lua_pushvalue( L, 3 );
+        lua_pushvalue( L, -3 );
+        lua_call( L, 2, 1 );
+        lua_replace( L, 3 );
+        lua_pop( L, 1 );
+      } else {
+        lua_replace( L, 3 );
+        has_acc = 1;
+      }
+    }
+    lua_pushvalue( L, 3 );
+  }
+  return 1;
+}
+
+
+static int tinylthread_map( lua_State* L ) {
+  return map_reduce( L, 0 );
+}
+
+
+static int tinylthread_reduce( lua_State* L ) {
+  return map_reduce( L, 1 );
+}
+
+
+/* marks the scheduler's Lua state and creates the table that anchors
+ * the coroutines of the running tasks */
+static int init_sched_worker( lua_State* L ) {
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_THISWORKER );
+  lua_newtable( L );
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_TASKS );
+  return 0;
+}
+
+
+static void start_sched_worker( lua_State* L, tinylsched_shared* s ) {
+  tinylsworker* w = s->workers + s->nworkers;
+  thrd_start_t workerf = 0;
+  w->sched = s;
+  w->head = NULL;
+  w->tail = NULL;
+  w->ready = NULL;
+  w->ready_tail = NULL;
+  w->current = NULL;
+  w->timed = NULL;
+  w->is_idle = 0;
+  w->sel.notified = NULL;
+  w->sel.is_changed = 0;
+  w->L = luaL_newstate();
+  if( !w->L )
+    luaL_error( L, "memory allocation error" );
+  push_package_paths( L );
+  if( 0 != lua_cpcallr( w->L, prepare_worker_state, L, 0 ) ||
+      0 != lua_cpcallr( w->L, init_sched_worker, w, 0 ) ) {
+    int r = lua_cpcallr( L, copy_stack_top, w->L, 1 );
+    lua_close( w->L );
+    w->L = NULL;
+    if( r != 0 )
+      lua_pushliteral( L, "thread initialization error" );
+    lua_error( L ); /* rethrow the error on this thread */
+  }
+  if( thrd_success != mtx_init( &(w->sel.mutex), mtx_plain ) ) {
+    lua_close( w->L );
+    w->L = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(w->sel.changed) ) ) {
+    mtx_destroy( &(w->sel.mutex) );
+    lua_close( w->L );
+    w->L = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  /* get worker main function from the worker's registry (must not
+   * raise an error!) */
+  lua_getfield( w->L, LUA_REGISTRYINDEX, TLT_SCHED_WORKER );
+  workerf = (thrd_start_t)lua_tocfunction( w->L, -1 );
+  lua_pop( w->L, 1 );
+  if( thrd_success != thrd_create( &(w->thread), workerf, w ) ) {
+    mtx_destroy( &(w->sel.mutex) );
+    cnd_destroy( &(w->sel.changed) );
+    lua_close( w->L );
+    w->L = NULL;
+    luaL_error( L, "thread spawning failed" );
+  }
+  /* the running workers look at the other workers for stealing */
+  no_fail( mtx_lock( &(s->mutex) ) );
+  s->nworkers++;
+  no_fail( mtx_unlock( &(s->mutex) ) );
+}
+
+
+static int tinylthread_new_scheduler( lua_State* L ) {
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  tinylsched* sched = NULL;
+  size_t i = 0;
+  luaL_argcheck( L, n > 0, 1, "positive number expected" );
+  luaL_argcheck( L, (uintmax_t)n <= SIZE_MAX / sizeof( tinylsworker ), 1,
+                 "too many workers" );
+  luaL_optstring( L, 2, NULL ); /* the prelude code */
+  lua_settop( L, 2 );
+  sched = lua_newuserdata( L, sizeof( *sched ) );
+  sched->s = NULL;
+  luaL_setmetatable( L, TLT_SCHED_NAME );
+  sched->s = malloc( sizeof( *sched->s ) );
+  if( !sched->s )
+    luaL_error( L, "memory allocation error" );
+  sched->s->nworkers = 0;
+  sched->s->ntasks = 0;
+  sched->s->next = 0;
+  sched->s->nfailed = 0;
+  sched->s->nexited = 0;
+  sched->s->error = NULL;
+  sched->s->is_closed = 0;
+  sched->s->is_detached = 0;
+  sched->s->workers = malloc( (size_t)n * sizeof( tinylsworker ) );
+  if( !sched->s->workers ) {
+    free( sched->s );
+    sched->s = NULL;
+    luaL_error( L, "memory allocation error" );
+  }
+  if( thrd_success != mtx_init( &(sched->s->mutex), mtx_plain ) ) {
+    free( sched->s->workers );
+    free( sched->s );
+    sched->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  if( thrd_success != cnd_init( &(sched->s->done) ) ) {
+    mtx_destroy( &(sched->s->mutex) );
+    free( sched->s->workers );
+    free( sched->s );
+    sched->s = NULL;
+    luaL_error( L, "condition variable initialization failed" );
+  }
+  /* on errors the __gc metamethod cleans up the workers started so
+   * far */
+  for( i = 0; i < (size_t)n; ++i )
+    start_sched_worker( L, sched->s );
+  return 1;
+}
+
+
+static void wake_sched_worker( tinylsworker* w ) {
+  no_fail( mtx_lock( &(w->sel.mutex) ) );
+  w->sel.is_changed = 1;
+  no_fail( cnd_signal( &(w->sel.changed) ) );
+  no_fail( mtx_unlock( &(w->sel.mutex) ) );
+}
+
+
+static size_t count_sched_workers( tinylsched_shared* s ) {
+  size_t n = 0;
+  no_fail( mtx_lock( &(s->mutex) ) );
+  n = s->nworkers;
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  return n;
+}
+
+
+/* puts a new task at the tail of a worker's deque and wakes up that
+ * worker, or some idle worker that may steal the task if the worker
+ * is busy */
+static void push_task( tinylsworker* w, tinyltask* t ) {
+  tinylsched_shared* s = w->sched;
+  size_t n = 0;
+  size_t i = 0;
+  int idle = 0;
+  no_fail( mtx_lock( &(w->sel.mutex) ) );
+  t->next = NULL;
+  t->prev = w->tail;
+  if( w->tail )
+    w->tail->next = t;
+  else
+    w->head = t;
+  w->tail = t;
+  idle = w->is_idle;
+  w->sel.is_changed = 1;
+  no_fail( cnd_signal( &(w->sel.changed) ) );
+  no_fail( mtx_unlock( &(w->sel.mutex) ) );
+  n = idle ? 0 : count_sched_workers( s );
+  for( i = 0; i < n && !idle; ++i ) {
+    tinylsworker* o = s->workers + i;
+    if( o != w ) {
+      no_fail( mtx_lock( &(o->sel.mutex) ) );
+      if( o->is_idle ) {
+        o->sel.is_changed = 1;
+        no_fail( cnd_signal( &(o->sel.changed) ) );
+        idle = 1;
+      }
+      no_fail( mtx_unlock( &(o->sel.mutex) ) );
+    }
+  }
+}
+
+
+/* the worker takes new tasks from the tail of its own deque (the
+ * most recently spawned task is probably still in the cache) */
+static tinyltask* pop_task( tinylsworker* w ) {
+  tinyltask* t = NULL;
+  no_fail( mtx_lock( &(w->sel.mutex) ) );
+  t = w->tail;
+  if( t != NULL ) {
+    w->tail = t->prev;
+    if( w->tail )
+      w->tail->next = NULL;
+    else
+      w->head = NULL;
+  }
+  no_fail( mtx_unlock( &(w->sel.mutex) ) );
+  return t;
+}
+
+
+/* idle workers steal the oldest new task from the head of another
+ * worker's deque */
+static tinyltask* steal_task( tinylsworker* w ) {
+  tinylsched_shared* s = w->sched;
+  size_t n = count_sched_workers( s );
+  size_t k = (size_t)(w - s->workers);
+  size_t i = 0;
+  for( i = 1; i < n; ++i ) {
+    tinylsworker* v = s->workers + (k+i) % n;
+    tinyltask* t = NULL;
+    no_fail( mtx_lock( &(v->sel.mutex) ) );
+    t = v->head;
+    if( t != NULL ) {
+      v->head = t->next;
+      if( v->head )
+        v->head->prev = NULL;
+      else
+        v->tail = NULL;
+    }
+    no_fail( mtx_unlock( &(v->sel.mutex) ) );
+    if( t != NULL )
+      return t;
+  }
+  return NULL;
+}
+
+
+static void append_ready( tinylsworker* w, tinyltask* t ) {
+  t->next = NULL;
+  if( w->ready_tail )
+    w->ready_tail->next = t;
+  else
+    w->ready = t;
+  w->ready_tail = t;
+}
+
+
+static tinyltask* pop_ready( tinylsworker* w ) {
+  tinyltask* t = w->ready;
+  if( t != NULL ) {
+    w->ready = t->next;
+    if( w->ready == NULL )
+      w->ready_tail = NULL;
+  }
+  return t;
+}
+
+
+static void link_timed( tinylsworker* w, tinyltask* t ) {
+  t->prev = NULL;
+  t->next = w->timed;
+  if( w->timed )
+    w->timed->prev = t;
+  w->timed = t;
+}
+
+
+static void unlink_timed( tinylsworker* w, tinyltask* t ) {
+  if( t->prev )
+    t->prev->next = t->next;
+  else
+    w->timed = t->next;
+  if( t->next )
+    t->next->prev = t->prev;
+}
+
+
+/* stops waiting for the port or mutex of a suspended task */
+static void unwatch_task( tinyltask* t ) {
+  if( t->port != NULL )
+    unwatch_port( t->port->s, t->port->is_reader, &(t->w) );
+  else if( t->mutex != NULL )
+    unwatch_mutex( t->mutex->s, &(t->w) );
+  t->port = NULL;
+  t->mutex = NULL;
+}
+
+
+/* moves the suspended tasks whose port or mutex has changed to the
+ * ready list */
+static void collect_notified( tinylsworker* w ) {
+  tinylwatcher* n = NULL;
+  no_fail( mtx_lock( &(w->sel.mutex) ) );
+  n = w->sel.notified;
+  w->sel.notified = NULL;
+  w->sel.is_changed = 0;
+  no_fail( mtx_unlock( &(w->sel.mutex) ) );
+  while( n != NULL ) {
+    tinyltask* t = (tinyltask*)n; /* the watcher is the first member */
+    n = n->next_notified;
+    if( t->has_deadline )
+      unlink_timed( w, t );
+    unwatch_task( t );
+    t->w.is_notified = 0;
+    append_ready( w, t );
+  }
+}
+
+
+static int deadline_passed( struct timespec const* dl,
+                            struct timespec const* now ) {
+  return dl->tv_sec < now->tv_sec ||
+         (dl->tv_sec == now->tv_sec && dl->tv_nsec <= now->tv_nsec);
+}
+
+
+/* moves the suspended tasks whose deadline has passed to the ready
+ * list, and returns the earliest deadline of the remaining ones (or
+ * NULL) */
+static struct timespec const* expire_tasks( tinylsworker* w ) {
+  struct timespec now;
+  struct timespec const* next = NULL;
+  tinyltask* t = w->timed;
+  if( t == NULL || TIME_UTC != timespec_get( &now, TIME_UTC ) )
+    return NULL;
+  while( t != NULL ) {
+    tinyltask* n = t->next;
+    if( deadline_passed( &(t->deadline), &now ) ) {
+      unlink_timed( w, t );
+      unwatch_task( t );
+      /* the task may have been notified in the meantime */
+      no_fail( mtx_lock( &(w->sel.mutex) ) );
+      if( t->w.is_notified ) {
+        tinylwatcher** p = &(w->sel.notified);
+        while( *p != &(t->w) )
+          p = &((*p)->next_notified);
+        *p = t->w.next_notified;
+        t->w.is_notified = 0;
+      }
+      no_fail( mtx_unlock( &(w->sel.mutex) ) );
+      t->is_timedout = 1;
+      append_ready( w, t );
+    } else if( next == NULL || !deadline_passed( next, &(t->deadline) ) )
+      next = &(t->deadline);
+    t = n;
+  }
+  return next;
+}
+
+
+/* creates a new task from the code and arguments on the stack */
+static tinyltask* new_task( lua_State* L, int first ) {
+  tinyltask* t = NULL;
+  lua_State* taskL = NULL;
+  copy_data data;
+  check_code( L, first );
+  data.L = L;
+  data.tidx = 0;
+  data.first = first;
+  data.n = lua_gettop( L )-first+1;
+  taskL = new_slot_state();
+  if( !taskL )
+    luaL_error( L, "memory allocation error" );
+  /* copy code and arguments into the task's Lua state */
+  if( 0 != lua_cpcallr( taskL, copy_values, &data, LUA_MULTRET ) ) {
+    int r = lua_cpcallr( L, copy_stack_top, taskL, 1 );
+    lua_close( taskL );
+    if( r != 0 )
+      lua_pushliteral( L, "task initialization error" );
+    lua_error( L ); /* rethrow the error on this thread */
+  }
+  t = malloc( sizeof( *t ) );
+  if( !t ) {
+    lua_close( taskL );
+    luaL_error( L, "memory allocation error" );
+  }
+  t->w.sel = NULL;
+  t->w.next = NULL;
+  t->w.next_notified = NULL;
+  t->w.is_notified = 0;
+  t->next = NULL;
+  t->prev = NULL;
+  t->port = NULL;
+  t->mutex = NULL;
+  t->has_deadline = 0;
+  t->is_timedout = 0;
+  t->L = taskL;
+  return t;
+}
+
+
+static void add_task( tinylsworker* w, tinyltask* t ) {
+  no_fail( mtx_lock( &(w->sched->mutex) ) );
+  w->sched->ntasks++;
+  no_fail( mtx_unlock( &(w->sched->mutex) ) );
+  push_task( w, t );
+}
+
+
+static int tinylsched_spawn( lua_State* L ) {
+  tinylsched* sched = check_sched( L, 1 );
+  tinyltask* t = new_task( L, 2 );
+  tinylsworker* w = NULL;
+  /* distribute the tasks round-robin, stealing does the rest */
+  no_fail( mtx_lock( &(sched->s->mutex) ) );
+  w = sched->s->workers + sched->s->next;
+  sched->s->next = (sched->s->next + 1) % sched->s->nworkers;
+  no_fail( mtx_unlock( &(sched->s->mutex) ) );
+  add_task( w, t );
+  return 0;
+}
+
+
+/* spawns a new task on the scheduler of the current task */
+static int tinylthread_spawn( lua_State* L ) {
+  tinylsworker* w = get_udata_from_registry( L, TLT_THISWORKER );
+  lua_pop( L, 1 );
+  if( w == NULL || w->current == NULL )
+    luaL_error( L, "not running in a scheduler task" );
+  add_task( w, new_task( L, 1 ) );
+  return 0;
+}
+
+
+/* moves code and arguments of a new task into a coroutine of the
+ * worker's Lua state */
+static int start_task( lua_State* L ) {
+  tinyltask* t = lua_touserdata( L, 1 );
+  lua_State* co = NULL;
+  int i = 1;
+  int top = lua_gettop( t->L );
+  lua_pop( L, 1 );
+  luaL_checkstack( L, top+LUA_MINSTACK, "start_task" );
+  for( i = 1; i <= top; ++i )
+    copy_value_to_thread( L, t->L, i );
+  load_code( L, 1, "=taskmain" );
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_TASKS );
+  lua_pushlightuserdata( L, t );
+  co = lua_newthread( L );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  lua_xmove( L, co, top );
+  lua_close( t->L );
+  t->L = co;
+  return 0;
+}
+
+
+/* remembers the first error message of a failed task */
+static void record_error( tinylsched_shared* s, lua_State* L ) {
+  char const* msg = lua_tostring( L, -1 );
+  no_fail( mtx_lock( &(s->mutex) ) );
+  s->nfailed++;
+  if( s->error == NULL ) {
+    size_t len = 0;
+    if( msg == NULL )
+      msg = "unknown error";
+    len = strlen( msg );
+    s->error = malloc( len+1 );
+    if( s->error != NULL )
+      memcpy( s->error, msg, len+1 );
+  }
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  lua_pop( L, 1 );
+}
+
+
+static void wake_sched_workers( tinylsched_shared* s ) {
+  size_t i = 0;
+  for( i = 0; i < s->nworkers; ++i )
+    wake_sched_worker( s->workers + i );
+}
+
+
+static void finish_task( tinylsworker* w, tinyltask* t ) {
+  tinylsched_shared* s = w->sched;
+  int wake = 0;
+  lua_getfield( w->L, LUA_REGISTRYINDEX, TLT_TASKS );
+  lua_pushlightuserdata( w->L, t );
+  lua_pushnil( w->L );
+  lua_rawset( w->L, -3 );
+  lua_pop( w->L, 1 );
+  /* port handles of finished tasks are released by their finalizers;
+   * a single incremental step per task keeps the collector going
+   * without the cost of a full collection */
+  lua_gc( w->L, LUA_GCSTEP, 0 );
+  free( t );
+  no_fail( mtx_lock( &(s->mutex) ) );
+  if( --(s->ntasks) == 0 ) {
+    no_fail( cnd_broadcast( &(s->done) ) );
+    wake = s->is_closed;
+  }
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  /* the other workers can exit now */
+  if( wake )
+    wake_sched_workers( s );
+}
+
+
+/* resumes a task until it finishes or yields */
+static void run_task( tinylsworker* w, tinyltask* t ) {
+  lua_State* co = t->L;
+  int nargs = lua_status( co ) == LUA_YIELD ? 0 : lua_gettop( co )-1;
+  int status = 0;
+  w->current = t;
+  status = resume_task( co, w->L, nargs );
+  w->current = NULL;
+  if( status == LUA_YIELD ) {
+    /* tasks waiting for a port or mutex are notified later */
+    if( t->port == NULL && t->mutex == NULL )
+      append_ready( w, t );
+    else if( t->has_deadline )
+      link_timed( w, t );
+    return;
+  }
+  if( status != 0 )
+    record_error( w->sched, co );
+  finish_task( w, t );
+}
+
+
+static void exit_detached_sched( tinylsworker* w );
+
+static int tinylsched_worker( void* arg ) {
+  tinylsworker* w = arg;
+  tinylsched_shared* s = w->sched;
+  for( ;; ) {
+    tinyltask* t = NULL;
+    struct timespec const* dl = NULL;
+    int done = 0;
+    int detached = 0;
+    collect_notified( w );
+    dl = expire_tasks( w );
+    if( (t = pop_ready( w )) != NULL ) {
+      run_task( w, t );
+      continue;
+    }
+    if( (t = pop_task( w )) != NULL || (t = steal_task( w )) != NULL ) {
+      t->w.sel = &(w->sel);
+      if( 0 != lua_cpcallr( w->L, start_task, t, 0 ) ) {
+        record_error( s, w->L );
+        lua_close( t->L );
+        finish_task( w, t );
+      } else
+        run_task( w, t );
+      continue;
+    }
+    no_fail( mtx_lock( &(s->mutex) ) );
+    done = s->is_closed && s->ntasks == 0;
+    detached = s->is_detached;
+    no_fail( mtx_unlock( &(s->mutex) ) );
+    if( done ) {
+      if( detached )
+        exit_detached_sched( w );
+      break;
+    }
+    no_fail( mtx_lock( &(w->sel.mutex) ) );
+    if( !w->sel.is_changed ) {
+      int res = thrd_success;
+      w->is_idle = 1;
+      /* wake up for the earliest deadline of a waiting task */
+      while( !w->sel.is_changed && res == thrd_success ) {
+        if( dl != NULL )
+          res = cnd_timedwait( &(w->sel.changed), &(w->sel.mutex), dl );
+        else
+          res = cnd_wait( &(w->sel.changed), &(w->sel.mutex) );
+      }
+      w->is_idle = 0;
+    }
+    no_fail( mtx_unlock( &(w->sel.mutex) ) );
+  }
+  return 0;
+}
+
+
+/* pushes true, or false, the first error message and the number of
+ * failed tasks (the scheduler mutex must be held) */
+static int push_sched_result( lua_State* L, tinylsched_shared* s ) {
+  if( s->nfailed == 0 ) {
+    lua_pushboolean( L, 1 );
+    return 1;
+  }
+  lua_pushboolean( L, 0 );
+  lua_pushstring( L, s->error ? s->error : "unknown error" );
+  lua_pushinteger( L, (lua_Integer)s->nfailed );
+  return 3;
+}
+
+
+/* waits until all tasks have finished (or the deadline has passed)
+ * and returns with the scheduler mutex held */
+static void wait_for_tasks( lua_State* L, tinylsched_shared* s,
+                            struct timespec const* dl ) {
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int itr = 0;
+  int disabled = 0;
+  int res = thrd_success;
+  lua_pop( L, 1 );
+  mtx_lock_or_throw( L, &(s->mutex) );
+  while( !(itr=is_interrupted( thread, &disabled )) &&
+         res != thrd_timedout && s->ntasks > 0 ) {
+    set_block( thread, &unshared_block, &(s->done), &(s->mutex) );
+    res = cnd_wait_until( &(s->done), &(s->mutex), dl, NULL );
+    set_block( thread, NULL, NULL, NULL );
+    if( res != thrd_success && res != thrd_timedout ) {
+      no_fail( mtx_unlock( &(s->mutex) ) );
+      luaL_error( L, "waiting for tasks failed" );
+    }
+  }
+  if( itr ) { /* handle interrupt request */
+    no_fail( mtx_unlock( &(s->mutex) ) );
+    throw_interrupt( L );
+  }
+}
+
+
+static int tinylsched_wait( lua_State* L ) {
+  tinylsched* sched = check_sched( L, 1 );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  struct timespec* dl = NULL;
+  int n = 0;
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  if( !lua_isnoneornil( L, 2 ) )
+    dl = make_deadline( L, &deadline, timeout );
+  lua_settop( L, 1 );
+  luaL_checkstack( L, 3, "tinylsched_wait" );
+  wait_for_tasks( L, sched->s, dl );
+  if( sched->s->ntasks > 0 ) {
+    no_fail( mtx_unlock( &(sched->s->mutex) ) );
+    lua_pushnil( L );
+    lua_pushliteral( L, "timeout" );
+    return 2;
+  }
+  n = push_sched_result( L, sched->s );
+  no_fail( mtx_unlock( &(sched->s->mutex) ) );
+  return n;
+}
+
+
+static void stop_sched( tinylsched_shared* s ) {
+  size_t i = 0;
+  /* the workers finish all tasks before they exit */
+  no_fail( mtx_lock( &(s->mutex) ) );
+  s->is_closed = 1;
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  wake_sched_workers( s );
+  for( i = 0; i < s->nworkers; ++i ) {
+    no_fail( thrd_join( s->workers[ i ].thread, NULL ) );
+    lua_close( s->workers[ i ].L );
+    mtx_destroy( &(s->workers[ i ].sel.mutex) );
+    cnd_destroy( &(s->workers[ i ].sel.changed) );
+  }
+}
+
+
+static void free_sched( tinylsched_shared* s ) {
+  mtx_destroy( &(s->mutex) );
+  cnd_destroy( &(s->done) );
+  free( s->error );
+  free( s->workers );
+  free( s );
+}
+
+
+/* called by the workers of a detached scheduler when they exit; the
+ * last one frees the scheduler */
+static void exit_detached_sched( tinylsworker* w ) {
+  tinylsched_shared* s = w->sched;
+  int last = 0;
+  size_t i = 0;
+  /* like detached threads, the worker doesn't close its Lua state,
+   * because that might unload the code that is running right now */
+  lua_gc( w->L, LUA_GCCOLLECT, 0 );
+  no_fail( mtx_lock( &(s->mutex) ) );
+  last = ++(s->nexited) == s->nworkers;
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  if( last ) {
+    for( i = 0; i < s->nworkers; ++i ) {
+      mtx_destroy( &(s->workers[ i ].sel.mutex) );
+      cnd_destroy( &(s->workers[ i ].sel.changed) );
+    }
+    free_sched( s );
+  }
+}
+
+
+static int tinylsched_gc( lua_State* L ) {
+  tinylsched* sched = lua_touserdata( L, 1 );
+  tinylsched_shared* s = sched->s;
+  if( s ) {
+    int busy = 0;
+    size_t i = 0;
+    sched->s = NULL;
+    no_fail( mtx_lock( &(s->mutex) ) );
+    busy = s->ntasks > 0;
+    if( busy ) {
+      /* a task might never finish, so don't block the collector:
+       * the workers exit (and clean up) after the last task */
+      s->is_closed = 1;
+      s->is_detached = 1;
+      for( i = 0; i < s->nworkers; ++i )
+        no_fail( thrd_detach( s->workers[ i ].thread ) );
+    }
+    no_fail( mtx_unlock( &(s->mutex) ) );
+    if( !busy ) {
+      stop_sched( s );
+      free_sched( s );
+    }
+  }
+  return 0;
+}
+
+
+static int tinylsched_close( lua_State* L ) {
+  tinylsched* sched = check_sched( L, 1 );
+  tinylsched_shared* s = sched->s;
+  int n = 0;
+  lua_settop( L, 1 );
+  luaL_checkstack( L, 3, "tinylsched_close" );
+  /* wait for the tasks here, where it can be interrupted */
+  wait_for_tasks( L, s, NULL );
+  no_fail( mtx_unlock( &(s->mutex) ) );
+  sched->s = NULL;
+  stop_sched( s );
+  n = push_sched_result( L, s );
+  free_sched( s );
+  return n;
+}
+
+
+
+
+static int dump_writer( lua_State* L, void const* p, size_t sz,
+                        void* ud ) {
+  (void)L;
+  luaL_addlstring( ud, p, sz );
+  return 0;
+}
+
+
+static int tinylthread_compile( lua_State* L ) {
+  size_t len = 0;
+  char const* s = luaL_checklstring( L, 1, &len );
+  char const* name = luaL_optstring( L, 2, "=chunk" );
+  tinylchunk* chunk = NULL;
+  luaL_Buffer b;
+  lua_settop( L, 2 );
+  chunk = lua_newuserdata( L, sizeof( *chunk ) );
+  chunk->s = NULL;
+  luaL_setmetatable( L, TLT_CHUNK_NAME );
+  if( 0 != luaL_loadbuffer( L, s, len, name ) )
+    lua_error( L ); /* report syntax errors to the caller */
+  luaL_buffinit( L, &b );
+#if LUA_VERSION_NUM >= 503
+  if( 0 != lua_dump( L, dump_writer, &b, 0 ) )
+#else
+  if( 0 != lua_dump( L, dump_writer, &b ) )
+#endif
+    luaL_error( L, "unable to dump compiled chunk" );
+  luaL_pushresult( &b );
+  s = lua_tolstring( L, -1, &len );
+  chunk->s = malloc( offsetof( tinylchunk_shared, code ) + len );
+  if( !chunk->s )
+    luaL_error( L, "memory allocation error" );
+  chunk->s->len = len;
+  memcpy( chunk->s->code, s, len );
+  if( !init_ref_count( &(chunk->s->ref), 1 ) ) {
+    free( chunk->s );
+    chunk->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  lua_settop( L, 3 );
+  return 1;
+}
+
+
+static int tinylchunk_copy( void* p, lua_State* L, int midx ) {
+  tinylchunk* chunk = p;
+  tinylchunk* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( chunk->s ) {
+    increment_ref_count( L, &(chunk->s->ref) );
+    copy->s = chunk->s;
+  }
+  return 1;
+}
+
+
+static int tinylchunk_gc( lua_State* L ) {
+  tinylchunk* chunk = lua_touserdata( L, 1 );
+  if( chunk->s ) {
+    if( 0 == decrement_ref_count( L, &(chunk->s->ref) ) ) {
+      destroy_ref_count( &(chunk->s->ref) );
+      free( chunk->s );
+    }
+    chunk->s = NULL;
+  }
+  return 0;
+}
+
+
+
+static int tinylthread_new_buffer( lua_State* L ) {
+  size_t len = 0;
+  char const* s = luaL_checklstring( L, 1, &len );
+  tinylbuffer* buffer = lua_newuserdata( L, sizeof( *buffer ) );
+  buffer->s = NULL;
+  buffer->offset = 0;
+  buffer->len = len;
+  luaL_setmetatable( L, TLT_BUF_NAME );
+  buffer->s = malloc( offsetof( tinylbuffer_shared, data ) + len );
+  if( !buffer->s )
+    luaL_error( L, "memory allocation error" );
+  buffer->s->len = len;
+  memcpy( buffer->s->data, s, len );
+  if( !init_ref_count( &(buffer->s->ref), 1 ) ) {
+    free( buffer->s );
+    buffer->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  return 1;
+}
+
+
+static int tinylbuffer_copy( void* p, lua_State* L, int midx ) {
+  tinylbuffer* buffer = p;
+  tinylbuffer* copy = lua_newuserdata( L, sizeof( *copy ) );
+  copy->s = NULL;
+  copy->offset = buffer->offset;
+  copy->len = buffer->len;
+  lua_pushvalue( L, midx );
+  lua_setmetatable( L, -2 );
+  if( buffer->s ) {
+    increment_ref_count( L, &(buffer->s->ref) );
+    copy->s = buffer->s;
+  }
+  return 1;
+}
+
+
+static int tinylbuffer_gc( lua_State* L ) {
+  tinylbuffer* buffer = lua_touserdata( L, 1 );
+  if( buffer->s ) {
+    if( 0 == decrement_ref_count( L, &(buffer->s->ref) ) ) {
+      destroy_ref_count( &(buffer->s->ref) );
+      free( buffer->s );
+    }
+    buffer->s = NULL;
+  }
+  return 0;
+}
+
+
+/* converts relative string positions (like `string.sub`) to a range
+ * of bytes [*i, *j) */
+static void get_range( lua_State* L, int idx, size_t len,
+                       lua_Integer defi, lua_Integer defj,
+                       size_t* i, size_t* j ) {
+  lua_Integer a = luaL_optinteger( L, idx, defi );
+  lua_Integer b = luaL_optinteger( L, idx+1, defj );
+  if( a < 0 )
+    a = (lua_Integer)len + a + 1;
+  if( b < 0 )
+    b = (lua_Integer)len + b + 1;
+  if( a < 1 )
+    a = 1;
+  if( b > (lua_Integer)len )
+    b = (lua_Integer)len;
+  if( a > b ) {
+    *i = *j = 0;
+  } else {
+    *i = (size_t)a-1;
+    *j = (size_t)b;
+  }
+}
+
+
+static int tinylbuffer_len( lua_State* L ) {
+  tinylbuffer* buffer = check_buffer( L, 1 );
+  lua_pushinteger( L, (lua_Integer)buffer->len );
+  return 1;
+}
+
+
+static int tinylbuffer_tostring( lua_State* L ) {
+  tinylbuffer* buffer = check_buffer( L, 1 );
+  size_t i = 0;
+  size_t j = 0;
+  get_range( L, 2, buffer->len, 1, -1, &i, &j );
+  lua_pushlstring( L, buffer->s->data+buffer->offset+i, j-i );
+  return 1;
+}
+
+
+/* creates a new view sharing the bytes with the original buffer */
+static int tinylbuffer_sub( lua_State* L ) {
+  tinylbuffer* buffer = check_buffer( L, 1 );
+  size_t i = 0;
+  size_t j = 0;
+  get_range( L, 2, buffer->len, 1, -1, &i, &j );
+  lua_settop( L, 1 );
+  luaL_getmetatable( L, TLT_BUF_NAME );
+  tinylbuffer_copy( buffer, L, 2 );
+  buffer = lua_touserdata( L, -1 );
+  buffer->offset += i;
+  buffer->len = j-i;
+  return 1;
+}
+
+
+static int tinylbuffer_byte( lua_State* L ) {
+  tinylbuffer* buffer = check_buffer( L, 1 );
+  unsigned char const* p = NULL;
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  lua_Integer a = luaL_optinteger( L, 2, 1 );
+  get_range( L, 2, buffer->len, 1, a, &i, &j );
+  if( j-i >= INT_MAX )
+    luaL_error( L, "string slice too long" );
+  luaL_checkstack( L, (int)(j-i), "string slice too long" );
+  p = (unsigned char const*)buffer->s->data + buffer->offset;
+  for( k = i; k < j; ++k )
+    lua_pushinteger( L, p[ k ] );
+  return (int)(j-i);
+}
+
+
+/* plain substring search (no patterns) */
+static int tinylbuffer_find( lua_State* L ) {
+  tinylbuffer* buffer = check_buffer( L, 1 );
+  size_t len = 0;
+  char const* s = luaL_checklstring( L, 2, &len );
+  lua_Integer init = luaL_optinteger( L, 3, 1 );
+  char const* data = buffer->s->data + buffer->offset;
+  size_t i = 0;
+  if( init < 0 )
+    init = (lua_Integer)buffer->len + init + 1;
+  if( init < 1 )
+    init = 1;
+  if( (size_t)init-1 > buffer->len ) {
+    lua_pushnil( L );
+    return 1;
+  }
+  for( i = (size_t)init-1; i+len <= buffer->len; ++i ) {
+    char const* p = NULL;
+    if( len == 0 ) {
+      p = data+i;
+    } else {
+      p = memchr( data+i, s[ 0 ], buffer->len-len-i+1 );
+      if( p == NULL )
+        break;
+    }
+    i = (size_t)(p-data);
+    if( memcmp( p, s, len ) == 0 ) {
+      lua_pushinteger( L, (lua_Integer)i+1 );
+      lua_pushinteger( L, (lua_Integer)(i+len) );
+      return 2;
+    }
+  }
+  lua_pushnil( L );
+  return 1;
+}
+
+
+
+static char const* const array_types[] = {
+  "int32", "int64", "float", "double", NULL
+};
+
+static size_t const array_sizes[] = {
+  sizeof( int32_t ), sizeof( int64_t ), sizeof( float ), sizeof( double )
+};
+
+#define is_integral( _s ) ((_s)->type == TLT_INT32 || \
+                           (_s)->type == TLT_INT64)
+
+/* address of the element with the given offset as char pointer */
+#define element_ptr( _s, _i ) \
+  ((char*)&((_s)->data) + (_i)*array_sizes[ (_s)->type ])
+
+/* expands `_k( type, union member )` for the element type of the
+ * array, so that all kernels are simple loops over plain C arrays
+ * which the compiler can vectorize */
+#define ARRAY_DISPATCH( _s, _k ) \
+  do { \
+    switch( (_s)->type ) { \
+      case TLT_INT32: _k( int32_t, i32 ); break; \
+      case TLT_INT64: _k( int64_t, i64 ); break; \
+      case TLT_FLOAT: _k( float, f32 ); break; \
+      default: _k( double, f64 ); break; \
+    } \
+  } while( 0 )
+
+
+static int tinylthread_new_array( lua_State* L ) {
+  int type = luaL_checkoption( L, 1, NULL, array_types );
+  lua_Integer n = luaL_checkinteger( L, 2 );
+  tinylarray* array = NULL;
+  luaL_argcheck( L, n >= 0 && (size_t)n <= ((size_t)-1 -
+                 sizeof( tinylarray_shared )) / array_sizes[ type ],
+                 2, "invalid array size" );
+  array = lua_newuserdata( L, sizeof( *array ) );
+  array->s = NULL;
+  array->offset = 0;
+  array->len = (size_t)n;
+  luaL_setmetatable( L, TLT_ARRAY_NAME );
+  /* all bits zero means 0 for integers and IEEE floats alike */
+  array->s = calloc( 1, sizeof( tinylarray_shared ) +
+                        (size_t)n * array_sizes[ type ] );
+  if( !array->s )
+    luaL_error( L, "memory allocation error" );
+  array->s->n = (size_t)n;
+  array->s->type = type;
+  if( !init_ref_count( &(array->s->ref), 1 ) ) {
+    free( array->s );
+    array->s = NULL;
+    luaL_error( L, "mutex initialization failed" );
+  }
+  return 1;
 }
 
 
-static int tinylport_copy( void* p, lua_State* L, int midx ) {
-  tinylport* port = p;
-  tinylport* copy = lua_newuserdata( L, sizeof( *copy ) );
+static int tinylarray_copy( void* p, lua_State* L, int midx ) {
+  tinylarray* array = p;
+  tinylarray* copy = lua_newuserdata( L, sizeof( *copy ) );
   copy->s = NULL;
-  copy->is_reader = port->is_reader;
+  copy->offset = array->offset;
+  copy->len = array->len;
   lua_pushvalue( L, midx );
   lua_setmetatable( L, -2 );
-  if( port->s ) {
-    increment_ref_count( L, &(port->s->ref) );
-    copy->s = port->s;
+  if( array->s ) {
+    increment_ref_count( L, &(array->s->ref) );
+    copy->s = array->s;
   }
   return 1;
 }
 
 
-static int tinylport_gc( lua_State* L ) {
-  tinylport* port = lua_touserdata( L, 1 );
-  if( port->s ) {
-    no_fail( mtx_lock( &(port->s->mutex) ) );
-    if( port->is_reader ) {
-      if( 0 == --(port->s->rports) )
-        no_fail( cnd_broadcast( &(port->s->waiting_senders) ) );
-    } else {
-      if( 0 == --(port->s->wports) ) {
-        no_fail( cnd_broadcast( &(port->s->data_copied) ) );
-        no_fail( cnd_broadcast( &(port->s->waiting_receivers) ) );
-      }
-    }
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    if( 0 == decrement_ref_count( L, &(port->s->ref) ) ) {
-      mtx_destroy( &(port->s->ref.mtx) );
-      mtx_destroy( &(port->s->mutex) );
-      cnd_destroy( &(port->s->data_copied) );
-      cnd_destroy( &(port->s->waiting_senders) );
-      cnd_destroy( &(port->s->waiting_receivers) );
-      free( port->s );
+static int tinylarray_gc( lua_State* L ) {
+  tinylarray* array = lua_touserdata( L, 1 );
+  if( array->s ) {
+    if( 0 == decrement_ref_count( L, &(array->s->ref) ) ) {
+      destroy_ref_count( &(array->s->ref) );
+      free( array->s );
     }
-    port->s = NULL;
+    array->s = NULL;
   }
   return 0;
 }
 
 
-static int tinylport_read( lua_State* L ) {
-  tinylport* port = check_rport( L, 1 );
-  tinylthread* thread = NULL;
-  int itr = 0;
-  int disabled = 0;
-  lua_settop( L, 1 );
-  thread = get_udata_from_registry( L, TLT_THISTHREAD );
-  mtx_lock_or_throw( L, &(port->s->mutex) );
-  while( !(itr=is_interrupted( thread, &disabled )) &&
-         port->s->L != NULL &&
-         port->s->wports > 0 ) {
-    set_block( thread, &(port->s->ref), &(port->s->waiting_receivers),
-               &(port->s->mutex) );
-    if( thrd_success !=
-        cnd_wait( &(port->s->waiting_receivers), &(port->s->mutex) ) ) {
-      set_block( thread, NULL, NULL, NULL );
-      no_fail( mtx_unlock( &(port->s->mutex) ) );
-      luaL_error( L, "waiting for port access failed" );
-    }
-    set_block( thread, NULL, NULL, NULL );
-  }
-  if( itr ) { /* handle interrupt request */
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    throw_interrupt( L );
+/* converts a (possibly negative) index into the view to an offset
+ * into the shared elements */
+static size_t check_index( lua_State* L, int idx, tinylarray* array ) {
+  lua_Integer i = luaL_checkinteger( L, idx );
+  if( i < 0 )
+    i += (lua_Integer)array->len + 1;
+  luaL_argcheck( L, i >= 1 && (size_t)i <= array->len, idx,
+                 "index out of range" );
+  return array->offset + (size_t)i - 1;
+}
+
+
+static int tinylarray_len( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  lua_pushinteger( L, (lua_Integer)array->len );
+  return 1;
+}
+
+
+static int tinylarray_type( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  lua_pushstring( L, array_types[ array->s->type ] );
+  return 1;
+}
+
+
+static int tinylarray_get( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  size_t i = check_index( L, 2, array );
+  switch( array->s->type ) {
+    case TLT_INT32:
+      lua_pushinteger( L, (lua_Integer)array->s->data.i32[ i ] );
+      break;
+    case TLT_INT64:
+      lua_pushinteger( L, (lua_Integer)array->s->data.i64[ i ] );
+      break;
+    case TLT_FLOAT:
+      lua_pushnumber( L, array->s->data.f32[ i ] );
+      break;
+    default:
+      lua_pushnumber( L, array->s->data.f64[ i ] );
+      break;
   }
-  if( port->s->wports == 0 ) { /* no more senders alive */
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    luaL_error( L, "broken pipe" );
+  return 1;
+}
+
+
+static int tinylarray_set( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  size_t i = check_index( L, 2, array );
+  switch( array->s->type ) {
+    case TLT_INT32:
+      array->s->data.i32[ i ] = (int32_t)luaL_checkinteger( L, 3 );
+      break;
+    case TLT_INT64:
+      array->s->data.i64[ i ] = (int64_t)luaL_checkinteger( L, 3 );
+      break;
+    case TLT_FLOAT:
+      array->s->data.f32[ i ] = (float)luaL_checknumber( L, 3 );
+      break;
+    default:
+      array->s->data.f64[ i ] = (double)luaL_checknumber( L, 3 );
+      break;
   }
-  port->s->L = L;
-  if( thrd_success !=
-      cnd_signal( &(port->s->waiting_senders) ) ) {
-    port->s->L = NULL;
-    no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    luaL_error( L, "waking up sender thread failed" );
+  return 0;
+}
+
+
+/* creates a new view sharing the elements with the original array */
+static int tinylarray_sub( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  size_t i = 0;
+  size_t j = 0;
+  get_range( L, 2, array->len, 1, -1, &i, &j );
+  lua_settop( L, 1 );
+  luaL_getmetatable( L, TLT_ARRAY_NAME );
+  tinylarray_copy( array, L, 2 );
+  array = lua_touserdata( L, -1 );
+  array->offset += i;
+  array->len = j-i;
+  return 1;
+}
+
+
+static int tinylarray_fill( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  lua_Integer iv = 0;
+  lua_Number nv = 0;
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  if( is_integral( array->s ) )
+    iv = luaL_checkinteger( L, 2 );
+  else
+    nv = luaL_checknumber( L, 2 );
+  get_range( L, 3, array->len, 1, -1, &i, &j );
+#define FILL( _t, _m ) \
+  { \
+    _t* p = array->s->data._m + array->offset; \
+    _t v = is_integral( array->s ) ? (_t)iv : (_t)nv; \
+    for( k = i; k < j; ++k ) \
+      p[ k ] = v; \
   }
-  while( !(itr=is_interrupted( thread, &disabled )) &&
-         port->s->L == L &&
-         port->s->wports > 0 ) {
-    set_block( thread, &(port->s->ref), &(port->s->data_copied),
-               &(port->s->mutex) );
-    if( thrd_success !=
-        cnd_wait( &(port->s->data_copied), &(port->s->mutex) ) ) {
-      set_block( thread, NULL, NULL, NULL );
-      port->s->L = NULL;
-      no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
-      no_fail( mtx_unlock( &(port->s->mutex) ) );
-      luaL_error( L, "waiting for data transfer failed" );
-    }
-    set_block( thread, NULL, NULL, NULL );
+  ARRAY_DISPATCH( array->s, FILL );
+#undef FILL
+  return 0;
+}
+
+
+static int tinylarray_sum( lua_State* L ) {
+  tinylarray* array = check_array( L, 1 );
+  /* several independent accumulators break the dependency chain,
+   * unsigned integers make overflow well-defined (wrap around) */
+  uint64_t iacc[ 4 ] = { 0, 0, 0, 0 };
+  double facc[ 4 ] = { 0, 0, 0, 0 };
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  get_range( L, 2, array->len, 1, -1, &i, &j );
+#define SUM( _t, _m, _acc, _at ) \
+  { \
+    _t const* p = array->s->data._m + array->offset; \
+    for( k = i; k+4 <= j; k += 4 ) { \
+      _acc[ 0 ] += (_at)p[ k ]; \
+      _acc[ 1 ] += (_at)p[ k+1 ]; \
+      _acc[ 2 ] += (_at)p[ k+2 ]; \
+      _acc[ 3 ] += (_at)p[ k+3 ]; \
+    } \
+    for( ; k < j; ++k ) \
+      _acc[ 0 ] += (_at)p[ k ]; \
   }
-  if( port->s->L == L ) { /* no data received */
-    if( itr ) { /* handle interrupt request */
-      no_fail( mtx_unlock( &(port->s->mutex) ) );
-      throw_interrupt( L );
-    }
-    if( port->s->wports == 0 ) {
-      no_fail( mtx_unlock( &(port->s->mutex) ) );
-      luaL_error( L, "broken pipe" );
-    }
+  switch( array->s->type ) {
+    case TLT_INT32:
+      SUM( int32_t, i32, iacc, uint64_t );
+      break;
+    case TLT_INT64:
+      SUM( int64_t, i64, iacc, uint64_t );
+      break;
+    case TLT_FLOAT:
+      SUM( float, f32, facc, double );
+      break;
+    default:
+      SUM( double, f64, facc, double );
+      break;
   }
-  no_fail( mtx_unlock( &(port->s->mutex) ) );
+#undef SUM
+  if( is_integral( array->s ) )
+    lua_pushinteger( L, (lua_Integer)(int64_t)(iacc[ 0 ] + iacc[ 1 ] +
+                                               iacc[ 2 ] + iacc[ 3 ]) );
+  else
+    lua_pushnumber( L, (lua_Number)(facc[ 0 ] + facc[ 1 ] +
+                                    facc[ 2 ] + facc[ 3 ]) );
   return 1;
 }
 
 
-static int tinylport_write( lua_State* L ) {
-  tinylport* port = check_wport( L, 1 );
-  tinylthread* thread = NULL;
-  int itr = 0;
-  int disabled = 0;
-  luaL_checkany( L, 2 );
-  lua_settop( L, 2 );
-  thread = get_udata_from_registry( L, TLT_THISTHREAD );
-  lua_pushvalue( L, 2 );
-  mtx_lock_or_throw( L, &(port->s->mutex) );
-  while( !(itr=is_interrupted( thread, &disabled )) &&
-         port->s->L == NULL &&
-         port->s->rports > 0 ) {
-    set_block( thread, &(port->s->ref), &(port->s->waiting_senders),
-               &(port->s->mutex) );
-    if( thrd_success !=
-        cnd_wait( &(port->s->waiting_senders), &(port->s->mutex) ) ) {
-      set_block( thread, NULL, NULL, NULL );
-      no_fail( mtx_unlock( &(port->s->mutex) ) );
-      luaL_error( L, "waiting for a receiver thread failed" );
-    }
-    set_block( thread, NULL, NULL, NULL );
+static int array_minmax( lua_State* L, int ismax ) {
+  tinylarray* array = check_array( L, 1 );
+  size_t i = 0;
+  size_t j = 0;
+  size_t k = 0;
+  get_range( L, 2, array->len, 1, -1, &i, &j );
+  if( i >= j ) {
+    lua_pushnil( L );
+    return 1;
   }
-  if( itr ) { /* handle interrupt request */
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    throw_interrupt( L );
+#define MINMAX( _t, _m ) \
+  { \
+    _t const* p = array->s->data._m + array->offset; \
+    _t v = p[ i ]; \
+    if( ismax ) { \
+      for( k = i+1; k < j; ++k ) \
+        v = p[ k ] > v ? p[ k ] : v; \
+    } else { \
+      for( k = i+1; k < j; ++k ) \
+        v = p[ k ] < v ? p[ k ] : v; \
+    } \
+    if( is_integral( array->s ) ) \
+      lua_pushinteger( L, (lua_Integer)v ); \
+    else \
+      lua_pushnumber( L, (lua_Number)v ); \
   }
-  if( port->s->rports == 0 ) { /* no more receivers alive */
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    luaL_error( L, "broken pipe" );
+  ARRAY_DISPATCH( array->s, MINMAX );
+#undef MINMAX
+  return 1;
+}
+
+static int tinylarray_min( lua_State* L ) {
+  return array_minmax( L, 0 );
+}
+
+static int tinylarray_max( lua_State* L ) {
+  return array_minmax( L, 1 );
+}
+
+
+/* y:axpy( alpha, x ) computes y = alpha*x + y element-wise */
+static int tinylarray_axpy( lua_State* L ) {
+  tinylarray* y = check_array( L, 1 );
+  tinylarray* x = check_array( L, 3 );
+  lua_Integer ia = 0;
+  lua_Number na = 0;
+  size_t k = 0;
+  if( is_integral( y->s ) )
+    ia = luaL_checkinteger( L, 2 );
+  else
+    na = luaL_checknumber( L, 2 );
+  luaL_argcheck( L, x->s->type == y->s->type, 3, "array type mismatch" );
+  luaL_argcheck( L, x->len == y->len, 3, "array length mismatch" );
+#define AXPY_INT( _t, _m ) \
+  { \
+    _t* py = y->s->data._m + y->offset; \
+    _t const* px = x->s->data._m + x->offset; \
+    uint64_t a = (uint64_t)ia; \
+    for( k = 0; k < y->len; ++k ) \
+      py[ k ] = (_t)((uint64_t)py[ k ] + a * (uint64_t)px[ k ]); \
   }
-  if( 0 != lua_cpcallr( port->s->L, copy_stack_top, L, 1 ) ) {
-    int res = lua_cpcallr( L, copy_stack_top, port->s->L, 1 );
-    lua_pop( port->s->L, 1 ); /* remove error object */
-    if( res != 0 )
-      lua_pushliteral( L, "unknown error" );
-    lua_error( L );
+#define AXPY_FLOAT( _t, _m ) \
+  { \
+    _t* py = y->s->data._m + y->offset; \
+    _t const* px = x->s->data._m + x->offset; \
+    _t a = (_t)na; \
+    for( k = 0; k < y->len; ++k ) \
+      py[ k ] += a * px[ k ]; \
   }
-  /* signal waiting receiver */
-  if( thrd_success !=
-      cnd_signal( &(port->s->data_copied) ) ) {
-    lua_pop( port->s->L, 1 );
-    no_fail( mtx_unlock( &(port->s->mutex) ) );
-    luaL_error( L, "waking up receiver thread failed" );
+  switch( y->s->type ) {
+    case TLT_INT32:
+      AXPY_INT( int32_t, i32 );
+      break;
+    case TLT_INT64:
+      AXPY_INT( int64_t, i64 );
+      break;
+    case TLT_FLOAT:
+      AXPY_FLOAT( float, f32 );
+      break;
+    default:
+      AXPY_FLOAT( double, f64 );
+      break;
   }
-  port->s->L = NULL;
-  no_fail( cnd_signal( &(port->s->waiting_receivers) ) );
-  no_fail( mtx_unlock( &(port->s->mutex) ) );
-  lua_pushboolean( L, 1 );
-  return 1;
+#undef AXPY_INT
+#undef AXPY_FLOAT
+  return 0;
+}
+
+
+/* dst:copy( src [, i] ) copies all elements of src to dst starting
+ * at index i (the ranges may overlap) */
+static int tinylarray_copyfrom( lua_State* L ) {
+  tinylarray* dst = check_array( L, 1 );
+  tinylarray* src = check_array( L, 2 );
+  lua_Integer i = luaL_optinteger( L, 3, 1 );
+  luaL_argcheck( L, src->s->type == dst->s->type, 2,
+                 "array type mismatch" );
+  luaL_argcheck( L, i >= 1 && (size_t)i-1 <= dst->len &&
+                    src->len <= dst->len-((size_t)i-1), 3,
+                 "range out of bounds" );
+  memmove( element_ptr( dst->s, dst->offset+(size_t)i-1 ),
+           element_ptr( src->s, src->offset ),
+           src->len * array_sizes[ src->s->type ] );
+  return 0;
 }
 
 
@@ -1030,6 +7334,175 @@ static int tinylthread_sleep( lua_State* L ) {
 }
 
 
+/* wall clock time in seconds (e.g. for benchmarks) */
+static int tinylthread_clock( lua_State* L ) {
+  struct timespec ts;
+  if( TIME_UTC != timespec_get( &ts, TIME_UTC ) )
+    luaL_error( L, "reading clock failed" );
+  lua_pushnumber( L, (lua_Number)ts.tv_sec +
+                     (lua_Number)ts.tv_nsec / 1000000000.0 );
+  return 1;
+}
+
+
+/* process-wide statistics; an optional boolean argument switches the
+ * collection of statistics on or off */
+static int tinylthread_globalstats( lua_State* L ) {
+  if( !lua_isnoneornil( L, 1 ) ) {
+    luaL_checktype( L, 1, LUA_TBOOLEAN );
+#ifdef TLT_HAVE_STATS
+    atomic_store_explicit( &stats_off, !lua_toboolean( L, 1 ),
+                           memory_order_relaxed );
+#endif
+  }
+  lua_createtable( L, 0, 10 );
+  lua_pushboolean( L, stats_on() );
+  lua_setfield( L, -2, "enabled" );
+#ifdef TLT_HAVE_STATS
+  set_stat_field( L, "threads", stat_get( global_stats.threads ) );
+  set_stat_field( L, "messages", stat_get( global_stats.messages ) );
+  set_stat_field( L, "bytes", stat_get( global_stats.bytes ) );
+  set_stat_field( L, "acquisitions",
+                  stat_get( global_stats.acquisitions ) );
+  set_stat_field( L, "contended", stat_get( global_stats.contended ) );
+  set_stat_field( L, "interrupts", stat_get( global_stats.interrupts ) );
+  push_wait_stats( L, &(global_stats.wait) );
+#endif
+  return 1;
+}
+
+
+/* waits until one of the given ports is ready, and returns its index
+ * (and the value read for input ports). Output ports are only
+ * checked for readiness, the actual write is left to the caller. */
+static int tinylthread_select( lua_State* L ) {
+  tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
+  int has_timeout = !lua_isnoneornil( L, 2 );
+  lua_Number timeout = luaL_optnumber( L, 2, 0 );
+  struct timespec deadline;
+  select_entry* entries = NULL;
+  tinylselect sel;
+  size_t n = 0;
+  size_t i = 0;
+  size_t start = 0;
+  int ready = 0;
+  int itr = 0;
+  int disabled = 0;
+  int timedout = 0;
+  int failed = 0;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  luaL_argcheck( L, timeout >= 0, 2, "non-negative number expected" );
+  n = lua_rawlen( L, 1 );
+  luaL_argcheck( L, n > 0 && n <= INT_MAX, 1, "invalid number of ports" );
+  lua_settop( L, 1 );
+  /* start the scan at the next port on every call, so that a busy
+   * port can't starve the ports after it */
+  lua_getfield( L, LUA_REGISTRYINDEX, TLT_SELECT_NEXT );
+  start = (size_t)lua_tointeger( L, -1 ) % n;
+  lua_pop( L, 1 );
+  lua_pushinteger( L, (lua_Integer)((start + 1) % n) );
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_SELECT_NEXT );
+  entries = lua_newuserdata( L, n * sizeof( *entries ) );
+  for( i = 0; i < n; ++i ) {
+    lua_rawgeti( L, 1, (int)i+1 );
+    entries[ i ].port = test_udata( L, -1, TLT_RPORT_NAME );
+    if( !entries[ i ].port )
+      entries[ i ].port = test_udata( L, -1, TLT_WPORT_NAME );
+    if( !entries[ i ].port || !entries[ i ].port->s )
+      luaL_argerror( L, 1, lua_pushfstring( L, "port expected at index %d",
+                                            (int)i+1 ) );
+    entries[ i ].w.sel = &sel;
+    entries[ i ].w.next = NULL;
+    entries[ i ].w.next_notified = NULL;
+    entries[ i ].w.is_notified = 0;
+    entries[ i ].is_registered = 0;
+    lua_pop( L, 1 );
+  }
+  if( has_timeout )
+    has_timeout = NULL != make_deadline( L, &deadline, timeout );
+  for( ;; ) {
+    if( thrd_success != mtx_init( &(sel.mutex), mtx_plain ) )
+      luaL_error( L, "mutex initialization failed" );
+    if( thrd_success != cnd_init( &(sel.changed) ) ) {
+      mtx_destroy( &(sel.mutex) );
+      luaL_error( L, "condition variable initialization failed" );
+    }
+    sel.notified = NULL;
+    sel.is_changed = 0;
+    for( i = 0; i < n && !ready; ++i ) {
+      size_t j = (start + i) % n;
+      if( watch_port( entries[ j ].port, &(entries[ j ].w) ) )
+        ready = (int)j+1;
+      else
+        entries[ j ].is_registered = 1;
+    }
+    if( !ready ) {
+      no_fail( mtx_lock( &(sel.mutex) ) );
+      while( !(itr=is_interrupted( thread, &disabled )) &&
+             !sel.is_changed && !timedout && !failed ) {
+        int res = 0;
+        set_block( thread, &(entries[ 0 ].port->s->ref), &(sel.changed),
+                   &(sel.mutex) );
+        res = cnd_wait_until( &(sel.changed), &(sel.mutex),
+                              has_timeout ? &deadline : NULL, NULL );
+        set_block( thread, NULL, NULL, NULL );
+        if( res == thrd_timedout )
+          timedout = 1;
+        else if( res != thrd_success )
+          failed = 1;
+      }
+      no_fail( mtx_unlock( &(sel.mutex) ) );
+    }
+    for( i = 0; i < n; ++i ) {
+      if( entries[ i ].is_registered ) {
+        unwatch_port( entries[ i ].port->s, entries[ i ].port->is_reader,
+                      &(entries[ i ].w) );
+        entries[ i ].is_registered = 0;
+        entries[ i ].w.is_notified = 0;
+      }
+    }
+    cnd_destroy( &(sel.changed) );
+    mtx_destroy( &(sel.mutex) );
+    if( itr ) /* handle interrupt request */
+      throw_interrupt( L );
+    if( failed )
+      luaL_error( L, "waiting for ports failed" );
+    if( ready ) {
+      tinylport* port = entries[ ready-1 ].port;
+      int r = 1;
+      if( port->is_reader ) {
+        luaL_checkstack( L, LUA_MINSTACK, "too many values" );
+        if( port->s->capacity > 0 )
+          r = read_buffered( L, port, thread, 1, 0, NULL );
+        else
+          r = read_direct( L, port, thread, 1, 0, NULL );
+      } else {
+        no_fail( mtx_lock( &(port->s->mutex) ) );
+        if( port->s->rports == 0 )
+          r = -1;
+        no_fail( mtx_unlock( &(port->s->mutex) ) );
+      }
+      if( r > 0 ) {
+        lua_pushinteger( L, ready );
+        lua_replace( L, 1 );
+        lua_remove( L, 2 ); /* the entries */
+        return lua_gettop( L );
+      } else if( r < 0 ) {
+        lua_pushnil( L );
+        lua_pushliteral( L, "broken pipe" );
+        lua_pushinteger( L, ready );
+        return 3;
+      }
+      ready = 0; /* somebody else was faster, try again */
+    } else if( timedout ) {
+      lua_pushnil( L );
+      lua_pushliteral( L, "timeout" );
+      return 2;
+    }
+  }
+}
+
+
 static int tinylthread_nointerrupt( lua_State* L ) {
   tinylthread* thread = get_udata_from_registry( L, TLT_THISTHREAD );
   if( thread != NULL ) {
@@ -1050,9 +7523,23 @@ static int tinylthread_type( lua_State* L ) {
   type_map const types[] = {
     { TLT_THRD_NAME, "thread" },
     { TLT_MTX_NAME, "mutex" },
+    { TLT_RWLOCK_NAME, "rwlock" },
+    { TLT_SEM_NAME, "semaphore" },
+    { TLT_BARRIER_NAME, "barrier" },
+    { TLT_COND_NAME, "condition" },
+    { TLT_ATOMIC_NAME, "atomic" },
+    { TLT_STORE_NAME, "store" },
     { TLT_RPORT_NAME, "port" },
     { TLT_WPORT_NAME, "port" },
     { TLT_ITR_NAME, "interrupt" },
+    { TLT_POOL_NAME, "pool" },
+    { TLT_JOB_NAME, "job" },
+    { TLT_FUTURE_NAME, "future" },
+    { TLT_SCHED_NAME, "scheduler" },
+    { TLT_TOKEN_NAME, "token" },
+    { TLT_CHUNK_NAME, "chunk" },
+    { TLT_BUF_NAME, "buffer" },
+    { TLT_ARRAY_NAME, "array" },
     { NULL, NULL }
   };
   lua_settop( L, 1 );
@@ -1144,8 +7631,28 @@ TINYLTHREAD_API int luaopen_tinylthread( lua_State* L ) {
   luaL_Reg const functions[] = {
     { "thread", tinylthread_new_thread },
     { "mutex", tinylthread_new_mutex },
+    { "rwlock", tinylthread_new_rwlock },
+    { "semaphore", tinylthread_new_semaphore },
+    { "barrier", tinylthread_new_barrier },
+    { "condition", tinylthread_new_condition },
+    { "atomic", tinylthread_new_atomic },
+    { "store", tinylthread_new_store },
     { "pipe", tinylthread_new_pipe },
+    { "pool", tinylthread_new_pool },
+    { "async", tinylthread_async },
+    { "wait_any", tinylthread_wait_any },
+    { "wait_all", tinylthread_wait_all },
+    { "map", tinylthread_map },
+    { "reduce", tinylthread_reduce },
+    { "scheduler", tinylthread_new_scheduler },
+    { "spawn", tinylthread_spawn },
+    { "compile", tinylthread_compile },
+    { "buffer", tinylthread_new_buffer },
+    { "array", tinylthread_new_array },
     { "sleep", tinylthread_sleep },
+    { "clock", tinylthread_clock },
+    { "stats", tinylthread_globalstats },
+    { "select", tinylthread_select },
     { "nointerrupt", tinylthread_nointerrupt },
     { "type", tinylthread_type },
     { "version", tinylthread_version },
@@ -1155,6 +7662,8 @@ TINYLTHREAD_API int luaopen_tinylthread( lua_State* L ) {
     { "detach", tinylthread_detach },
     { "join", tinylthread_join },
     { "interrupt", tinylthread_interrupt },
+    { "memory", tinylthread_memory },
+    { "stats", tinylthread_stats },
     { NULL, NULL }
   };
   luaL_Reg const thread_metas[] = {
@@ -1164,8 +7673,10 @@ TINYLTHREAD_API int luaopen_tinylthread( lua_State* L ) {
   };
   luaL_Reg const mutex_methods[] = {
     { "lock", tinylmutex_lock },
+    { "ylock", tinylmutex_ylock },
     { "trylock", tinylmutex_trylock },
     { "unlock", tinylmutex_unlock },
+    { "stats", tinylmutex_stats },
     { NULL, NULL }
   };
   luaL_Reg const mutex_metas[] = {
@@ -1173,12 +7684,94 @@ TINYLTHREAD_API int luaopen_tinylthread( lua_State* L ) {
     { "__copy@tinylthread", (lua_CFunction)tinylmutex_copy },
     { NULL, NULL }
   };
+  luaL_Reg const rwlock_methods[] = {
+    { "rdlock", tinylrwlock_rdlock },
+    { "wrlock", tinylrwlock_wrlock },
+    { "tryrdlock", tinylrwlock_tryrdlock },
+    { "trywrlock", tinylrwlock_trywrlock },
+    { "unlock", tinylrwlock_unlock },
+    { NULL, NULL }
+  };
+  luaL_Reg const rwlock_metas[] = {
+    { "__gc", tinylrwlock_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylrwlock_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const semaphore_methods[] = {
+    { "acquire", tinylsemaphore_acquire },
+    { "tryacquire", tinylsemaphore_tryacquire },
+    { "release", tinylsemaphore_release },
+    { "count", tinylsemaphore_count },
+    { NULL, NULL }
+  };
+  luaL_Reg const semaphore_metas[] = {
+    { "__gc", tinylsemaphore_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylsemaphore_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const barrier_methods[] = {
+    { "wait", tinylbarrier_wait },
+    { NULL, NULL }
+  };
+  luaL_Reg const barrier_metas[] = {
+    { "__gc", tinylbarrier_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylbarrier_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const condition_methods[] = {
+    { "wait", tinylcondition_wait },
+    { "signal", tinylcondition_signal },
+    { "broadcast", tinylcondition_broadcast },
+    { NULL, NULL }
+  };
+  luaL_Reg const condition_metas[] = {
+    { "__gc", tinylcondition_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylcondition_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const atomic_methods[] = {
+    { "load", tinylatomic_load },
+    { "store", tinylatomic_store },
+    { "add", tinylatomic_add },
+    { "sub", tinylatomic_sub },
+    { "exchange", tinylatomic_exchange },
+    { "compare_exchange", tinylatomic_compare_exchange },
+    { NULL, NULL }
+  };
+  luaL_Reg const atomic_metas[] = {
+    { "__gc", tinylatomic_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylatomic_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const store_methods[] = {
+    { "get", tinylstore_get },
+    { "set", tinylstore_set },
+    { "cas", tinylstore_cas },
+    { "incr", tinylstore_incr },
+    { "delete", tinylstore_delete },
+    { NULL, NULL }
+  };
+  luaL_Reg const store_metas[] = {
+    { "__gc", tinylstore_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylstore_copy },
+    { NULL, NULL }
+  };
   luaL_Reg const rport_methods[] = {
     { "read", tinylport_read },
+    { "readall", tinylport_readall },
+    { "tryread", tinylport_tryread },
+    { "yread", tinylport_yread },
+    { "settimeout", tinylport_settimeout },
+    { "stats", tinylport_stats },
     { NULL, NULL }
   };
   luaL_Reg const wport_methods[] = {
     { "write", tinylport_write },
+    { "writev", tinylport_writev },
+    { "trywrite", tinylport_trywrite },
+    { "ywrite", tinylport_ywrite },
+    { "settimeout", tinylport_settimeout },
+    { "stats", tinylport_stats },
     { NULL, NULL }
   };
   luaL_Reg const port_metas[] = {
@@ -1186,6 +7779,93 @@ TINYLTHREAD_API int luaopen_tinylthread( lua_State* L ) {
     { "__copy@tinylthread", (lua_CFunction)tinylport_copy },
     { NULL, NULL }
   };
+  luaL_Reg const pool_methods[] = {
+    { "run", tinylpool_run },
+    { "close", tinylpool_close },
+    { NULL, NULL }
+  };
+  luaL_Reg const pool_metas[] = {
+    { "__gc", tinylpool_gc },
+    { NULL, NULL }
+  };
+  luaL_Reg const job_methods[] = {
+    { "join", tinyljob_join },
+    { NULL, NULL }
+  };
+  luaL_Reg const job_metas[] = {
+    { "__gc", tinyljob_gc },
+    { NULL, NULL }
+  };
+  luaL_Reg const future_methods[] = {
+    { "get", tinylfuture_get },
+    { "ready", tinylfuture_ready },
+    { NULL, NULL }
+  };
+  luaL_Reg const future_metas[] = {
+    { "__gc", tinylfuture_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylfuture_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const sched_methods[] = {
+    { "spawn", tinylsched_spawn },
+    { "wait", tinylsched_wait },
+    { "close", tinylsched_close },
+    { NULL, NULL }
+  };
+  luaL_Reg const sched_metas[] = {
+    { "__gc", tinylsched_gc },
+    { NULL, NULL }
+  };
+#ifdef TLT_HAVE_YIELDK
+  luaL_Reg const token_methods[] = {
+    { "ready", tinyltoken_ready },
+    { "wait", tinyltoken_wait },
+    { NULL, NULL }
+  };
+  luaL_Reg const token_metas[] = {
+    { "__gc", tinyltoken_gc },
+    { NULL, NULL }
+  };
+#endif
+  luaL_Reg const chunk_metas[] = {
+    { "__gc", tinylchunk_gc },
+    { "__copy@tinylthread", (lua_CFunction)tinylchunk_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const buffer_methods[] = {
+    { "len", tinylbuffer_len },
+    { "sub", tinylbuffer_sub },
+    { "byte", tinylbuffer_byte },
+    { "find", tinylbuffer_find },
+    { "tostring", tinylbuffer_tostring },
+    { NULL, NULL }
+  };
+  luaL_Reg const buffer_metas[] = {
+    { "__gc", tinylbuffer_gc },
+    { "__len", tinylbuffer_len },
+    { "__copy@tinylthread", (lua_CFunction)tinylbuffer_copy },
+    { NULL, NULL }
+  };
+  luaL_Reg const array_methods[] = {
+    { "len", tinylarray_len },
+    { "type", tinylarray_type },
+    { "get", tinylarray_get },
+    { "set", tinylarray_set },
+    { "sub", tinylarray_sub },
+    { "fill", tinylarray_fill },
+    { "sum", tinylarray_sum },
+    { "min", tinylarray_min },
+    { "max", tinylarray_max },
+    { "axpy", tinylarray_axpy },
+    { "copy", tinylarray_copyfrom },
+    { NULL, NULL }
+  };
+  luaL_Reg const array_metas[] = {
+    { "__gc", tinylarray_gc },
+    { "__len", tinylarray_len },
+    { "__copy@tinylthread", (lua_CFunction)tinylarray_copy },
+    { NULL, NULL }
+  };
   luaL_Reg const itr_metas[] = {
     { "__tostring", tinylitr_tostring },
     { "__copy@tinylthread", (lua_CFunction)tinylitr_copy },
@@ -1197,12 +7877,41 @@ TINYLTHREAD_API int luaopen_tinylthread( lua_State* L ) {
   /* create and register all metatables used by this module */
   create_meta( L, TLT_THRD_NAME, thread_methods, thread_metas );
   create_meta( L, TLT_MTX_NAME, mutex_methods, mutex_metas );
+  create_meta( L, TLT_RWLOCK_NAME, rwlock_methods, rwlock_metas );
+  create_meta( L, TLT_SEM_NAME, semaphore_methods, semaphore_metas );
+  create_meta( L, TLT_BARRIER_NAME, barrier_methods, barrier_metas );
+  create_meta( L, TLT_COND_NAME, condition_methods, condition_metas );
+  create_meta( L, TLT_ATOMIC_NAME, atomic_methods, atomic_metas );
+  create_meta( L, TLT_STORE_NAME, store_methods, store_metas );
   create_meta( L, TLT_RPORT_NAME, rport_methods, port_metas );
   create_meta( L, TLT_WPORT_NAME, wport_methods, port_metas );
   create_meta( L, TLT_ITR_NAME, NULL, itr_metas );
-  /* store the common thread main function in the registry */
+  create_meta( L, TLT_POOL_NAME, pool_methods, pool_metas );
+  create_meta( L, TLT_JOB_NAME, job_methods, job_metas );
+  create_meta( L, TLT_FUTURE_NAME, future_methods, future_metas );
+  create_meta( L, TLT_SCHED_NAME, sched_methods, sched_metas );
+#ifdef TLT_HAVE_YIELDK
+  create_meta( L, TLT_TOKEN_NAME, token_methods, token_metas );
+#endif
+  create_meta( L, TLT_CHUNK_NAME, NULL, chunk_metas );
+  create_meta( L, TLT_BUF_NAME, buffer_methods, buffer_metas );
+  create_meta( L, TLT_ARRAY_NAME, array_methods, array_metas );
+#ifdef TLT_HAVE_STATS
+  /* only the first Lua state that loads this module looks at the
+   * environment, so that tlt.stats( bool ) isn't overridden later */
+  if( !atomic_flag_test_and_set( &stats_configured ) ) {
+    char const* env = getenv( "TINYLTHREAD_STATS" );
+    if( env != NULL && 0 == strcmp( env, "0" ) )
+      atomic_store_explicit( &stats_off, 1, memory_order_relaxed );
+  }
+#endif
+  /* store the common thread main functions in the registry */
   lua_pushcfunction( L, (lua_CFunction)tinylthread_thunk );
   lua_setfield( L, LUA_REGISTRYINDEX, TLT_THUNK );
+  lua_pushcfunction( L, (lua_CFunction)tinylpool_worker );
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_WORKER );
+  lua_pushcfunction( L, (lua_CFunction)tinylsched_worker );
+  lua_setfield( L, LUA_REGISTRYINDEX, TLT_SCHED_WORKER );
   /* create a sentinel value and store it in the registry */
   lua_newuserdata( L, 0 );
   luaL_setmetatable( L, TLT_ITR_NAME );
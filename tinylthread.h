@@ -19,7 +19,21 @@
 #  include <tinycthread.h>
 #endif
 
+#if defined( __STDC_VERSION__ ) && \
+    __STDC_VERSION__ >= 201112L && \
+    !defined( __STDC_NO_ATOMICS__ ) /* use C11 atomics */
+#  include <stdatomic.h>
+#  define TLT_HAVE_ATOMICS
+#endif
+
+/* runtime statistics need relaxed atomics to be cheap enough, define
+ * TLT_NO_STATS to compile them out completely */
+#if defined( TLT_HAVE_ATOMICS ) && !defined( TLT_NO_STATS )
+#  define TLT_HAVE_STATS
+#endif
+
 #include <stddef.h>
+#include <stdint.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
@@ -41,25 +55,73 @@
 /* metatable names */
 #define TLT_THRD_NAME   "tinylthread.thread"
 #define TLT_MTX_NAME    "tinylthread.mutex"
+#define TLT_RWLOCK_NAME "tinylthread.rwlock"
+#define TLT_SEM_NAME    "tinylthread.semaphore"
+#define TLT_BARRIER_NAME "tinylthread.barrier"
+#define TLT_COND_NAME   "tinylthread.condition"
+#define TLT_ATOMIC_NAME "tinylthread.atomic"
+#define TLT_STORE_NAME  "tinylthread.store"
 #define TLT_RPORT_NAME  "tinylthread.port.in"
 #define TLT_WPORT_NAME  "tinylthread.port.out"
 #define TLT_ITR_NAME    "tinylthread.interrupt"
+#define TLT_POOL_NAME   "tinylthread.pool"
+#define TLT_JOB_NAME    "tinylthread.job"
+#define TLT_FUTURE_NAME "tinylthread.future"
+#define TLT_SCHED_NAME  "tinylthread.scheduler"
+#define TLT_TOKEN_NAME  "tinylthread.token"
+#define TLT_CHUNK_NAME  "tinylthread.chunk"
+#define TLT_BUF_NAME    "tinylthread.buffer"
+#define TLT_ARRAY_NAME  "tinylthread.array"
 
 /* other important keys in the registry */
 #define TLT_THISTHREAD  "tinylthread.this"
 #define TLT_THUNK       "tinylthread.thunk"
+#define TLT_WORKER      "tinylthread.worker"
+#define TLT_MAP_POOL    "tinylthread.map.pool"
+#define TLT_SCHED_WORKER "tinylthread.scheduler.worker"
+#define TLT_THISWORKER  "tinylthread.this.worker"
+#define TLT_TASKS       "tinylthread.tasks"
+#define TLT_SLOT        "tinylthread.slot"
+#define TLT_STORE_DATA  "tinylthread.store.data"
 #define TLT_INTERRUPT   "tinylthread.interrupt.error"
+#define TLT_SELECT_NEXT "tinylthread.select.next"
 #define TLT_C_API_V1    "tinylthread.c.api.v1"
 
 
 /* common header for all objects/userdatas that may be shared over
  * multiple threads, and thus need reference counting */
 typedef struct {
+#ifdef TLT_HAVE_ATOMICS
+  atomic_size_t cnt;
+#else
   size_t cnt;
   mtx_t mtx;
+#endif
 } tinylheader;
 
 
+/* a counter that may be read without holding a lock */
+#ifdef TLT_HAVE_ATOMICS
+typedef atomic_size_t tinylcount;
+#else
+typedef size_t tinylcount;
+#endif
+
+/* a statistics counter */
+#ifdef TLT_HAVE_ATOMICS
+typedef atomic_ullong tinylstat;
+#else
+typedef unsigned long long tinylstat;
+#endif
+
+/* statistics about time spent blocked in cnd_wait (in nanoseconds) */
+typedef struct {
+  tinylstat waits;
+  tinylstat wait_ns;
+  tinylstat max_wait_ns;
+} tinylwaitstats;
+
+
 /* a structure that contains all information about where a
  * tinylthread is currently blocked */
 typedef struct {
@@ -69,17 +131,66 @@ typedef struct {
 } tinylblock;
 
 
+/* size classes of the pool allocator for Lua states of threads:
+ * allocations up to TLT_POOL_CLASSES*TLT_POOL_GRANULE bytes are
+ * carved out of arenas of TLT_POOL_ARENA bytes and recycled via free
+ * lists, bigger ones go to malloc */
+#define TLT_POOL_GRANULE  16
+#define TLT_POOL_CLASSES  32
+#define TLT_POOL_ARENA    (64*1024)
+
+typedef struct tinylarena {
+  struct tinylarena* next;
+} tinylarena;
+
+/* state of the allocator of a thread's Lua state; only used by one
+ * OS thread at a time, but the usage counters can be read from other
+ * threads */
+typedef struct {
+  tinylcount used;
+  tinylcount peak;
+  size_t limit;  /* 0 means no limit */
+  char use_pool;
+  void* free[ TLT_POOL_CLASSES ];  /* free lists for size classes */
+  tinylarena* arenas;
+  char* next;  /* unused part of the current arena */
+  char* end;
+} tinylalloc;
+
+
+/* attributes that are applied when a thread starts (see the options
+ * of tlt.thread) */
+typedef struct {
+  char name[ 16 ];  /* Linux limits thread names to 15 bytes */
+  int priority;  /* a nice value */
+  char has_priority;
+  char use_pthread;  /* created with pthread_create, not thrd_create */
+  thrd_start_t thunk;  /* thread main function (from the child state) */
+} tinylattrs;
+
+
+struct tinylfuture_shared;
+
 /* shared part of thread handle userdata type */
 typedef struct {
   tinylheader ref;
   thrd_t thread;
   mtx_t mutex;
   tinylblock block;  /* contains info if thread is blocked */
+  cnd_t finished;  /* signaled when the thread is about to exit */
   lua_State* L;  /* as long as it lives only the child may access L */
   int  exit_status;
   char is_detached;
+  char is_finished;
   char is_interrupted;
   char ignore_interrupt;
+  tinylalloc alloc;  /* allocator for L */
+  tinylattrs attrs;
+  struct tinylfuture_shared* future;  /* completed by the child */
+  /* statistics */
+  unsigned long long block_start;  /* protected by mutex */
+  tinylstat interrupts;
+  tinylwaitstats wait;
 } tinylthread_shared;
 
 /* thread handle userdata type */
@@ -95,34 +206,258 @@ typedef struct {
   mtx_t mutex;
   cnd_t unlocked;
   size_t count;
+  size_t waiters;  /* threads blocked in cnd_wait */
+  int spin;  /* average spin count for adaptive mutexes */
+  char adaptive;
+  struct tinylwatcher* watchers;  /* suspended scheduler tasks */
+  /* statistics */
+  tinylstat acquisitions;
+  tinylstat contended;
+  tinylwaitstats wait;
 } tinylmutex_shared;
 
 /* mutex handle userdata type */
 typedef struct {
   tinylmutex_shared* s;
+  lua_State* holder;  /* the coroutine that locked it via `ylock` */
   char is_owner;
 } tinylmutex;
 
 
+/* shared part of a (writer-preferring) reader-writer lock */
+typedef struct {
+  tinylheader ref;
+  mtx_t mutex;
+  cnd_t readers_ok;
+  cnd_t writers_ok;
+  size_t readers;  /* number of read locks currently held */
+  size_t waiting_writers;
+  char has_writer;
+} tinylrwlock_shared;
+
+/* reader-writer lock userdata type */
+typedef struct {
+  tinylrwlock_shared* s;
+  size_t nread;  /* read locks held via this handle */
+  char is_writer;
+} tinylrwlock;
+
+
+/* shared part of a counting semaphore */
+typedef struct {
+  tinylheader ref;
+  mtx_t mutex;
+  cnd_t available;
+  size_t count;
+} tinylsemaphore_shared;
+
+/* semaphore userdata type */
+typedef struct {
+  tinylsemaphore_shared* s;
+} tinylsemaphore;
+
+
+/* shared part of a (reusable) barrier */
+typedef struct {
+  tinylheader ref;
+  mtx_t mutex;
+  cnd_t released;
+  size_t n;
+  size_t arrived;
+  size_t phase;  /* incremented each time all threads have arrived */
+} tinylbarrier_shared;
+
+/* barrier userdata type */
+typedef struct {
+  tinylbarrier_shared* s;
+} tinylbarrier;
+
+
+/* shared part of a condition variable used together with a
+ * tinylthread mutex
+ *
+ * Every `signal` and `broadcast` that wakes somebody starts a new
+ * generation. Only waiters that arrived in an earlier generation
+ * (i.e. that were already waiting when the signal was sent) may
+ * consume a wakeup, so a later waiter can't steal it. */
+typedef struct {
+  tinylheader ref;
+  mtx_t mutex;
+  cnd_t signaled;
+  size_t waiters;
+  size_t eligible;  /* waiters that were present at the last signal */
+  size_t wakeups;  /* pending signals not yet consumed by a waiter */
+  size_t generation;
+} tinylcondition_shared;
+
+/* condition variable userdata type */
+typedef struct {
+  tinylcondition_shared* s;
+} tinylcondition;
+
+
+/* shared part of an atomic integer (without C11 atomics the value is
+ * protected by the mutex in the header) */
+typedef struct {
+  tinylheader ref;
+#ifdef TLT_HAVE_ATOMICS
+  atomic_llong value;
+#else
+  long long value;
+#endif
+} tinylatomic_shared;
+
+/* atomic integer userdata type */
+typedef struct {
+  tinylatomic_shared* s;
+} tinylatomic;
+
+
+/* one independently locked part of a store; the data lives in a
+ * table in a private Lua state */
+typedef struct {
+  mtx_t mutex;
+  lua_State* L;
+} tinylstripe;
+
+/* shared part of a key-value store */
+typedef struct {
+  tinylheader ref;
+  size_t nstripes;  /* always a power of two */
+  tinylstripe stripes[ 1 ];
+} tinylstore_shared;
+
+/* key-value store userdata type */
+typedef struct {
+  tinylstore_shared* s;
+} tinylstore;
+
+
+/* kinds of values in the ring buffer of a buffered pipe */
+#define TLT_CELL_EMPTY    0
+#define TLT_CELL_STATE    1  /* the value is in the cell's Lua state */
+#define TLT_CELL_NIL      2
+#define TLT_CELL_BOOLEAN  3
+#define TLT_CELL_NUMBER   4
+#define TLT_CELL_INTEGER  5
+#define TLT_CELL_STRING   6
+
+/* string buffers of cells up to this size are kept for reuse */
+#define TLT_CELL_KEEP     256
+
+/* an element of the ring buffer of a buffered pipe: nil, booleans,
+ * numbers and strings are serialized into the cell itself, all other
+ * values are copied into a Lua state of the cell */
+typedef struct {
+#ifdef TLT_HAVE_ATOMICS
+  atomic_size_t seq;  /* sequence number for the lock-free queue */
+#endif
+  lua_State* L;  /* holds a single value (created lazily) */
+  char* str;  /* string buffer */
+  size_t len;
+  size_t cap;
+  union {
+    lua_Number n;
+    lua_Integer i;
+    int b;
+  } v;
+  char kind;
+} tinylcell;
+
+/* a thread waiting for one of several ports in `tlt.select` (or a
+ * scheduler worker waiting for its suspended tasks) */
+typedef struct {
+  mtx_t mutex;
+  cnd_t changed;
+  struct tinylwatcher* notified;  /* watchers notified since the last
+                                   * check */
+  char is_changed;
+} tinylselect;
+
+/* registration of a selecting thread at a single port */
+typedef struct tinylwatcher {
+  tinylselect* sel;
+  struct tinylwatcher* next;
+  struct tinylwatcher* next_notified;
+  char is_notified;
+} tinylwatcher;
+
 /* shared part of port userdata type
  *
  * receiver:
  * - lock the mutex
  * - while L != NULL and wports > 0 wait on waiting_receivers
  * - raise error if wports == 0 or interrupted
- * - set L and signal waiting_senders
+ * - set L and want (max. number of values) and signal waiting_senders
  * - wait on data_copied
  * - set L to NULL
  * - signal waiting_receivers
  * - raise error if (wports == 0 and no value) or interrupted
  *
+ * non-blocking receiver (never waits):
+ * - lock the mutex
+ * - if L == NULL and offer != NULL, copy up to want values from the
+ *   offering sender, remove them from the offer, and broadcast
+ *   waiting_senders
+ *
  * sender:
  * - lock the mutex
- * - while L == NULL and rports > 0 wait on waiting_senders
+ * - increment senders, notify watchers
+ * - while L == NULL and rports > 0 and values are left, set offer
+ *   (if unset) and wait on waiting_senders
+ * - reset offer if it is ours, decrement senders
+ * - done if non-blocking receivers took all values
  * - raise error if rports == 0 or (interrupted and L == 0)
- * - copy value to L
- * - signal data_copied
- * - raise error if interrupted
+ * - copy up to want values to L
+ * - signal data_copied, set L to NULL, notify watchers
+ * - repeat if there are values left
+ *
+ * Threads waiting in `tlt.select` register a watcher at every port
+ * they are interested in. Whenever a port might have become ready,
+ * the thread changing it notifies all watchers (with the port mutex
+ * held).
+ *
+ * Buffered pipes (capacity > 0) don't use L and data_copied. Values
+ * are copied into the Lua states of a ring buffer instead. If C11
+ * atomics are available, the ring buffer is a lock-free bounded
+ * multi-producer/multi-consumer queue (Dmitry Vyukov's algorithm):
+ *
+ * receiver:
+ * - claim the cell at deq_pos if its seq is deq_pos+1 (CAS deq_pos)
+ * - copy the value from the cell, set seq to deq_pos+capacity
+ * - repeat for up to want values
+ * - if there are parked senders, lock the mutex and signal
+ *   waiting_senders
+ * - if the queue was empty: lock the mutex, increment parked_receivers
+ *   and wait on waiting_receivers while the queue is empty and
+ *   wports > 0, then retry (or raise an error)
+ *
+ * sender:
+ * - claim the cell at enq_pos if its seq is enq_pos (CAS enq_pos)
+ * - copy a value to the cell, set seq to enq_pos+1
+ * - repeat for all values, parking like the receiver (using
+ *   parked_senders and waiting_senders) while the queue is full
+ *   and rports > 0
+ * - if there are parked receivers, lock the mutex and signal
+ *   waiting_receivers
+ *
+ * Without atomics the mutex protects the ring buffer:
+ *
+ * receiver:
+ * - lock the mutex
+ * - while count == 0 and wports > 0 wait on waiting_receivers
+ * - raise error if interrupted or (count == 0 and wports == 0)
+ * - copy up to want values from buffer[ head ], advance head
+ * - signal waiting_senders
+ *
+ * sender:
+ * - lock the mutex
+ * - while count == capacity and rports > 0 wait on waiting_senders
+ * - raise error if interrupted or rports == 0
+ * - copy values to buffer[ (head+count) % capacity ] while there
+ *   is space left
+ * - signal waiting_receivers
+ * - repeat if there are values left
  */
 typedef struct {
   tinylheader ref;
@@ -131,16 +466,258 @@ typedef struct {
   cnd_t waiting_senders;
   cnd_t waiting_receivers;
   lua_State* L;  /* L of current receiver */
-  size_t rports;
-  size_t wports;
+  size_t want;  /* number of values the current receiver accepts */
+  tinylcount rports;
+  tinylcount wports;
+  size_t senders;  /* senders waiting for a receiver */
+  void* offer;  /* values of a waiting sender (a `copy_data*`) */
+  struct tinylwatcher* watchers;  /* threads waiting in `select` */
+  tinylcell* buffer;
+  size_t capacity;  /* the requested number of buffered values */
+  size_t size;  /* number of cells, a power of two for the lock-free
+                 * queue */
+#ifdef TLT_HAVE_ATOMICS
+  atomic_size_t enq_pos;
+  atomic_size_t deq_pos;
+  atomic_size_t parked_senders;
+  atomic_size_t parked_receivers;
+#else
+  size_t head;
+  size_t count;
+#endif
+  /* statistics */
+  tinylstat messages;
+  tinylstat bytes;  /* of strings and buffers */
+  tinylwaitstats wait;
 } tinylport_shared;
 
 /* port userdata type */
 typedef struct {
   tinylport_shared* s;
+  double timeout;  /* in seconds, negative for no timeout */
   char is_reader;
 } tinylport;
 
+/* readiness token yielded by the `yread`/`ywrite`/`ylock` methods
+ * (not shared, because ports and mutexes point to its watcher); the
+ * token keeps the port or mutex handle alive via its uservalue, and
+ * holds a reference to the shared part it is registered at, because
+ * the handle may be finalized first when the Lua state is closed */
+typedef struct {
+  tinylselect sel;
+  tinylwatcher w;
+  tinylport_shared* port;  /* where the token is registered */
+  tinylmutex_shared* mutex;
+  char is_reader;  /* the token waits for the reading end */
+  int count;  /* number of values written so far (`ywrite`) */
+} tinyltoken;
+
+
+
+/* shared part of a job handle
+ *
+ * `L` is a bare Lua state that holds the code and the arguments of
+ * the job until a worker picks it up, and the status flag and the
+ * return values after the job has finished. It is only accessed by
+ * the worker until `is_done` is set, and only with the job mutex
+ * held afterwards.
+ *
+ * Internal jobs (see `tlt.map`) set `run` instead: the worker calls
+ * it with its own Lua state, and the function takes care of its own
+ * completion. Those jobs don't use the reference count, the mutex and
+ * the condition variable. */
+typedef struct tinyljob_shared {
+  tinylheader ref;
+  mtx_t mutex;
+  cnd_t finished;
+  struct tinyljob_shared* next;  /* link for the job queue */
+  lua_State* L;
+  void (*run)( lua_State* L, struct tinyljob_shared* job );
+  void* ud;  /* extra data for `run` */
+  char is_done;
+} tinyljob_shared;
+
+/* job handle userdata type */
+typedef struct {
+  tinyljob_shared* s;
+} tinyljob;
+
+
+/* shared part of a future handle (see `tlt.async`)
+ *
+ * `L` is a bare Lua state that receives the status flag and the
+ * return values of the thread once it has finished. It is only
+ * accessed by the thread until `is_done` is set, and only with the
+ * future mutex held afterwards. The thread holds a reference to the
+ * future until then, and the future owns the thread: it is joined
+ * (and its Lua state closed) as soon as somebody notices that it is
+ * done, or when the future is collected. */
+typedef struct tinylfuture_shared {
+  tinylheader ref;
+  mtx_t mutex;
+  cnd_t finished;
+  lua_State* L;
+  struct tinylwatcher* watchers;  /* threads waiting in `wait_any` */
+  tinylthread_shared* thread;  /* NULL once joined */
+  char is_done;
+} tinylfuture_shared;
+
+/* future handle userdata type */
+typedef struct {
+  tinylfuture_shared* s;
+} tinylfuture;
+
+
+struct tinylpool_shared;
+
+/* a worker thread of a thread pool with its long-lived Lua state */
+typedef struct {
+  thrd_t thread;
+  lua_State* L;
+  struct tinylpool_shared* pool;
+} tinylworker;
+
+/* thread pool data (not shared, only the creating thread may submit
+ * jobs, but all workers access the job queue) */
+typedef struct tinylpool_shared {
+  mtx_t mutex;
+  cnd_t job_available;
+  tinyljob_shared* head;  /* job queue */
+  tinyljob_shared* tail;
+  tinylworker* workers;
+  size_t nworkers;
+  char is_closed;
+} tinylpool_shared;
+
+/* thread pool userdata type */
+typedef struct {
+  tinylpool_shared* s;
+} tinylpool;
+
+
+/* a task of a scheduler
+ *
+ * A new task holds its code and arguments in a bare Lua state `L`
+ * and sits in the deque of a worker until that worker (or another
+ * worker stealing it) starts it. A started task is a coroutine in the
+ * Lua state of its worker (and `L` is that coroutine). It stays with
+ * that worker, because coroutines can't move between Lua states.
+ * When a task would block on a buffered port or a mutex, it registers
+ * its watcher there and yields; the notification wakes up the worker
+ * which then resumes the task to try again. A task waiting with a
+ * timeout is also linked into the worker's list of timed tasks, and
+ * the worker resumes it when the deadline has passed. */
+typedef struct tinyltask {
+  tinylwatcher w;
+  struct tinyltask* next;  /* link in a deque, a ready list or the */
+  struct tinyltask* prev;  /* list of timed tasks */
+  lua_State* L;
+  tinylport* port;  /* the port or mutex the task is waiting for */
+  tinylmutex* mutex;
+  struct timespec deadline;
+  char has_deadline;
+  char is_timedout;
+} tinyltask;
+
+struct tinylsched_shared;
+
+/* a worker thread of a scheduler with its long-lived Lua state */
+typedef struct {
+  thrd_t thread;
+  lua_State* L;
+  struct tinylsched_shared* sched;
+  tinylselect sel;  /* the mutex also protects the deque and is_idle */
+  tinyltask* head;  /* deque of new tasks: the worker itself takes */
+  tinyltask* tail;  /* them from the tail, others steal the head */
+  tinyltask* ready;  /* started tasks that may continue (worker only) */
+  tinyltask* ready_tail;
+  tinyltask* current;  /* the running task (worker only) */
+  tinyltask* timed;  /* waiting tasks with a deadline (worker only) */
+  char is_idle;
+} tinylsworker;
+
+/* scheduler data (not shared, only the creating thread and the tasks
+ * may spawn new tasks) */
+typedef struct tinylsched_shared {
+  mtx_t mutex;
+  cnd_t done;  /* signaled when the last task has finished */
+  tinylsworker* workers;
+  size_t nworkers;
+  size_t ntasks;  /* tasks that haven't finished yet */
+  size_t next;  /* worker for the next task spawned from outside */
+  size_t nfailed;
+  size_t nexited;  /* workers of a detached scheduler that are done */
+  char* error;  /* error message of the first failed task */
+  char is_closed;
+  char is_detached;  /* the last worker frees the scheduler */
+} tinylsched_shared;
+
+/* scheduler userdata type */
+typedef struct {
+  tinylsched_shared* s;
+} tinylsched;
+
+
+
+/* shared part of a precompiled chunk handle (immutable) */
+typedef struct {
+  tinylheader ref;
+  size_t len;
+  char code[ 1 ];  /* the `lua_dump`ed byte code */
+} tinylchunk_shared;
+
+/* precompiled chunk handle userdata type */
+typedef struct {
+  tinylchunk_shared* s;
+} tinylchunk;
+
+
+
+/* shared part of a byte buffer (immutable) */
+typedef struct {
+  tinylheader ref;
+  size_t len;
+  char data[ 1 ];
+} tinylbuffer_shared;
+
+/* byte buffer userdata type (a view into the shared bytes) */
+typedef struct {
+  tinylbuffer_shared* s;
+  size_t offset;
+  size_t len;
+} tinylbuffer;
+
+
+
+/* element types of typed arrays */
+#define TLT_INT32   0
+#define TLT_INT64   1
+#define TLT_FLOAT   2
+#define TLT_DOUBLE  3
+
+/* shared part of a typed numeric array
+ *
+ * The elements are *not* protected by any lock: threads should work
+ * on disjoint slices or synchronize by other means. */
+typedef struct {
+  tinylheader ref;
+  size_t n;
+  int type;
+  union {
+    int32_t i32[ 1 ];
+    int64_t i64[ 1 ];
+    float f32[ 1 ];
+    double f64[ 1 ];
+  } data;
+} tinylarray_shared;
+
+/* typed array userdata type (a view into the shared elements) */
+typedef struct {
+  tinylarray_shared* s;
+  size_t offset;
+  size_t len;
+} tinylarray;
+
 
 
 /* a C API for other extension modules */